@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,64 +7,627 @@
 #include <dirent.h>
 #include <termios.h>
 #include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
 
 #define MAX_TABLE_NAME 50
 #define MAX_FIELD_NAME 30
 #define MAX_FIELDS 20
 #define MAX_RECORD_SIZE 4096
-#define MAX_QUERY_LENGTH 1024
+#define MAX_QUERY_LENGTH 8192
 #define TABLE_PREFIX "ODQ"
 #define HISTORY_SIZE 30
+#define TRIGRAM_INITIAL_SLOTS 4096
+#define FM_BLOCK 256
+#define FM_SAMPLE_RATE 32
+#define FM_ROW_SEPARATOR '\x01'
+#define MAX_AGGREGATE_THREADS 16
+#define AGGREGATE_CHUNK_ROWS 4096
+#define ORDER_SORT_MEMORY (64 * 1024 * 1024)
+#define ORDER_MERGE_BLOCK 256
+#define INDEX_RANGE_SELECTIVITY 4
+#define IN_LIST_POINT_LOOKUPS 512
+#define ROW_FETCH_BUFFER (256 * 1024)
+#define ROW_FETCH_GAP_PAGES 4
+#define ROW_FETCH_QUEUE_DEPTH 4
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_WORDS 1024
+#define HASH_BUCKET_SLOTS 8
+#define HASH_TAG_REMOVED 2
+#define BTREE_FANOUT 32
+#define LSM_MEMTABLE_ROWS 4096
+#define LSM_TIER_RUNS 4
+#define BENCH_DEFAULT_KEYS 200000
+#define ZONE_ROWS 65536
+#define BLOOM_WORDS (ZONE_ROWS * 8 / 64)
+#define BLOOM_HASHES 3
+#define SEGMENT_ROWS (16 * ZONE_ROWS)
+#define SEGMENT_IO_BUFFER (64 * 1024)
+#define BUFFER_POOL_DEFAULT_MB 64
+#define SCAN_CHUNK_BYTES (1024 * 1024)
+#define SCAN_QUEUE_DEPTH 4
+#define ASYNC_RING_ENTRIES 16
+#define ASYNC_READ_THREADS 4
+#define TABLE_MAGIC "ODQTBL1"
+#define TABLE_FORMAT_VERSION 2
+#define TABLE_HEADER_BYTES 4096
+#define SEGMENT_HEADER_BYTES 4096
+#define PAGE_MIN_BYTES 4096
+#define PAGE_MAX_BYTES 16384
 
 // Структуры данных
 typedef enum { FIELD_INT, FIELD_TEXT, FIELD_BOOL } FieldType;
+// Per-field index kind, chosen by a CREATE TABLE column modifier:
+// "noindex" leaves a field unindexed, "bitmap" suits low-cardinality fields,
+// "hash" equality-only keys such as ids, "btree" swaps the AVL tree for a B+tree,
+// "lsm" buffers inserts in a memtable merged into sorted runs for write-heavy tables
+// and "bloom" keeps only a per-block Bloom filter in the zone map
+typedef enum { INDEX_AVL, INDEX_NONE, INDEX_BITMAP, INDEX_HASH, INDEX_BTREE, INDEX_BLOOM, INDEX_LSM } IndexKind;
+typedef enum { TEXT_INDEX_NONE, TEXT_INDEX_TRIGRAM, TEXT_INDEX_FM } TextIndexKind;
 
 typedef struct {
     char name[MAX_FIELD_NAME];
     FieldType type;
     int size;
+    TextIndexKind text_index;
+    IndexKind index;
 } Field;
 
 typedef struct AVLNode {
     char key[256];
     long file_position;
+    long* duplicates;
+    int duplicate_count;
+    int duplicate_capacity;
+    long size;
     struct AVLNode* left;
     struct AVLNode* right;
     int height;
 } AVLNode;
 
+typedef struct {
+    long* items;
+    long count;
+    long capacity;
+} PositionList;
+
+// LIMIT n OFFSET m; a negative limit returns every row
+typedef struct {
+    long limit;
+    long offset;
+    long skipped;
+    long returned;
+} RowLimit;
+
+// Posting list of one trigram; trigram 0 marks an empty slot
+typedef struct {
+    unsigned int trigram;
+    int count;
+    int capacity;
+    long* positions;
+} TrigramPosting;
+
+typedef struct {
+    TrigramPosting* slots;
+    int slot_count;
+    int used;
+    long indexed_rows;
+    bool dirty;
+} TrigramIndex;
+
+// On-disk layout of an FM-index file. Sections follow the header at the
+// recorded offsets so the whole file can be used straight from mmap.
+typedef struct {
+    char magic[8];
+    long first_row;
+    long indexed_rows;
+    long text_length;
+    long counts[257];
+    unsigned char symbol_of[256];
+    int sigma;
+    int block;
+    int sample_rate;
+    long bwt_offset;
+    long occ_offset;
+    long sampled_offset;
+    long sampled_rank_offset;
+    long samples_offset;
+    long rows_offset;
+    long file_size;
+} FMHeader;
+
+typedef struct {
+    void* map;
+    size_t map_size;
+    const FMHeader* header;
+    const unsigned char* bwt;
+    const uint32_t* occ;
+    const uint64_t* sampled;
+    const uint32_t* sampled_rank;
+    const uint32_t* samples;
+    const uint32_t* row_starts;
+} FMIndex;
+
+// Roaring-style bitmap of row numbers: one container per 65536 rows, kept
+// as a sorted array while sparse and as a plain bitset once dense
+typedef struct {
+    uint32_t key;
+    int cardinality;
+    uint16_t* array;
+    uint64_t* bits;
+} RoaringContainer;
+
+typedef struct {
+    RoaringContainer* containers;
+    int count;
+    int capacity;
+} Roaring;
+
+typedef enum { ROARING_AND, ROARING_OR, ROARING_AND_NOT } RoaringOperation;
+
+// One bitmap per distinct key
+typedef struct {
+    char key[256];
+    Roaring rows;
+} BitmapValue;
+
+typedef struct {
+    BitmapValue* values;
+    int count;
+    int capacity;
+} BitmapIndex;
+
+// Open-addressing hash index probed a cache line at a time. A bucket holds
+// 8 key tags and their row numbers; tag 0 marks a free slot. Live tags are
+// odd, so HASH_TAG_REMOVED keeps probe chains intact after an UPDATE until
+// the next rehash. Keys are not stored, so tag matches are verified against
+// the record by the caller.
+typedef struct {
+    uint32_t tags[HASH_BUCKET_SLOTS];
+    uint32_t rows[HASH_BUCKET_SLOTS];
+} __attribute__((aligned(64))) HashBucket;
+
+typedef struct {
+    HashBucket* buckets;
+    int bucket_bits;
+    long used;
+    long indexed_rows;
+    bool dirty;
+} HashIndex;
+
+// Int keys are stored inline; text and bool keys point to a copy of the string
+typedef union {
+    long number;
+    char* text;
+} BTreeKey;
+
+// B+tree node. Keys sit in one contiguous array so a node search touches a
+// handful of cache lines instead of one line per level. Entries are ordered
+// by (key, row position): leaves hold row positions, inner nodes the
+// position that goes with each separator. Inner nodes keep the number of
+// rows under each child for rank queries; leaves are chained both ways for
+// range scans and ordered walks.
+typedef struct BTreeNode {
+    bool leaf;
+    int count;
+    BTreeKey keys[BTREE_FANOUT + 1];
+    long positions[BTREE_FANOUT + 1];
+    union {
+        struct {
+            struct BTreeNode* children[BTREE_FANOUT + 2];
+            long sizes[BTREE_FANOUT + 2];
+        };
+        struct {
+            struct BTreeNode* prev;
+            struct BTreeNode* next;
+        };
+    };
+} BTreeNode;
+
+typedef struct {
+    BTreeNode* root;
+    FieldType type;
+    long size;
+} BTree;
+
+typedef struct {
+    BTreeKey key;
+    long position;
+} LsmEntry;
+
+typedef struct {
+    LsmEntry* entries;
+    long count;
+} LsmRun;
+
+// Log-structured ordered index for write-heavy tables. Inserts append to
+// an in-memory memtable that is sorted into an immutable run once it holds
+// LSM_MEMTABLE_ROWS entries; runs are merged in the background, size
+// tiered: LSM_TIER_RUNS runs of one tier become one run of the next.
+// Readers see the memtable and every run; the lock keeps them apart from
+// the merging thread.
+typedef struct {
+    FieldType type;
+    LsmRun memtable;
+    bool memtable_sorted;
+    LsmRun* runs;
+    int run_count;
+    int run_capacity;
+    long size;
+    bool merging;
+    pthread_mutex_t lock;
+    pthread_cond_t merged;
+} LsmIndex;
+
+// Min and max of every int field over one block of ZONE_ROWS rows, so that
+// scans can skip blocks a range predicate rules out
+typedef struct {
+    int min[MAX_FIELDS];
+    int max[MAX_FIELDS];
+} Zone;
+
+// blooms[field] holds BLOOM_WORDS words per block for bloom fields (8 bits
+// per row, about 3% false positives on a full block) and is NULL otherwise
+typedef struct {
+    Zone* zones;
+    uint64_t* blooms[MAX_FIELDS];
+    long count;
+    long indexed_rows;
+    bool dirty;
+} ZoneMap;
+
+// Written at the start of every segment file and zero padded to
+// SEGMENT_HEADER_BYTES, so that the pages behind it stay aligned
+typedef struct {
+    char magic[8];
+    long segment;
+    long first_row;
+    int record_size;
+    int page_size;
+    int page_records;
+    long created;
+} SegmentHeader;
+
+// Rows are stored in pages of page_size bytes holding page_records rows
+// each, so no row straddles a page. The checksum covers the rest of the
+// page, slot_count is the number of rows written so far and first_row
+// catches pages read from the wrong place.
+typedef struct {
+    uint32_t checksum;
+    uint16_t slot_count;
+    uint16_t reserved;
+    int64_t first_row;
+} PageHeader;
+
+// On-disk table header: fixed-width fields only, so files do not depend on
+// the in-memory Table layout. It is zero padded to TABLE_HEADER_BYTES and
+// the rows start at that page-aligned offset.
+typedef struct {
+    char name[32];
+    uint32_t offset;
+    uint32_t size;
+    uint8_t type;
+    uint8_t index;
+    uint8_t text_index;
+    uint8_t reserved[5];
+} DiskField;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t checksum;
+    uint32_t header_bytes;
+    uint32_t field_count;
+    uint32_t record_size;
+    uint32_t page_size;
+    uint32_t page_records;
+    int32_t auto_increment;
+    char name[64];
+    int64_t row_count;
+    int64_t segment_rows;
+    int64_t first_row;
+    int64_t retention_days;
+    int64_t retention_rows;
+    DiskField fields[MAX_FIELDS];
+} TableHeader;
+
+_Static_assert(sizeof(TableHeader) <= TABLE_HEADER_BYTES, "table header does not fit its page");
+_Static_assert(sizeof(SegmentHeader) <= SEGMENT_HEADER_BYTES, "segment header does not fit its page");
+_Static_assert(MAX_RECORD_SIZE + sizeof(PageHeader) <= PAGE_MAX_BYTES, "records do not fit the largest page");
+_Static_assert(MAX_FIELD_NAME <= 32 && MAX_TABLE_NAME <= 64, "names do not fit the table header");
+
+// Fixed set of page frames in front of the segment files, evicted by CLOCK.
+// Frames are found through chained buckets keyed by the global page number;
+// pages[frame] is -1 for a free frame. Misses count pages loaded from disk.
+typedef struct {
+    char* memory;
+    int page_size;
+    long frame_count;
+    long* pages;
+    long* next;
+    unsigned char* referenced;
+    long* buckets;
+    long bucket_mask;
+    long hand;
+    long used;
+    long hits;
+    long misses;
+    long evictions;
+    pthread_mutex_t lock;
+} BufferPool;
+
+// Storage of a segmented table: the Table header stays in ODQ_<name>.bin and
+// the rows go to ODQ_<name>.seg/<n>.seg, segment_rows rows per file. The
+// rest of the code sees one FILE with the single-file positions; segment
+// files are opened on first access, so skipped blocks are never touched.
+// page caches the page last written, the newest one while appending.
+// damaged_pages counts the pages that failed their checksum since opening.
+typedef struct {
+    char directory[150];
+    int header_fd;
+    int record_size;
+    int page_size;
+    int page_records;
+    long segment_rows;
+    char* page;
+    long page_number;
+    BufferPool* pool;
+    int* segment_fds;
+    long segment_capacity;
+    long data_bytes;
+    long offset;
+    long damaged_pages;
+    pthread_mutex_t lock;
+} SegmentStore;
+
 typedef struct {
     char name[MAX_TABLE_NAME];
     char filename[100];
     Field fields[MAX_FIELDS];
     int field_count;
     int record_size;
+    int page_size;
+    int page_records;
     AVLNode* indexes[MAX_FIELDS];
+    BTree* btrees[MAX_FIELDS];
+    LsmIndex* lsm_indexes[MAX_FIELDS];
+    TrigramIndex* trigram_indexes[MAX_FIELDS];
+    FMIndex* fm_indexes[MAX_FIELDS];
+    BitmapIndex* bitmap_indexes[MAX_FIELDS];
+    HashIndex* hash_indexes[MAX_FIELDS];
+    ZoneMap* zone_map;
+    Roaring* tombstones;
     int auto_increment;
+    long row_count;
+    long segment_rows;
+    long first_row;
+    long retention_days;
+    long retention_rows;
+    SegmentStore* segments;
     FILE* data_file;
 } Table;
 
+// One read handed to the async layer; done is set once result is known
+typedef struct AsyncRead {
+    int fd;
+    char* buffer;
+    size_t length;
+    long offset;
+    ssize_t result;
+    bool done;
+    struct AsyncRead* next;
+} AsyncRead;
+
+// Reads go through io_uring when the kernel allows it (ring_fd >= 0) and
+// to a queue served by ASYNC_READ_THREADS pread threads otherwise
+typedef struct {
+    int ring_fd;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+#ifdef HAVE_IO_URING
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+#endif
+    AsyncRead* queue;
+    AsyncRead* queue_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t requested;
+    pthread_cond_t completed;
+} AsyncIO;
+
+// Rows [first_row, end_row) of a scan, read as the whole pages holding them
+typedef struct {
+    AsyncRead read;
+    long first_row;
+    long end_row;
+    long first_page;
+    bool pending;
+    bool ready;
+} ScanChunk;
+
+// Values of an IN (...) list, deduplicated through an open-addressed hash
+// set; slots hold value index + 1 and 0 marks an empty slot
+typedef struct {
+    char** values;
+    int count;
+    int* slots;
+    int slot_count;
+} InList;
+
 typedef struct {
     char field_name[MAX_FIELD_NAME];
     char operator[10];
     char value[100];
+    char value2[100];
+    InList* in_list;
+    bool negated;
     bool is_and;
 } WhereCondition;
 
+// Sequential scan keeping SCAN_QUEUE_DEPTH chunk reads in flight, so that
+// predicates run on one chunk while the following ones are being read.
+// With conditions, chunks end at zone map blocks and ruled out blocks are
+// never requested. Pages are verified as the scan enters them; a damaged
+// page is reported and its rows skipped. with_deleted also yields deleted
+// rows.
+typedef struct {
+    ScanChunk chunks[SCAN_QUEUE_DEPTH];
+    char* memory;
+    long chunk_rows;
+    long chunk_bytes;
+    int head;
+    long next_row;
+    long end_row;
+    long row;
+    long checked_page;
+    bool page_valid;
+    bool with_deleted;
+    WhereCondition* conditions;
+    int condition_count;
+} TableScan;
+
+// Positions [begin, end) of a row fetch, held by the page_count whole pages
+// in buffer from first_page on. Pages found in the buffer pool are copied
+// and flagged in cached; one read from read_page covers the others.
+typedef struct {
+    AsyncRead read;
+    char* buffer;
+    char* cached;
+    long begin;
+    long end;
+    long first_page;
+    long page_count;
+    long read_page;
+    long pages;
+    bool pending;
+    bool ready;
+} FetchRange;
+
+// Fetches the rows of an ascending position list. Positions whose pages lie
+// at most ROW_FETCH_GAP_PAGES apart form one range read as whole pages, so
+// dense matches cost sequential reads; ROW_FETCH_QUEUE_DEPTH ranges are in
+// flight at once, so sparse matches do not wait for one read per row.
+// Pages held by the buffer pool are served from it.
+typedef struct {
+    FetchRange ranges[ROW_FETCH_QUEUE_DEPTH];
+    const long* positions;
+    long count;
+    long next;
+    long planned;
+    int head;
+    char* memory;
+    long range_pages;
+    long checked_page;
+    bool page_valid;
+} RowFetch;
+
+// Key interval on an ordered index; a missing bound is open-ended
+typedef struct {
+    char lower[256];
+    char upper[256];
+    bool has_lower;
+    bool has_upper;
+    bool lower_inclusive;
+    bool upper_inclusive;
+} KeyRange;
+
+typedef enum { AGG_COUNT, AGG_SUM, AGG_AVG, AGG_MIN, AGG_MAX } AggregateFunction;
+
+typedef struct {
+    AggregateFunction function;
+    int field_index;
+    int offset;
+} AggregateColumn;
+
+typedef struct {
+    long long sum;
+    int min;
+    int max;
+} AggregateState;
+
+// Output columns refer either to a group field (>= 0) or to aggregate -(n + 1)
+typedef struct {
+    int group_fields[MAX_FIELDS];
+    int group_offsets[MAX_FIELDS];
+    int group_count;
+    int key_size;
+    AggregateColumn aggregates[MAX_FIELDS];
+    int aggregate_count;
+    int output[MAX_FIELDS];
+    int output_count;
+} AggregatePlan;
+
+// Open addressing group table; a slot with zero rows is empty
+typedef struct {
+    unsigned char* keys;
+    long* counts;
+    AggregateState* states;
+    long capacity;
+    long used;
+} GroupTable;
+
 typedef struct {
     char table1[MAX_TABLE_NAME];
     char table2[MAX_TABLE_NAME];
     char field1[MAX_FIELD_NAME];
     char field2[MAX_FIELD_NAME];
     char join_type[20];
+    RowLimit limit;
 } JoinInfo;
 
+typedef struct {
+    char field_name[MAX_FIELD_NAME];
+    bool descending;
+} OrderBy;
+
+// One sort entry is the row position followed by the record. Unbounded
+// sorts spill sorted runs to a temp file and merge them block by block.
+typedef struct {
+    long next;
+    long end;
+    long loaded;
+    long used;
+    char* block;
+} SortRun;
+
+typedef struct {
+    long entry_size;
+    long capacity;
+    long count;
+    char* buffer;
+    char** heap;
+    bool bounded;
+    FILE* spill;
+    SortRun* runs;
+    int run_count;
+} OrderSort;
+
 // Глобальные переменные
 Table current_table;
 bool table_loaded = false;
 char command_history[HISTORY_SIZE][MAX_QUERY_LENGTH];
 int history_count = 0;
 int history_current = -1;
+long buffer_pool_megabytes = BUFFER_POOL_DEFAULT_MB;
 struct termios orig_termios;
 
 // Прототипы функций
@@ -72,33 +636,195 @@ void enable_raw_mode();
 void add_to_history(const char* command);
 const char* get_history_command(int direction);
 int height(AVLNode* node);
+long subtreeSize(AVLNode* node);
 int max(int a, int b);
+int compare_keys(const char* a, const char* b, FieldType type);
 AVLNode* newAVLNode(const char* key, long position);
+void freeAVL(AVLNode* node);
 AVLNode* rightRotate(AVLNode* y);
 AVLNode* leftRotate(AVLNode* x);
 int getBalance(AVLNode* node);
-AVLNode* insertAVL(AVLNode* node, const char* key, long position);
-AVLNode* searchAVL(AVLNode* root, const char* key);
+AVLNode* insertAVL(AVLNode* node, const char* key, long position, FieldType type);
+AVLNode* searchAVL(AVLNode* root, const char* key, FieldType type);
+AVLNode* deleteAVL(AVLNode* node, const char* key, long position, FieldType type);
+long countLessAVL(AVLNode* root, const char* key, FieldType type, bool inclusive);
+AVLNode* selectAVL(AVLNode* root, long k);
+long countRangeAVL(AVLNode* root, const KeyRange* range, FieldType type);
+void rangeAVL(AVLNode* node, const KeyRange* range, FieldType type, PositionList* out);
 void searchTextInAVL(AVLNode* root, const char* search_text, long** results, int* count);
+int compare_positions(const void* a, const void* b);
+void position_list_add(PositionList* list, long position);
+void position_list_intersect(PositionList* list, const PositionList* other);
+bool parse_limit_clause(char* query, RowLimit* limit);
+bool row_limit_take(RowLimit* limit);
+bool row_limit_done(const RowLimit* limit);
+bool parse_order_clause(char* query, OrderBy* order);
+bool walkAVL(AVLNode* node, bool descending, bool (*visit)(long position, void* context), void* context);
+AVLNode* pruneAVL(AVLNode* root, long from, long to);
+BTree* btree_create(FieldType type);
+void btree_free(BTree* tree);
+void btree_insert(BTree* tree, const char* key, long position);
+long btree_count_less(const BTree* tree, const char* key, bool inclusive);
+long btree_count_range(const BTree* tree, const KeyRange* range);
+void btree_range(const BTree* tree, const KeyRange* range, PositionList* out);
+bool btree_select(const BTree* tree, long k, char* key, size_t size);
+bool btree_walk(const BTree* tree, bool descending, bool (*visit)(long position, void* context), void* context);
+void btree_prune(BTree* tree, long from, long to);
+bool btree_delete(BTree* tree, const char* key, long position);
+LsmIndex* lsm_create(FieldType type);
+void lsm_insert(LsmIndex* index, const char* key, long position);
+bool lsm_delete(LsmIndex* index, const char* key, long position);
+void lsm_prune(LsmIndex* index, long from, long to);
+void lsm_free(LsmIndex* index);
+long lsm_count_less(LsmIndex* index, const char* key, bool inclusive);
+long lsm_count_range(LsmIndex* index, const KeyRange* range);
+void lsm_range(LsmIndex* index, const KeyRange* range, PositionList* out);
+bool lsm_select(LsmIndex* index, long k, char* key, size_t size);
+bool lsm_walk(LsmIndex* index, bool descending, bool (*visit)(long position, void* context), void* context);
+bool ordered_index(int field_index);
+void ordered_insert(int field_index, const char* key, long position);
+bool ordered_delete(int field_index, const char* key, long position);
+long ordered_size(int field_index);
+long ordered_count_less(int field_index, const char* key, bool inclusive);
+long ordered_count_range(int field_index, const KeyRange* range);
+void ordered_range(int field_index, const KeyRange* range, PositionList* out);
+bool ordered_select(int field_index, long k, char* key, size_t size);
+bool ordered_walk(int field_index, bool descending, bool (*visit)(long position, void* context), void* context);
+void bench_index(long key_count);
+long select_ordered(const int* selected_columns, int selected_count, WhereCondition* conditions,
+                    int condition_count, OrderBy order, RowLimit* limit);
+TrigramIndex* trigram_index_create();
+void trigram_index_free(TrigramIndex* index);
+void trigram_index_add(TrigramIndex* index, const char* text, int size, long position);
+void trigram_index_remove(TrigramIndex* index, const char* text, int size, long position);
+bool trigram_candidates(TrigramIndex* index, const char* literal, int length, PositionList* out);
+bool trigram_index_save(TrigramIndex* index, const char* filename);
+TrigramIndex* trigram_index_load(const char* filename, long expected_rows);
+void trigram_index_prune(TrigramIndex* index, long from, long to);
+bool fm_index_build(int field_index, const char* filename);
+FMIndex* fm_index_open(const char* filename);
+void fm_index_close(FMIndex* index);
+long fm_count(const FMIndex* index, const char* pattern, int length);
+void fm_candidates(const FMIndex* index, const char* pattern, int length, PositionList* out);
+bool text_index_candidates(int field_index, const char* literal, int length, PositionList* out);
+bool like_match(const char* text, const char* pattern);
 void create_table(const char* table_name, const char* field_definitions);
 bool load_table(const char* table_name);
+void close_table();
+void save_table_header();
+void save_row_count();
+uint32_t crc32c(const void* data, size_t size);
+void table_header_encode(const Table* table, char* page);
+bool table_header_decode(const char* page, Table* table);
+bool condition_key_range(const WhereCondition* condition, FieldType type, KeyRange* range, bool* exact);
+void key_range_intersect(KeyRange* range, const KeyRange* other, FieldType type);
+bool index_count_conditions(WhereCondition* conditions, int condition_count, long* result);
+long table_row_count();
+bool read_record_at(long position, char* record);
+void row_fetch_begin(RowFetch* fetch, const PositionList* positions);
+bool row_fetch_next(RowFetch* fetch, long* position, char** record);
+void row_fetch_end(RowFetch* fetch);
+void segment_directory(char* out, size_t size, const char* table_name);
+FILE* segment_store_open(const Table* table, SegmentStore** store_out);
+BufferPool* buffer_pool_create(long bytes, int page_size);
+bool buffer_pool_copy(BufferPool* pool, long page, long from, long length, char* out);
+void buffer_pool_put(BufferPool* pool, long page, const char* data, bool referenced);
+void buffer_pool_update(BufferPool* pool, long page, const char* data);
+void buffer_pool_clear(BufferPool* pool);
+void buffer_pool_free(BufferPool* pool);
+void set_buffer_pool(long megabytes);
+void show_buffer_pool();
+void async_read_submit(AsyncRead* read);
+void async_read_wait(AsyncRead* read);
+void table_scan_begin(TableScan* scan, WhereCondition* conditions, int condition_count);
+bool table_scan_next(TableScan* scan, long* row, char** record);
+void table_scan_end(TableScan* scan);
+FILE* open_table_file(const Table* table);
+ssize_t table_pread(void* buffer, size_t size, long position);
+ssize_t table_pwrite(const void* buffer, size_t size, long position);
+long table_data_start();
+void apply_retention();
+void set_retention(long amount, const char* unit);
+void index_filename(char* out, size_t size, int field_index, const char* extension);
+long row_position(long row);
+long position_row(long position);
+void roaring_add(Roaring* bitmap, long row);
+void roaring_combine(Roaring* bitmap, const Roaring* other, RoaringOperation operation);
+long roaring_cardinality(const Roaring* bitmap);
+void roaring_positions(const Roaring* bitmap, PositionList* out);
+void roaring_free(Roaring* bitmap);
+bool roaring_contains(const Roaring* bitmap, long row);
+void roaring_remove(Roaring* bitmap, long row);
+long roaring_first(const Roaring* bitmap);
+void roaring_trim(Roaring* bitmap, long first_row, long end_row);
+bool roaring_save(const Roaring* bitmap, FILE* file);
+bool roaring_load(Roaring* bitmap, FILE* file);
+void bitmap_index_add(BitmapIndex* index, const char* key, long row);
+void bitmap_index_remove(BitmapIndex* index, const char* key, long row);
+void bitmap_index_free(BitmapIndex* index);
+void bitmap_index_prune(BitmapIndex* index, long first_row, long end_row);
+bool bitmap_condition(const WhereCondition* condition, Roaring* out);
+bool bitmap_evaluate(WhereCondition* conditions, int condition_count, Roaring* out);
+HashIndex* hash_index_create(int bucket_bits);
+void hash_index_add(HashIndex* index, const char* key, long row);
+void hash_index_lookup(const HashIndex* index, const char* key, PositionList* out);
+void hash_index_remove(HashIndex* index, const char* key, long row);
+bool hash_index_save(HashIndex* index, const char* filename);
+HashIndex* hash_index_load(const char* filename, long expected_rows);
+void hash_index_free(HashIndex* index);
+void hash_index_prune(HashIndex* index, long first_row, long end_row);
+void zone_map_add(ZoneMap* map, long row, const char* record);
+bool zone_map_save(ZoneMap* map, const char* filename);
+ZoneMap* zone_map_load(const char* filename, long expected_rows);
+void zone_map_free(ZoneMap* map);
+bool zone_may_match(long block, WhereCondition* conditions, int condition_count);
+long zone_next_row(long row, WhereCondition* conditions, int condition_count);
+void zone_filename(char* out, size_t size);
+void tombstone_filename(char* out, size_t size, const char* table_name);
+Roaring* tombstones_load(const char* table_name);
+void tombstones_save();
+bool row_deleted(long row);
+bool has_tombstones();
+void index_add_record(const char* record, long position);
+void delete_rows(const char* where_clause);
+void update_rows(const char* assignments, const char* where_clause);
+void vacuum_table();
+void create_text_index(const char* field_name, TextIndexKind kind);
+void count_text(const char* search_text, const char* field_name);
+void store_field_value(const Field* field, const char* value, char* slot);
 void insert_into_table(const char* values);
 void select_all();
 void select_field(const char* field_name);
 bool compare_values(const char* field_value, const char* operator, const char* compare_value, FieldType field_type);
 WhereCondition* parse_where_conditions(const char* where_clause, int* condition_count);
+void free_where_conditions(WhereCondition* conditions, int condition_count);
+InList* in_list_parse(const char* text, FieldType type);
+bool in_list_contains(const InList* list, const char* value);
+void in_list_free(InList* list);
+static uint64_t group_key_hash(const unsigned char* key, int size);
+bool condition_matches_value(const WhereCondition* condition, const char* value, FieldType type);
 bool check_single_condition(char* record, WhereCondition* condition);
 bool check_complex_conditions(char* record, WhereCondition* conditions, int condition_count);
 void select_where(const char* field_name, const char* operator, const char* value);
-void find_text(const char* search_text);
+void print_record(const char* record);
+void print_selected_columns(const char* record, const int* selected_columns, int selected_count);
+bool plan_index_candidates(WhereCondition* conditions, int condition_count, PositionList* out);
+bool slot_contains(const char* slot, int size, const char* needle, int needle_len);
+bool record_contains_text(const char* record, const char* search_text);
+bool text_search_candidates(const char* search_text, PositionList* out);
+void find_text(const char* search_text, RowLimit limit);
 void load_macro(const char* filename);
-void select_columns(const char* columns, const char* where_clause);
+void select_columns(const char* columns, const char* where_clause, OrderBy order, RowLimit limit);
 void select_count(const char* where_clause);
+bool parse_aggregate_plan(const char* columns, const char* group_clause, AggregatePlan* plan);
+void select_aggregate(const char* columns, const char* where_clause, const char* group_clause, RowLimit limit);
+void record_field_key(const char* record, int field_index, char* key, size_t size);
+void select_order_statistic(const char* expression, const char* where_clause);
 bool load_table_from_file(const char* filename, Table* table);
-void inner_join(Table* table1, Table* table2, const char* field1, const char* field2);
-void left_join(Table* table1, Table* table2, const char* field1, const char* field2);
-void right_join(Table* table1, Table* table2, const char* field1, const char* field2);
-void full_join(Table* table1, Table* table2, const char* field1, const char* field2);
+void inner_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit);
+void left_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit);
+void right_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit);
+void full_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit);
 void perform_join(JoinInfo* join_info);
 void process_command(const char* command);
 char* read_command_with_history();
@@ -155,19 +881,45 @@ int height(AVLNode* node) {
     return node ? node->height : 0;
 }
 
+// Rows stored in the subtree, counting every duplicate of a key
+long subtreeSize(AVLNode* node) {
+    return node ? node->size : 0;
+}
+
 int max(int a, int b) {
     return (a > b) ? a : b;
 }
 
+// Int keys are kept as decimal strings but ordered numerically
+int compare_keys(const char* a, const char* b, FieldType type) {
+    if (type == FIELD_INT) {
+        long x = atol(a), y = atol(b);
+        return (x > y) - (x < y);
+    }
+    return strcmp(a, b);
+}
+
 AVLNode* newAVLNode(const char* key, long position) {
     AVLNode* node = (AVLNode*)malloc(sizeof(AVLNode));
     strncpy(node->key, key, sizeof(node->key));
     node->file_position = position;
+    node->duplicates = NULL;
+    node->duplicate_count = 0;
+    node->duplicate_capacity = 0;
+    node->size = 1;
     node->left = node->right = NULL;
     node->height = 1;
     return node;
 }
 
+void freeAVL(AVLNode* node) {
+    if (!node) return;
+    freeAVL(node->left);
+    freeAVL(node->right);
+    free(node->duplicates);
+    free(node);
+}
+
 AVLNode* rightRotate(AVLNode* y) {
     AVLNode* x = y->left;
     AVLNode* T2 = x->right;
@@ -175,6 +927,8 @@ AVLNode* rightRotate(AVLNode* y) {
     y->left = T2;
     y->height = max(height(y->left), height(y->right)) + 1;
     x->height = max(height(x->left), height(x->right)) + 1;
+    y->size = subtreeSize(y->left) + subtreeSize(y->right) + 1 + y->duplicate_count;
+    x->size = subtreeSize(x->left) + subtreeSize(x->right) + 1 + x->duplicate_count;
     return x;
 }
 
@@ -185,6 +939,8 @@ AVLNode* leftRotate(AVLNode* x) {
     x->right = T2;
     x->height = max(height(x->left), height(x->right)) + 1;
     y->height = max(height(y->left), height(y->right)) + 1;
+    x->size = subtreeSize(x->left) + subtreeSize(x->right) + 1 + x->duplicate_count;
+    y->size = subtreeSize(y->left) + subtreeSize(y->right) + 1 + y->duplicate_count;
     return y;
 }
 
@@ -192,733 +948,6796 @@ int getBalance(AVLNode* node) {
     return node ? height(node->left) - height(node->right) : 0;
 }
 
-AVLNode* insertAVL(AVLNode* node, const char* key, long position) {
+AVLNode* insertAVL(AVLNode* node, const char* key, long position, FieldType type) {
     if (!node) return newAVLNode(key, position);
     
-    int cmp = strcmp(key, node->key);
-    if (cmp < 0) node->left = insertAVL(node->left, key, position);
-    else if (cmp > 0) node->right = insertAVL(node->right, key, position);
-    else return node;
+    int cmp = compare_keys(key, node->key, type);
+    if (cmp < 0) node->left = insertAVL(node->left, key, position, type);
+    else if (cmp > 0) node->right = insertAVL(node->right, key, position, type);
+    else {
+        // Equal keys share a node; extra rows go to the duplicate list, kept
+        // in file order behind file_position. Loads append; UPDATE may not.
+        if (node->duplicate_count == node->duplicate_capacity) {
+            node->duplicate_capacity = node->duplicate_capacity ? node->duplicate_capacity * 2 : 4;
+            node->duplicates = realloc(node->duplicates, node->duplicate_capacity * sizeof(long));
+        }
+        if (position < node->file_position) {
+            long first = node->file_position;
+            node->file_position = position;
+            position = first;
+        }
+        int slot = node->duplicate_count;
+        while (slot > 0 && node->duplicates[slot - 1] > position) slot--;
+        memmove(&node->duplicates[slot + 1], &node->duplicates[slot], (node->duplicate_count - slot) * sizeof(long));
+        node->duplicates[slot] = position;
+        node->duplicate_count++;
+        node->size++;
+        return node;
+    }
     
     node->height = 1 + max(height(node->left), height(node->right));
+    node->size = subtreeSize(node->left) + subtreeSize(node->right) + 1 + node->duplicate_count;
     int balance = getBalance(node);
     
-    if (balance > 1 && strcmp(key, node->left->key) < 0)
+    if (balance > 1 && compare_keys(key, node->left->key, type) < 0)
         return rightRotate(node);
-    if (balance < -1 && strcmp(key, node->right->key) > 0)
+    if (balance < -1 && compare_keys(key, node->right->key, type) > 0)
         return leftRotate(node);
-    if (balance > 1 && strcmp(key, node->left->key) > 0) {
+    if (balance > 1 && compare_keys(key, node->left->key, type) > 0) {
         node->left = leftRotate(node->left);
         return rightRotate(node);
     }
-    if (balance < -1 && strcmp(key, node->right->key) < 0) {
+    if (balance < -1 && compare_keys(key, node->right->key, type) < 0) {
         node->right = rightRotate(node->right);
         return leftRotate(node);
     }
     return node;
 }
 
-AVLNode* searchAVL(AVLNode* root, const char* key) {
-    if (!root || strcmp(root->key, key) == 0) return root;
-    if (strcmp(key, root->key) < 0) return searchAVL(root->left, key);
-    return searchAVL(root->right, key);
+static AVLNode* rebalanceAVL(AVLNode* node) {
+    node->height = 1 + max(height(node->left), height(node->right));
+    node->size = subtreeSize(node->left) + subtreeSize(node->right) + 1 + node->duplicate_count;
+    int balance = getBalance(node);
+    if (balance > 1) {
+        if (getBalance(node->left) < 0) node->left = leftRotate(node->left);
+        return rightRotate(node);
+    }
+    if (balance < -1) {
+        if (getBalance(node->right) > 0) node->right = rightRotate(node->right);
+        return leftRotate(node);
+    }
+    return node;
 }
 
-void searchTextInAVL(AVLNode* root, const char* search_text, long** results, int* count) {
-    if (!root) return;
-    if (strstr(root->key, search_text) != NULL) {
-        *results = realloc(*results, (*count + 1) * sizeof(long));
-        (*results)[*count] = root->file_position;
-        (*count)++;
+// Unlinks the leftmost node of the subtree without freeing it
+static AVLNode* detachMinAVL(AVLNode* node, AVLNode** min) {
+    if (!node->left) {
+        *min = node;
+        return node->right;
     }
-    searchTextInAVL(root->left, search_text, results, count);
-    searchTextInAVL(root->right, search_text, results, count);
+    node->left = detachMinAVL(node->left, min);
+    return rebalanceAVL(node);
 }
 
-// Table functions
-void create_table(const char* table_name, const char* field_definitions) {
-    char filename[100];
-    snprintf(filename, sizeof(filename), "%s_%s.bin", TABLE_PREFIX, table_name);
-    
-    FILE* file = fopen(filename, "wb");
-    if (!file) {
-        printf("Error creating table\n");
-        return;
-    }
-    
-    Table table;
-    strcpy(table.name, table_name);
-    strcpy(table.filename, filename);
-    table.field_count = 0;
-    table.record_size = 0;
-    table.auto_increment = 1;
-    table.data_file = NULL;
-    for (int i = 0; i < MAX_FIELDS; i++) table.indexes[i] = NULL;
-    
-    char def_copy[MAX_QUERY_LENGTH];
-    strcpy(def_copy, field_definitions);
-    char* token = strtok(def_copy, ",");
+// Removes one row. A node goes away with its last row: a node with two
+// children is replaced by its in-order successor, and every node on the
+// path is rebalanced on the way back up. Unknown rows are ignored.
+AVLNode* deleteAVL(AVLNode* node, const char* key, long position, FieldType type) {
+    if (!node) return NULL;
     
-    while (token && table.field_count < MAX_FIELDS) {
-        while (*token == ' ') token++;
-        
-        char field_name[MAX_FIELD_NAME];
-        char field_type[20];
-        if (sscanf(token, "%s %s", field_name, field_type) == 2) {
-            Field field;
-            strcpy(field.name, field_name);
-            
-            if (strcmp(field_type, "int") == 0) {
-                field.type = FIELD_INT;
-                field.size = sizeof(int);
-            } else if (strncmp(field_type, "text", 4) == 0) {
-                field.type = FIELD_TEXT;
-                field.size = 255;
-                char* bracket = strchr(token, '(');
-                if (bracket && sscanf(bracket, "(%d)", &field.size) == 1) {}
-            } else if (strcmp(field_type, "bool") == 0) {
-                field.type = FIELD_BOOL;
-                field.size = sizeof(bool);
-            } else {
-                printf("Unknown field type: %s\n", field_type);
-                fclose(file);
-                return;
+    int cmp = compare_keys(key, node->key, type);
+    if (cmp < 0) node->left = deleteAVL(node->left, key, position, type);
+    else if (cmp > 0) node->right = deleteAVL(node->right, key, position, type);
+    else if (node->duplicate_count > 0) {
+        int slot = -1;
+        if (node->file_position == position) {
+            node->file_position = node->duplicates[0];
+            slot = 0;
+        } else {
+            for (int i = 0; i < node->duplicate_count && slot < 0; i++) {
+                if (node->duplicates[i] == position) slot = i;
             }
-            
-            table.record_size += field.size;
-            table.fields[table.field_count++] = field;
         }
-        token = strtok(NULL, ",");
+        if (slot < 0) return node;
+        memmove(&node->duplicates[slot], &node->duplicates[slot + 1], (node->duplicate_count - slot - 1) * sizeof(long));
+        node->duplicate_count--;
+        node->size--;
+        return node;
+    } else if (node->file_position != position) {
+        return node;
+    } else if (!node->left || !node->right) {
+        AVLNode* child = node->left ? node->left : node->right;
+        free(node->duplicates);
+        free(node);
+        return child;
+    } else {
+        AVLNode* successor;
+        AVLNode* right = detachMinAVL(node->right, &successor);
+        successor->left = node->left;
+        successor->right = right;
+        free(node->duplicates);
+        free(node);
+        node = successor;
     }
-    
-    fwrite(&table, sizeof(Table), 1, file);
-    fclose(file);
-    printf("Table '%s' created\n", table_name);
+    return rebalanceAVL(node);
 }
 
-bool load_table(const char* table_name) {
-    char filename[100];
-    snprintf(filename, sizeof(filename), "%s_%s.bin", TABLE_PREFIX, table_name);
-    
-    FILE* file = fopen(filename, "rb+");
-    if (!file) {
-        printf("Table '%s' not found\n", table_name);
-        return false;
+AVLNode* searchAVL(AVLNode* root, const char* key, FieldType type) {
+    if (!root) return root;
+    int cmp = compare_keys(key, root->key, type);
+    if (cmp == 0) return root;
+    if (cmp < 0) return searchAVL(root->left, key, type);
+    return searchAVL(root->right, key, type);
+}
+
+// Rows with a key below (or up to, when inclusive) the given one, O(log n)
+long countLessAVL(AVLNode* root, const char* key, FieldType type, bool inclusive) {
+    long count = 0;
+    while (root) {
+        int cmp = compare_keys(key, root->key, type);
+        if (cmp < 0 || (cmp == 0 && !inclusive)) {
+            root = root->left;
+        } else {
+            count += subtreeSize(root->left) + 1 + root->duplicate_count;
+            if (cmp == 0) break;
+            root = root->right;
+        }
     }
+    return count;
+}
+
+long countRangeAVL(AVLNode* root, const KeyRange* range, FieldType type) {
+    long below_upper = range->has_upper ? countLessAVL(root, range->upper, type, range->upper_inclusive) : subtreeSize(root);
+    long below_lower = range->has_lower ? countLessAVL(root, range->lower, type, !range->lower_inclusive) : 0;
+    return below_upper > below_lower ? below_upper - below_lower : 0;
+}
+
+// Collects the positions of every key inside the range in key order,
+// visiting only the subtrees that can overlap it
+void rangeAVL(AVLNode* node, const KeyRange* range, FieldType type, PositionList* out) {
+    if (!node) return;
+    int above_lower = range->has_lower ? compare_keys(node->key, range->lower, type) : 1;
+    int below_upper = range->has_upper ? compare_keys(node->key, range->upper, type) : -1;
     
-    if (fread(&current_table, sizeof(Table), 1, file) != 1) {
-        fclose(file);
-        printf("Error reading table\n");
-        return false;
+    if (above_lower > 0) rangeAVL(node->left, range, type, out);
+    if ((above_lower > 0 || (above_lower == 0 && range->lower_inclusive)) &&
+        (below_upper < 0 || (below_upper == 0 && range->upper_inclusive))) {
+        position_list_add(out, node->file_position);
+        for (int i = 0; i < node->duplicate_count; i++) {
+            position_list_add(out, node->duplicates[i]);
+        }
     }
-    
-    current_table.data_file = file;
-    
-    fseek(file, sizeof(Table), SEEK_SET);
-    char* record = malloc(current_table.record_size);
-    long position = ftell(file);
-    
-    while (fread(record, current_table.record_size, 1, file)) {
-        int offset = 0;
-        for (int i = 0; i < current_table.field_count; i++) {
-            Field field = current_table.fields[i];
-            char key[256] = {0};
-            
-            switch (field.type) {
-                case FIELD_INT: {
-                    int value;
-                    memcpy(&value, record + offset, sizeof(int));
-                    snprintf(key, sizeof(key), "%d", value);
-                    break;
-                }
-                case FIELD_TEXT:
-                    strncpy(key, record + offset, field.size);
-                    key[field.size] = '\0';
-                    break;
-                case FIELD_BOOL: {
-                    bool value;
-                    memcpy(&value, record + offset, sizeof(bool));
-                    strcpy(key, value ? "true" : "false");
-                    break;
-                }
-            }
-            
-            current_table.indexes[i] = insertAVL(current_table.indexes[i], key, position);
-            offset += field.size;
+    if (below_upper < 0) rangeAVL(node->right, range, type, out);
+}
+
+// Node holding the k-th smallest row (0-based, duplicates counted), O(log n)
+AVLNode* selectAVL(AVLNode* root, long k) {
+    while (root) {
+        long left = subtreeSize(root->left);
+        long here = 1 + root->duplicate_count;
+        if (k < left) {
+            root = root->left;
+        } else if (k < left + here) {
+            return root;
+        } else {
+            k -= left + here;
+            root = root->right;
         }
-        position = ftell(file);
     }
-    free(record);
-    
-    table_loaded = true;
-    printf("Table '%s' loaded with indexes\n", table_name);
-    return true;
+    return NULL;
 }
 
-bool load_table_from_file(const char* filename, Table* table) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        return false;
+// In-order (or reverse) traversal over every row position; stops when
+// visit returns false. Rows sharing a key come out in file order.
+bool walkAVL(AVLNode* node, bool descending, bool (*visit)(long position, void* context), void* context) {
+    if (!node) return true;
+    if (!walkAVL(descending ? node->right : node->left, descending, visit, context)) return false;
+    if (!visit(node->file_position, context)) return false;
+    for (int i = 0; i < node->duplicate_count; i++) {
+        if (!visit(node->duplicates[i], context)) return false;
     }
-    
-    if (fread(table, sizeof(Table), 1, file) != 1) {
-        fclose(file);
-        return false;
+    return walkAVL(descending ? node->left : node->right, descending, visit, context);
+}
+
+// B+tree functions
+static BTreeKey btree_key(const BTree* tree, const char* key) {
+    BTreeKey result;
+    if (tree->type == FIELD_INT) result.number = atol(key);
+    else result.text = (char*)key;
+    return result;
+}
+
+static int btree_compare(const BTree* tree, BTreeKey a, BTreeKey b) {
+    if (tree->type == FIELD_INT) return (a.number > b.number) - (a.number < b.number);
+    return strcmp(a.text, b.text);
+}
+
+// Keys in the node below the given one (or up to it, when inclusive)
+static int btree_bound(const BTree* tree, const BTreeNode* node, BTreeKey key, bool inclusive) {
+    int low = 0, high = node->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int cmp = btree_compare(tree, node->keys[middle], key);
+        if (cmp < 0 || (cmp == 0 && inclusive)) low = middle + 1;
+        else high = middle;
     }
-    
-    fclose(file);
-    return true;
+    return low;
 }
 
-void insert_into_table(const char* values) {
-    if (!table_loaded) {
-        printf("No table selected\n");
-        return;
+// (key, position) entries in the node before the given one, or up to it
+// when inclusive
+static int btree_entry_bound(const BTree* tree, const BTreeNode* node, BTreeKey key, long position, bool inclusive) {
+    int low = 0, high = node->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        int cmp = btree_compare(tree, node->keys[middle], key);
+        if (cmp == 0) cmp = (node->positions[middle] > position) - (node->positions[middle] < position);
+        if (cmp < 0 || (cmp == 0 && inclusive)) low = middle + 1;
+        else high = middle;
     }
-    
-    char values_copy[MAX_QUERY_LENGTH];
-    strcpy(values_copy, values);
-    char* token = strtok(values_copy, ",");
-    
-    char record[MAX_RECORD_SIZE] = {0};
-    int offset = 0;
-    
-    for (int i = 0; i < current_table.field_count && token; i++) {
-        while (*token == ' ' || *token == '\'') token++;
-        char* end = token + strlen(token) - 1;
+    return low;
+}
+
+static BTreeNode* btree_node_create(bool leaf) {
+    BTreeNode* node = calloc(1, sizeof(BTreeNode));
+    node->leaf = leaf;
+    return node;
+}
+
+static long btree_node_size(const BTreeNode* node) {
+    if (node->leaf) return node->count;
+    long size = 0;
+    for (int i = 0; i <= node->count; i++) size += node->sizes[i];
+    return size;
+}
+
+BTree* btree_create(FieldType type) {
+    BTree* tree = calloc(1, sizeof(BTree));
+    tree->type = type;
+    return tree;
+}
+
+// Separators are copies owned by the inner nodes and always freed; leaf
+// keys only when free_keys is set
+static void btree_free_node(const BTree* tree, BTreeNode* node, bool free_keys) {
+    bool text = tree->type != FIELD_INT;
+    if (node->leaf) {
+        if (text && free_keys) {
+            for (int i = 0; i < node->count; i++) free(node->keys[i].text);
+        }
+    } else {
+        for (int i = 0; i < node->count && text; i++) free(node->keys[i].text);
+        for (int i = 0; i <= node->count; i++) btree_free_node(tree, node->children[i], free_keys);
+    }
+    free(node);
+}
+
+void btree_free(BTree* tree) {
+    if (!tree) return;
+    if (tree->root) btree_free_node(tree, tree->root, true);
+    free(tree);
+}
+
+// Inserts in (key, position) order, so rows sharing a key stay in file
+// order. Returns the new right sibling and its separator when the node
+// splits.
+static BTreeNode* btree_insert_node(BTree* tree, BTreeNode* node, BTreeKey key, long position,
+                                    BTreeKey* separator, long* separator_position) {
+    int slot = btree_entry_bound(tree, node, key, position, true);
+    if (node->leaf) {
+        memmove(&node->keys[slot + 1], &node->keys[slot], (node->count - slot) * sizeof(BTreeKey));
+        memmove(&node->positions[slot + 1], &node->positions[slot], (node->count - slot) * sizeof(long));
+        node->keys[slot] = key;
+        node->positions[slot] = position;
+        if (++node->count <= BTREE_FANOUT) return NULL;
+        
+        BTreeNode* right = btree_node_create(true);
+        int half = node->count / 2;
+        right->count = node->count - half;
+        memcpy(right->keys, &node->keys[half], right->count * sizeof(BTreeKey));
+        memcpy(right->positions, &node->positions[half], right->count * sizeof(long));
+        node->count = half;
+        right->next = node->next;
+        if (right->next) right->next->prev = right;
+        right->prev = node;
+        node->next = right;
+        *separator = right->keys[0];
+        if (tree->type != FIELD_INT) separator->text = strdup(separator->text);
+        *separator_position = right->positions[0];
+        return right;
+    }
+    
+    node->sizes[slot]++;
+    BTreeKey child_separator;
+    long child_position;
+    BTreeNode* split = btree_insert_node(tree, node->children[slot], key, position, &child_separator, &child_position);
+    if (!split) return NULL;
+    
+    memmove(&node->keys[slot + 1], &node->keys[slot], (node->count - slot) * sizeof(BTreeKey));
+    memmove(&node->positions[slot + 1], &node->positions[slot], (node->count - slot) * sizeof(long));
+    memmove(&node->children[slot + 2], &node->children[slot + 1], (node->count - slot) * sizeof(BTreeNode*));
+    memmove(&node->sizes[slot + 2], &node->sizes[slot + 1], (node->count - slot) * sizeof(long));
+    node->keys[slot] = child_separator;
+    node->positions[slot] = child_position;
+    node->children[slot + 1] = split;
+    node->sizes[slot + 1] = btree_node_size(split);
+    node->sizes[slot] -= node->sizes[slot + 1];
+    if (++node->count <= BTREE_FANOUT) return NULL;
+    
+    BTreeNode* right = btree_node_create(false);
+    int half = node->count / 2;
+    *separator = node->keys[half];
+    *separator_position = node->positions[half];
+    right->count = node->count - half - 1;
+    memcpy(right->keys, &node->keys[half + 1], right->count * sizeof(BTreeKey));
+    memcpy(right->positions, &node->positions[half + 1], right->count * sizeof(long));
+    memcpy(right->children, &node->children[half + 1], (right->count + 1) * sizeof(BTreeNode*));
+    memcpy(right->sizes, &node->sizes[half + 1], (right->count + 1) * sizeof(long));
+    node->count = half;
+    return right;
+}
+
+static void btree_insert_key(BTree* tree, BTreeKey stored, long position) {
+    if (!tree->root) tree->root = btree_node_create(true);
+    
+    BTreeKey separator;
+    long separator_position;
+    BTreeNode* right = btree_insert_node(tree, tree->root, stored, position, &separator, &separator_position);
+    tree->size++;
+    if (right) {
+        BTreeNode* root = btree_node_create(false);
+        root->count = 1;
+        root->keys[0] = separator;
+        root->positions[0] = separator_position;
+        root->children[0] = tree->root;
+        root->children[1] = right;
+        root->sizes[1] = btree_node_size(right);
+        root->sizes[0] = tree->size - root->sizes[1];
+        tree->root = root;
+    }
+}
+
+void btree_insert(BTree* tree, const char* key, long position) {
+    BTreeKey stored = btree_key(tree, key);
+    if (tree->type != FIELD_INT) stored.text = strdup(key);
+    btree_insert_key(tree, stored, position);
+}
+
+// Removes the entry and shrinks the row counts on its path. Nodes may run
+// underfull, even empty, instead of being merged: the separators still
+// route correctly and btree_prune rebuilds the tree compactly.
+static bool btree_delete_node(BTree* tree, BTreeNode* node, BTreeKey key, long position) {
+    if (!node->leaf) {
+        int slot = btree_entry_bound(tree, node, key, position, true);
+        if (!btree_delete_node(tree, node->children[slot], key, position)) return false;
+        node->sizes[slot]--;
+        return true;
+    }
+    
+    int slot = btree_entry_bound(tree, node, key, position, false);
+    if (slot == node->count || node->positions[slot] != position ||
+        btree_compare(tree, node->keys[slot], key) != 0) return false;
+    if (tree->type != FIELD_INT) free(node->keys[slot].text);
+    memmove(&node->keys[slot], &node->keys[slot + 1], (node->count - slot - 1) * sizeof(BTreeKey));
+    memmove(&node->positions[slot], &node->positions[slot + 1], (node->count - slot - 1) * sizeof(long));
+    node->count--;
+    return true;
+}
+
+bool btree_delete(BTree* tree, const char* key, long position) {
+    if (!tree->root || !btree_delete_node(tree, tree->root, btree_key(tree, key), position)) return false;
+    tree->size--;
+    return true;
+}
+
+// Rows with a key below (or up to, when inclusive) the given one
+long btree_count_less(const BTree* tree, const char* key, bool inclusive) {
+    BTreeKey probe = btree_key(tree, key);
+    long count = 0;
+    for (BTreeNode* node = tree->root; node; ) {
+        int slot = btree_bound(tree, node, probe, inclusive);
+        if (node->leaf) return count + slot;
+        for (int i = 0; i < slot; i++) count += node->sizes[i];
+        node = node->children[slot];
+    }
+    return count;
+}
+
+long btree_count_range(const BTree* tree, const KeyRange* range) {
+    long below_upper = range->has_upper ? btree_count_less(tree, range->upper, range->upper_inclusive) : tree->size;
+    long below_lower = range->has_lower ? btree_count_less(tree, range->lower, !range->lower_inclusive) : 0;
+    return below_upper > below_lower ? below_upper - below_lower : 0;
+}
+
+// Leaf and slot of the k-th smallest row (0-based)
+static BTreeNode* btree_seek(const BTree* tree, long k, int* slot) {
+    BTreeNode* node = tree->root;
+    if (!node || k < 0 || k >= tree->size) return NULL;
+    while (!node->leaf) {
+        int i = 0;
+        while (k >= node->sizes[i]) k -= node->sizes[i++];
+        node = node->children[i];
+    }
+    *slot = (int)k;
+    return node;
+}
+
+// Positions of every key inside the range in key order: one descent to the
+// first row, then along the leaf chain
+void btree_range(const BTree* tree, const KeyRange* range, PositionList* out) {
+    long first = range->has_lower ? btree_count_less(tree, range->lower, !range->lower_inclusive) : 0;
+    long remaining = btree_count_range(tree, range);
+    int slot;
+    BTreeNode* node = btree_seek(tree, first, &slot);
+    for (; node && remaining > 0; node = node->next, slot = 0) {
+        for (; slot < node->count && remaining > 0; slot++, remaining--) {
+            position_list_add(out, node->positions[slot]);
+        }
+    }
+}
+
+// Key of the k-th smallest row, formatted like the AVL keys
+bool btree_select(const BTree* tree, long k, char* key, size_t size) {
+    int slot;
+    BTreeNode* node = btree_seek(tree, k, &slot);
+    if (!node) return false;
+    if (tree->type == FIELD_INT) snprintf(key, size, "%ld", node->keys[slot].number);
+    else snprintf(key, size, "%s", node->keys[slot].text);
+    return true;
+}
+
+// Last entry of the leaves before this one, skipping leaves emptied by deletes
+static BTreeNode* btree_previous(const BTreeNode* node, int* slot) {
+    BTreeNode* previous = node->prev;
+    while (previous && previous->count == 0) previous = previous->prev;
+    if (previous) *slot = previous->count - 1;
+    return previous;
+}
+
+// Ordered walk over the leaf chain. Descending order goes backwards by key
+// but, as in walkAVL, rows sharing a key still come out in file order.
+bool btree_walk(const BTree* tree, bool descending, bool (*visit)(long position, void* context), void* context) {
+    int slot;
+    BTreeNode* node = btree_seek(tree, descending ? tree->size - 1 : 0, &slot);
+    if (!descending) {
+        for (; node; node = node->next, slot = 0) {
+            for (; slot < node->count; slot++) {
+                if (!visit(node->positions[slot], context)) return false;
+            }
+        }
+        return true;
+    }
+    
+    while (node) {
+        BTreeNode* start = node;
+        int start_slot = slot;
+        while (true) {
+            BTreeNode* before = start;
+            int before_slot = start_slot - 1;
+            if (before_slot < 0) {
+                before = btree_previous(start, &before_slot);
+                if (!before) break;
+            }
+            if (btree_compare(tree, before->keys[before_slot], node->keys[slot]) != 0) break;
+            start = before;
+            start_slot = before_slot;
+        }
+        
+        BTreeNode* run = start;
+        int run_slot = start_slot;
+        while (true) {
+            if (!visit(run->positions[run_slot], context)) return false;
+            if (run == node && run_slot == slot) break;
+            for (run_slot++; run_slot == run->count; run_slot = 0) run = run->next;
+        }
+        
+        node = start;
+        slot = start_slot - 1;
+        if (slot < 0) node = btree_previous(start, &slot);
+    }
+    return true;
+}
+
+// Reloads the surviving entries, in order, into fresh nodes; dropped text
+// keys are freed and surviving ones move over
+void btree_prune(BTree* tree, long from, long to) {
+    int slot;
+    BTreeNode* leaf = btree_seek(tree, 0, &slot);
+    BTreeNode* old_root = tree->root;
+    tree->root = NULL;
+    tree->size = 0;
+    
+    for (; leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->count; i++) {
+            if (leaf->positions[i] >= from && leaf->positions[i] < to) {
+                btree_insert_key(tree, leaf->keys[i], leaf->positions[i]);
+            } else if (tree->type != FIELD_INT) {
+                free(leaf->keys[i].text);
+            }
+        }
+    }
+    if (old_root) btree_free_node(tree, old_root, false);
+}
+
+// LSM index functions
+static BTreeKey lsm_key(FieldType type, const char* key) {
+    BTreeKey result;
+    if (type == FIELD_INT) result.number = atol(key);
+    else result.text = (char*)key;
+    return result;
+}
+
+static int lsm_compare_keys(FieldType type, BTreeKey a, BTreeKey b) {
+    if (type == FIELD_INT) return (a.number > b.number) - (a.number < b.number);
+    return strcmp(a.text, b.text);
+}
+
+// Entries are ordered by key, then by row position
+static int lsm_compare(FieldType type, const LsmEntry* a, const LsmEntry* b) {
+    int cmp = lsm_compare_keys(type, a->key, b->key);
+    return cmp ? cmp : (a->position > b->position) - (a->position < b->position);
+}
+
+static int lsm_compare_int(const void* a, const void* b) {
+    return lsm_compare(FIELD_INT, a, b);
+}
+
+static int lsm_compare_text(const void* a, const void* b) {
+    return lsm_compare(FIELD_TEXT, a, b);
+}
+
+// First entry in [low, high) with a key not below (above, when inclusive) the given one
+static long lsm_bound(FieldType type, const LsmEntry* entries, long low, long high, BTreeKey key, bool inclusive) {
+    while (low < high) {
+        long middle = (low + high) / 2;
+        int cmp = lsm_compare_keys(type, entries[middle].key, key);
+        if (cmp < 0 || (cmp == 0 && inclusive)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+static long lsm_entry_bound(FieldType type, const LsmRun* run, const LsmEntry* entry) {
+    long low = 0, high = run->count;
+    while (low < high) {
+        long middle = (low + high) / 2;
+        if (lsm_compare(type, &run->entries[middle], entry) < 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+LsmIndex* lsm_create(FieldType type) {
+    LsmIndex* index = calloc(1, sizeof(LsmIndex));
+    index->type = type;
+    index->memtable.entries = malloc(LSM_MEMTABLE_ROWS * sizeof(LsmEntry));
+    index->memtable_sorted = true;
+    pthread_mutex_init(&index->lock, NULL);
+    pthread_cond_init(&index->merged, NULL);
+    return index;
+}
+
+// Only the owning thread touches the memtable, so it is sorted without the lock
+static void lsm_sort_memtable(LsmIndex* index) {
+    if (index->memtable_sorted) return;
+    qsort(index->memtable.entries, index->memtable.count, sizeof(LsmEntry),
+          index->type == FIELD_INT ? lsm_compare_int : lsm_compare_text);
+    index->memtable_sorted = true;
+}
+
+// Runs of up to LSM_MEMTABLE_ROWS rows are tier 0; each further tier
+// holds runs LSM_TIER_RUNS times larger
+static int lsm_tier(long count) {
+    int tier = 0;
+    for (long limit = LSM_MEMTABLE_ROWS; count > limit; limit *= LSM_TIER_RUNS) tier++;
+    return tier;
+}
+
+// Smallest tier holding LSM_TIER_RUNS runs, -1 when none does
+static int lsm_full_tier(const LsmIndex* index) {
+    int counts[64] = {0};
+    for (int r = 0; r < index->run_count; r++) counts[lsm_tier(index->runs[r].count)]++;
+    for (int tier = 0; tier < 64; tier++) {
+        if (counts[tier] >= LSM_TIER_RUNS) return tier;
+    }
+    return -1;
+}
+
+static LsmRun lsm_merge_runs(FieldType type, const LsmRun* inputs, int count) {
+    LsmRun merged = {NULL, 0};
+    long cursors[LSM_TIER_RUNS] = {0};
+    for (int i = 0; i < count; i++) merged.count += inputs[i].count;
+    merged.entries = malloc(merged.count * sizeof(LsmEntry));
+    for (long out = 0; out < merged.count; out++) {
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            if (cursors[i] < inputs[i].count &&
+                (best < 0 || lsm_compare(type, &inputs[i].entries[cursors[i]], &inputs[best].entries[cursors[best]]) < 0)) {
+                best = i;
+            }
+        }
+        merged.entries[out] = inputs[best].entries[cursors[best]++];
+    }
+    return merged;
+}
+
+// Background compaction. The inputs are merged without the lock; meanwhile
+// flushes can only append runs, so the inputs are still in place when the
+// merged run takes the first one's slot.
+static void* lsm_merge_worker(void* argument) {
+    LsmIndex* index = argument;
+    pthread_mutex_lock(&index->lock);
+    int tier;
+    while ((tier = lsm_full_tier(index)) >= 0) {
+        LsmRun inputs[LSM_TIER_RUNS];
+        int count = 0;
+        for (int r = 0; r < index->run_count && count < LSM_TIER_RUNS; r++) {
+            if (lsm_tier(index->runs[r].count) == tier) inputs[count++] = index->runs[r];
+        }
+        pthread_mutex_unlock(&index->lock);
+        LsmRun merged = lsm_merge_runs(index->type, inputs, count);
+        pthread_mutex_lock(&index->lock);
+        
+        int kept = 0;
+        bool placed = false;
+        for (int r = 0; r < index->run_count; r++) {
+            bool input = false;
+            for (int i = 0; i < count; i++) input = input || index->runs[r].entries == inputs[i].entries;
+            if (!input) index->runs[kept++] = index->runs[r];
+            else if (!placed) {
+                index->runs[kept++] = merged;
+                placed = true;
+            }
+        }
+        index->run_count = kept;
+        for (int i = 0; i < count; i++) free(inputs[i].entries);
+    }
+    index->merging = false;
+    pthread_cond_broadcast(&index->merged);
+    pthread_mutex_unlock(&index->lock);
+    return NULL;
+}
+
+// Seals the memtable into an immutable run and starts a merge when a tier
+// fills up
+static void lsm_flush(LsmIndex* index) {
+    lsm_sort_memtable(index);
+    LsmRun run = index->memtable;
+    index->memtable.entries = malloc(LSM_MEMTABLE_ROWS * sizeof(LsmEntry));
+    index->memtable.count = 0;
+    
+    pthread_mutex_lock(&index->lock);
+    if (index->run_count == index->run_capacity) {
+        index->run_capacity = index->run_capacity ? index->run_capacity * 2 : 8;
+        index->runs = realloc(index->runs, index->run_capacity * sizeof(LsmRun));
+    }
+    index->runs[index->run_count++] = run;
+    if (!index->merging && lsm_full_tier(index) >= 0) {
+        pthread_t thread;
+        index->merging = pthread_create(&thread, NULL, lsm_merge_worker, index) == 0;
+        if (index->merging) pthread_detach(thread);
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+// O(1) amortized: an append, plus a sort of LSM_MEMTABLE_ROWS entries
+// every LSM_MEMTABLE_ROWS inserts; merging happens on another thread
+void lsm_insert(LsmIndex* index, const char* key, long position) {
+    LsmEntry entry;
+    entry.key = lsm_key(index->type, key);
+    if (index->type != FIELD_INT) entry.key.text = strdup(key);
+    entry.position = position;
+    
+    LsmRun* memtable = &index->memtable;
+    if (memtable->count > 0 && lsm_compare(index->type, &memtable->entries[memtable->count - 1], &entry) > 0) {
+        index->memtable_sorted = false;
+    }
+    memtable->entries[memtable->count++] = entry;
+    index->size++;
+    if (memtable->count == LSM_MEMTABLE_ROWS) lsm_flush(index);
+}
+
+// Deletes and prunes change runs in place, so they first wait for a
+// running merge. Merges are only started by inserts on this thread.
+static void lsm_settle(LsmIndex* index) {
+    pthread_mutex_lock(&index->lock);
+    while (index->merging) pthread_cond_wait(&index->merged, &index->lock);
+    pthread_mutex_unlock(&index->lock);
+}
+
+bool lsm_delete(LsmIndex* index, const char* key, long position) {
+    lsm_settle(index);
+    lsm_sort_memtable(index);
+    LsmEntry probe;
+    probe.key = lsm_key(index->type, key);
+    probe.position = position;
+    
+    for (int s = -1; s < index->run_count; s++) {
+        LsmRun* run = s < 0 ? &index->memtable : &index->runs[s];
+        long slot = lsm_entry_bound(index->type, run, &probe);
+        if (slot == run->count || lsm_compare(index->type, &run->entries[slot], &probe) != 0) continue;
+        
+        if (index->type != FIELD_INT) free(run->entries[slot].key.text);
+        memmove(&run->entries[slot], &run->entries[slot + 1], (run->count - slot - 1) * sizeof(LsmEntry));
+        run->count--;
+        index->size--;
+        if (s >= 0 && run->count == 0) {
+            free(run->entries);
+            memmove(run, run + 1, (index->run_count - s - 1) * sizeof(LsmRun));
+            index->run_count--;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Keeps only the entries of positions in [from, to)
+void lsm_prune(LsmIndex* index, long from, long to) {
+    lsm_settle(index);
+    index->size = 0;
+    int kept_runs = 0;
+    for (int s = -1; s < index->run_count; s++) {
+        LsmRun* run = s < 0 ? &index->memtable : &index->runs[s];
+        long kept = 0;
+        for (long i = 0; i < run->count; i++) {
+            if (run->entries[i].position >= from && run->entries[i].position < to) {
+                run->entries[kept++] = run->entries[i];
+            } else if (index->type != FIELD_INT) {
+                free(run->entries[i].key.text);
+            }
+        }
+        run->count = kept;
+        index->size += kept;
+        if (s < 0) continue;
+        if (kept > 0) index->runs[kept_runs++] = *run;
+        else free(run->entries);
+    }
+    index->run_count = kept_runs;
+}
+
+void lsm_free(LsmIndex* index) {
+    if (!index) return;
+    lsm_settle(index);
+    for (int s = -1; s < index->run_count; s++) {
+        LsmRun* run = s < 0 ? &index->memtable : &index->runs[s];
+        if (index->type != FIELD_INT) {
+            for (long i = 0; i < run->count; i++) free(run->entries[i].key.text);
+        }
+        free(run->entries);
+    }
+    free(index->runs);
+    pthread_mutex_destroy(&index->lock);
+    pthread_cond_destroy(&index->merged);
+    free(index);
+}
+
+// Readers hold the lock and see the runs plus the memtable as one list of
+// sorted sources
+static int lsm_sources(LsmIndex* index, LsmRun** sources) {
+    lsm_sort_memtable(index);
+    *sources = malloc((index->run_count + 1) * sizeof(LsmRun));
+    int count = 0;
+    for (int r = 0; r < index->run_count; r++) (*sources)[count++] = index->runs[r];
+    if (index->memtable.count > 0) (*sources)[count++] = index->memtable;
+    return count;
+}
+
+long lsm_count_less(LsmIndex* index, const char* key, bool inclusive) {
+    BTreeKey probe = lsm_key(index->type, key);
+    pthread_mutex_lock(&index->lock);
+    LsmRun* sources;
+    int count = lsm_sources(index, &sources);
+    long below = 0;
+    for (int s = 0; s < count; s++) below += lsm_bound(index->type, sources[s].entries, 0, sources[s].count, probe, inclusive);
+    pthread_mutex_unlock(&index->lock);
+    free(sources);
+    return below;
+}
+
+long lsm_count_range(LsmIndex* index, const KeyRange* range) {
+    long below_upper = range->has_upper ? lsm_count_less(index, range->upper, range->upper_inclusive) : index->size;
+    long below_lower = range->has_lower ? lsm_count_less(index, range->lower, !range->lower_inclusive) : 0;
+    return below_upper > below_lower ? below_upper - below_lower : 0;
+}
+
+// Positions come source by source, not in key order; the planner sorts them
+void lsm_range(LsmIndex* index, const KeyRange* range, PositionList* out) {
+    pthread_mutex_lock(&index->lock);
+    LsmRun* sources;
+    int count = lsm_sources(index, &sources);
+    for (int s = 0; s < count; s++) {
+        long first = range->has_lower ? lsm_bound(index->type, sources[s].entries, 0, sources[s].count,
+                                                  lsm_key(index->type, range->lower), !range->lower_inclusive) : 0;
+        long last = range->has_upper ? lsm_bound(index->type, sources[s].entries, 0, sources[s].count,
+                                                 lsm_key(index->type, range->upper), range->upper_inclusive) : sources[s].count;
+        for (long i = first; i < last; i++) position_list_add(out, sources[s].entries[i].position);
+    }
+    pthread_mutex_unlock(&index->lock);
+    free(sources);
+}
+
+// k-th smallest key over all sources: each round splits the widest window
+// left at its middle key and keeps the side holding k, O(runs * log^2 n)
+bool lsm_select(LsmIndex* index, long k, char* key, size_t size) {
+    if (k < 0 || k >= index->size) return false;
+    pthread_mutex_lock(&index->lock);
+    LsmRun* sources;
+    int count = lsm_sources(index, &sources);
+    long* low = calloc(count, sizeof(long));
+    long* high = malloc(count * sizeof(long));
+    long* below = malloc(count * sizeof(long));
+    long* through = malloc(count * sizeof(long));
+    for (int s = 0; s < count; s++) high[s] = sources[s].count;
+    
+    while (true) {
+        int widest = 0;
+        for (int s = 1; s < count; s++) {
+            if (high[s] - low[s] > high[widest] - low[widest]) widest = s;
+        }
+        BTreeKey pivot = sources[widest].entries[(low[widest] + high[widest]) / 2].key;
+        long less = 0, equal = 0;
+        for (int s = 0; s < count; s++) {
+            below[s] = lsm_bound(index->type, sources[s].entries, low[s], high[s], pivot, false);
+            through[s] = lsm_bound(index->type, sources[s].entries, below[s], high[s], pivot, true);
+            less += below[s] - low[s];
+            equal += through[s] - below[s];
+        }
+        if (k < less) {
+            memcpy(high, below, count * sizeof(long));
+        } else if (k < less + equal) {
+            if (index->type == FIELD_INT) snprintf(key, size, "%ld", pivot.number);
+            else snprintf(key, size, "%s", pivot.text);
+            break;
+        } else {
+            k -= less + equal;
+            memcpy(low, through, count * sizeof(long));
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+    free(sources);
+    free(low);
+    free(high);
+    free(below);
+    free(through);
+    return true;
+}
+
+// Merges the sources on the fly. Descending order goes backwards by key
+// but, as in walkAVL, rows sharing a key still come out in file order.
+bool lsm_walk(LsmIndex* index, bool descending, bool (*visit)(long position, void* context), void* context) {
+    pthread_mutex_lock(&index->lock);
+    LsmRun* sources;
+    int count = lsm_sources(index, &sources);
+    long* cursor = malloc((count + 1) * sizeof(long));
+    long* start = malloc((count + 1) * sizeof(long));
+    long* bound = malloc((count + 1) * sizeof(long));
+    bool completed = true;
+    
+    for (int s = 0; s < count; s++) cursor[s] = descending ? sources[s].count : 0;
+    while (completed) {
+        int best = -1;
+        for (int s = 0; s < count; s++) {
+            if (descending) {
+                if (cursor[s] > 0 && (best < 0 || lsm_compare_keys(index->type, sources[s].entries[cursor[s] - 1].key,
+                                                                   sources[best].entries[cursor[best] - 1].key) > 0)) best = s;
+            } else if (cursor[s] < sources[s].count &&
+                       (best < 0 || lsm_compare(index->type, &sources[s].entries[cursor[s]], &sources[best].entries[cursor[best]]) < 0)) {
+                best = s;
+            }
+        }
+        if (best < 0) break;
+        if (!descending) {
+            completed = visit(sources[best].entries[cursor[best]++].position, context);
+            continue;
+        }
+        
+        // Every source's rows with the largest remaining key, merged by position
+        BTreeKey key = sources[best].entries[cursor[best] - 1].key;
+        for (int s = 0; s < count; s++) {
+            bound[s] = start[s] = lsm_bound(index->type, sources[s].entries, 0, cursor[s], key, false);
+        }
+        while (completed) {
+            int next = -1;
+            for (int s = 0; s < count; s++) {
+                if (start[s] < cursor[s] &&
+                    (next < 0 || sources[s].entries[start[s]].position < sources[next].entries[start[next]].position)) next = s;
+            }
+            if (next < 0) break;
+            completed = visit(sources[next].entries[start[next]++].position, context);
+        }
+        memcpy(cursor, bound, count * sizeof(long));
+    }
+    pthread_mutex_unlock(&index->lock);
+    free(sources);
+    free(cursor);
+    free(start);
+    free(bound);
+    return completed;
+}
+
+// Ordered index interface: the planner, COUNT, ORDER BY and the order
+// statistics go through these instead of a particular tree
+bool ordered_index(int field_index) {
+    IndexKind kind = current_table.fields[field_index].index;
+    return kind == INDEX_AVL || kind == INDEX_BTREE || kind == INDEX_LSM;
+}
+
+void ordered_insert(int field_index, const char* key, long position) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) {
+        btree_insert(current_table.btrees[field_index], key, position);
+    } else if (current_table.fields[field_index].index == INDEX_LSM) {
+        lsm_insert(current_table.lsm_indexes[field_index], key, position);
+    } else {
+        current_table.indexes[field_index] = insertAVL(current_table.indexes[field_index], key, position,
+                                                       current_table.fields[field_index].type);
+    }
+}
+
+bool ordered_delete(int field_index, const char* key, long position) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) {
+        return btree_delete(current_table.btrees[field_index], key, position);
+    }
+    if (current_table.fields[field_index].index == INDEX_LSM) {
+        return lsm_delete(current_table.lsm_indexes[field_index], key, position);
+    }
+    long before = subtreeSize(current_table.indexes[field_index]);
+    current_table.indexes[field_index] = deleteAVL(current_table.indexes[field_index], key, position,
+                                                   current_table.fields[field_index].type);
+    return subtreeSize(current_table.indexes[field_index]) < before;
+}
+
+long ordered_size(int field_index) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) return current_table.btrees[field_index]->size;
+    if (current_table.fields[field_index].index == INDEX_LSM) return current_table.lsm_indexes[field_index]->size;
+    return subtreeSize(current_table.indexes[field_index]);
+}
+
+long ordered_count_less(int field_index, const char* key, bool inclusive) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) {
+        return btree_count_less(current_table.btrees[field_index], key, inclusive);
+    }
+    if (current_table.fields[field_index].index == INDEX_LSM) {
+        return lsm_count_less(current_table.lsm_indexes[field_index], key, inclusive);
+    }
+    return countLessAVL(current_table.indexes[field_index], key, current_table.fields[field_index].type, inclusive);
+}
+
+long ordered_count_range(int field_index, const KeyRange* range) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) {
+        return btree_count_range(current_table.btrees[field_index], range);
+    }
+    if (current_table.fields[field_index].index == INDEX_LSM) {
+        return lsm_count_range(current_table.lsm_indexes[field_index], range);
+    }
+    return countRangeAVL(current_table.indexes[field_index], range, current_table.fields[field_index].type);
+}
+
+void ordered_range(int field_index, const KeyRange* range, PositionList* out) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) {
+        btree_range(current_table.btrees[field_index], range, out);
+    } else if (current_table.fields[field_index].index == INDEX_LSM) {
+        lsm_range(current_table.lsm_indexes[field_index], range, out);
+    } else {
+        rangeAVL(current_table.indexes[field_index], range, current_table.fields[field_index].type, out);
+    }
+}
+
+bool ordered_select(int field_index, long k, char* key, size_t size) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) {
+        return btree_select(current_table.btrees[field_index], k, key, size);
+    }
+    if (current_table.fields[field_index].index == INDEX_LSM) {
+        return lsm_select(current_table.lsm_indexes[field_index], k, key, size);
+    }
+    AVLNode* node = selectAVL(current_table.indexes[field_index], k);
+    if (!node) return false;
+    snprintf(key, size, "%s", node->key);
+    return true;
+}
+
+bool ordered_walk(int field_index, bool descending, bool (*visit)(long position, void* context), void* context) {
+    if (current_table.fields[field_index].index == INDEX_BTREE) {
+        return btree_walk(current_table.btrees[field_index], descending, visit, context);
+    }
+    if (current_table.fields[field_index].index == INDEX_LSM) {
+        return lsm_walk(current_table.lsm_indexes[field_index], descending, visit, context);
+    }
+    return walkAVL(current_table.indexes[field_index], descending, visit, context);
+}
+
+static double bench_seconds(struct timespec start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void bench_report(const char* operation, long operations, double avl_seconds, double btree_seconds) {
+    printf("  %-8s AVL %12.0f ops/s   B+tree %12.0f ops/s   (x%.2f)\n", operation,
+           operations / avl_seconds, operations / btree_seconds, avl_seconds / btree_seconds);
+}
+
+// BENCH INDEX [n]: insert, point lookup and range scan throughput of the
+// AVL tree against the B+tree, and of the LSM index, on n random int keys,
+// in memory
+void bench_index(long key_count) {
+    char (*keys)[24] = malloc(key_count * sizeof(*keys));
+    srand(42);
+    for (long i = 0; i < key_count; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "%ld", ((long)rand() << 16 ^ rand()) % (key_count * 4));
+    }
+    
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    AVLNode* avl = NULL;
+    for (long i = 0; i < key_count; i++) avl = insertAVL(avl, keys[i], i, FIELD_INT);
+    double avl_insert = bench_seconds(start);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    BTree* btree = btree_create(FIELD_INT);
+    for (long i = 0; i < key_count; i++) btree_insert(btree, keys[i], i);
+    double btree_insert_time = bench_seconds(start);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    LsmIndex* lsm = lsm_create(FIELD_INT);
+    for (long i = 0; i < key_count; i++) lsm_insert(lsm, keys[i], i);
+    double lsm_insert_time = bench_seconds(start);
+    
+    // Lookups probe the inserted keys in a different order
+    long checksum[3] = {0, 0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < key_count; i++) {
+        AVLNode* node = searchAVL(avl, keys[(i * 7919) % key_count], FIELD_INT);
+        if (node) checksum[0] += 1 + node->duplicate_count;
+    }
+    double avl_lookup = bench_seconds(start);
+    
+    KeyRange point = {0};
+    point.has_lower = point.has_upper = point.lower_inclusive = point.upper_inclusive = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < key_count; i++) {
+        strcpy(point.lower, keys[(i * 7919) % key_count]);
+        strcpy(point.upper, point.lower);
+        checksum[1] += btree_count_range(btree, &point);
+    }
+    double btree_lookup = bench_seconds(start);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < key_count; i++) {
+        strcpy(point.lower, keys[(i * 7919) % key_count]);
+        strcpy(point.upper, point.lower);
+        checksum[2] += lsm_count_range(lsm, &point);
+    }
+    double lsm_lookup = bench_seconds(start);
+    
+    // Range scans over about 1000 rows each
+    long scans = key_count / 100 > 0 ? key_count / 100 : 1;
+    PositionList rows[3] = {{0}, {0}, {0}};
+    double scan_seconds[3];
+    for (int kind = 0; kind < 3; kind++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < scans; i++) {
+            long lower = atol(keys[(i * 7919) % key_count]);
+            KeyRange range = {0};
+            range.has_lower = range.has_upper = range.lower_inclusive = true;
+            snprintf(range.lower, sizeof(range.lower), "%ld", lower);
+            snprintf(range.upper, sizeof(range.upper), "%ld", lower + 4000);
+            if (kind == 0) rangeAVL(avl, &range, FIELD_INT, &rows[kind]);
+            else if (kind == 1) btree_range(btree, &range, &rows[kind]);
+            else lsm_range(lsm, &range, &rows[kind]);
+            checksum[kind] += rows[kind].count;
+            rows[kind].count = 0;
+        }
+        scan_seconds[kind] = bench_seconds(start);
+        free(rows[kind].items);
+    }
+    
+    printf("Index benchmark, %ld random int keys:\n", key_count);
+    bench_report("insert", key_count, avl_insert, btree_insert_time);
+    bench_report("lookup", key_count, avl_lookup, btree_lookup);
+    bench_report("range", scans, scan_seconds[0], scan_seconds[1]);
+    printf("  LSM: insert %.0f ops/s, lookup %.0f ops/s, range %.0f ops/s (%d runs)\n",
+           key_count / lsm_insert_time, key_count / lsm_lookup, scans / scan_seconds[2], lsm->run_count);
+    if (checksum[0] != checksum[1] || checksum[0] != checksum[2]) printf("Warning: index results differ\n");
+    
+    freeAVL(avl);
+    btree_free(btree);
+    lsm_free(lsm);
+    free(keys);
+}
+
+// In-order list of the nodes that keep at least one position in
+// [from, to); the others are freed
+static void collectAVL(AVLNode* node, long from, long to, AVLNode*** nodes, long* count, long* capacity) {
+    if (!node) return;
+    collectAVL(node->left, from, to, nodes, count, capacity);
+    AVLNode* right = node->right;
+    
+    long first = node->file_position >= from && node->file_position < to ? node->file_position : -1;
+    int kept = 0;
+    for (int i = 0; i < node->duplicate_count; i++) {
+        if (node->duplicates[i] < from || node->duplicates[i] >= to) continue;
+        if (first < 0) first = node->duplicates[i];
+        else node->duplicates[kept++] = node->duplicates[i];
+    }
+    if (first < 0) {
+        free(node->duplicates);
+        free(node);
+    } else {
+        node->file_position = first;
+        node->duplicate_count = kept;
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 1024;
+            *nodes = realloc(*nodes, *capacity * sizeof(AVLNode*));
+        }
+        (*nodes)[(*count)++] = node;
+    }
+    collectAVL(right, from, to, nodes, count, capacity);
+}
+
+static AVLNode* buildAVL(AVLNode** nodes, long low, long high) {
+    if (low > high) return NULL;
+    long middle = (low + high) / 2;
+    AVLNode* node = nodes[middle];
+    node->left = buildAVL(nodes, low, middle - 1);
+    node->right = buildAVL(nodes, middle + 1, high);
+    node->height = 1 + max(height(node->left), height(node->right));
+    node->size = subtreeSize(node->left) + subtreeSize(node->right) + 1 + node->duplicate_count;
+    return node;
+}
+
+// Drops every position outside [from, to) and relinks the surviving nodes
+// into a balanced tree in O(n), without touching the table data
+AVLNode* pruneAVL(AVLNode* root, long from, long to) {
+    AVLNode** nodes = NULL;
+    long count = 0, capacity = 0;
+    collectAVL(root, from, to, &nodes, &count, &capacity);
+    root = buildAVL(nodes, 0, count - 1);
+    free(nodes);
+    return root;
+}
+
+void searchTextInAVL(AVLNode* root, const char* search_text, long** results, int* count) {
+    if (!root) return;
+    if (strstr(root->key, search_text) != NULL) {
+        *results = realloc(*results, (*count + 1) * sizeof(long));
+        (*results)[*count] = root->file_position;
+        (*count)++;
+    }
+    searchTextInAVL(root->left, search_text, results, count);
+    searchTextInAVL(root->right, search_text, results, count);
+}
+
+// Position lists
+int compare_positions(const void* a, const void* b) {
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+void position_list_add(PositionList* list, long position) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = realloc(list->items, list->capacity * sizeof(long));
+    }
+    list->items[list->count++] = position;
+}
+
+// Both lists must be sorted ascending; keeps positions present in both
+void position_list_intersect(PositionList* list, const PositionList* other) {
+    long i = 0, j = 0, out = 0;
+    while (i < list->count && j < other->count) {
+        if (list->items[i] < other->items[j]) i++;
+        else if (list->items[i] > other->items[j]) j++;
+        else {
+            list->items[out++] = list->items[i];
+            i++;
+            j++;
+        }
+    }
+    list->count = out;
+}
+
+// Row numbers and file positions
+long row_position(long row) {
+    return TABLE_HEADER_BYTES + row * current_table.record_size;
+}
+
+long position_row(long position) {
+    return (position - TABLE_HEADER_BYTES) / current_table.record_size;
+}
+
+// Roaring bitmaps
+static RoaringContainer* roaring_container(Roaring* bitmap, uint32_t key) {
+    int low = 0, high = bitmap->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (bitmap->containers[middle].key < key) low = middle + 1;
+        else high = middle;
+    }
+    if (low < bitmap->count && bitmap->containers[low].key == key) return &bitmap->containers[low];
+    
+    if (bitmap->count == bitmap->capacity) {
+        bitmap->capacity = bitmap->capacity ? bitmap->capacity * 2 : 4;
+        bitmap->containers = realloc(bitmap->containers, bitmap->capacity * sizeof(RoaringContainer));
+    }
+    memmove(&bitmap->containers[low + 1], &bitmap->containers[low], (bitmap->count - low) * sizeof(RoaringContainer));
+    bitmap->count++;
+    RoaringContainer* container = &bitmap->containers[low];
+    memset(container, 0, sizeof(RoaringContainer));
+    container->key = key;
+    return container;
+}
+
+static void roaring_container_bits(const RoaringContainer* container, uint64_t* words) {
+    if (container->bits) {
+        memcpy(words, container->bits, ROARING_WORDS * sizeof(uint64_t));
+        return;
+    }
+    memset(words, 0, ROARING_WORDS * sizeof(uint64_t));
+    for (int i = 0; i < container->cardinality; i++) {
+        words[container->array[i] >> 6] |= 1ULL << (container->array[i] & 63);
+    }
+}
+
+// Stores a bitset as a container, picking the smaller representation
+static void roaring_container_store(RoaringContainer* container, const uint64_t* words) {
+    free(container->array);
+    free(container->bits);
+    container->array = NULL;
+    container->bits = NULL;
+    container->cardinality = 0;
+    for (int w = 0; w < ROARING_WORDS; w++) container->cardinality += __builtin_popcountll(words[w]);
+    
+    if (container->cardinality > ROARING_ARRAY_MAX) {
+        container->bits = malloc(ROARING_WORDS * sizeof(uint64_t));
+        memcpy(container->bits, words, ROARING_WORDS * sizeof(uint64_t));
+        return;
+    }
+    // Capacity stays a power of two, the growth rule of roaring_add()
+    int capacity = 4;
+    while (capacity < container->cardinality) capacity *= 2;
+    container->array = malloc(capacity * sizeof(uint16_t));
+    int count = 0;
+    for (int w = 0; w < ROARING_WORDS; w++) {
+        uint64_t word = words[w];
+        while (word) {
+            container->array[count++] = (uint16_t)(w * 64 + __builtin_ctzll(word));
+            word &= word - 1;
+        }
+    }
+}
+
+// Rows usually arrive in increasing order, so array inserts are appends
+void roaring_add(Roaring* bitmap, long row) {
+    RoaringContainer* container = roaring_container(bitmap, (uint32_t)(row >> 16));
+    uint16_t low = (uint16_t)(row & 0xFFFF);
+    
+    if (container->bits) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (!(container->bits[low >> 6] & bit)) {
+            container->bits[low >> 6] |= bit;
+            container->cardinality++;
+        }
+        return;
+    }
+    
+    int position = container->cardinality;
+    while (position > 0 && container->array[position - 1] > low) position--;
+    if (position > 0 && container->array[position - 1] == low) return;
+    
+    if (container->cardinality == ROARING_ARRAY_MAX) {
+        uint64_t words[ROARING_WORDS];
+        roaring_container_bits(container, words);
+        words[low >> 6] |= 1ULL << (low & 63);
+        roaring_container_store(container, words);
+        return;
+    }
+    // Arrays grow in powers of two
+    if ((container->cardinality & (container->cardinality - 1)) == 0) {
+        int capacity = container->cardinality ? container->cardinality * 2 : 4;
+        container->array = realloc(container->array, capacity * sizeof(uint16_t));
+    }
+    memmove(&container->array[position + 1], &container->array[position],
+            (container->cardinality - position) * sizeof(uint16_t));
+    container->array[position] = low;
+    container->cardinality++;
+}
+
+// bitmap = bitmap AND/OR other, container by container
+void roaring_combine(Roaring* bitmap, const Roaring* other, RoaringOperation operation) {
+    Roaring result = {0};
+    int i = 0, j = 0;
+    uint64_t left[ROARING_WORDS], right[ROARING_WORDS];
+    
+    while (i < bitmap->count || j < other->count) {
+        const RoaringContainer* a = i < bitmap->count ? &bitmap->containers[i] : NULL;
+        const RoaringContainer* b = j < other->count ? &other->containers[j] : NULL;
+        
+        if (a && (!b || a->key < b->key)) {
+            if (operation != ROARING_AND) {
+                roaring_container_bits(a, left);
+                roaring_container_store(roaring_container(&result, a->key), left);
+            }
+            i++;
+        } else if (b && (!a || b->key < a->key)) {
+            if (operation == ROARING_OR) {
+                roaring_container_bits(b, right);
+                roaring_container_store(roaring_container(&result, b->key), right);
+            }
+            j++;
+        } else {
+            roaring_container_bits(a, left);
+            roaring_container_bits(b, right);
+            bool any = false;
+            for (int w = 0; w < ROARING_WORDS; w++) {
+                left[w] = operation == ROARING_AND ? left[w] & right[w] :
+                          operation == ROARING_OR ? left[w] | right[w] : left[w] & ~right[w];
+                any = any || left[w];
+            }
+            if (any) roaring_container_store(roaring_container(&result, a->key), left);
+            i++;
+            j++;
+        }
+    }
+    
+    roaring_free(bitmap);
+    *bitmap = result;
+}
+
+long roaring_cardinality(const Roaring* bitmap) {
+    long count = 0;
+    for (int i = 0; i < bitmap->count; i++) count += bitmap->containers[i].cardinality;
+    return count;
+}
+
+// Appends the file positions of every set row, ascending
+void roaring_positions(const Roaring* bitmap, PositionList* out) {
+    for (int i = 0; i < bitmap->count; i++) {
+        const RoaringContainer* container = &bitmap->containers[i];
+        long base = (long)container->key << 16;
+        if (container->bits) {
+            for (int w = 0; w < ROARING_WORDS; w++) {
+                uint64_t word = container->bits[w];
+                while (word) {
+                    position_list_add(out, row_position(base + w * 64 + __builtin_ctzll(word)));
+                    word &= word - 1;
+                }
+            }
+        } else {
+            for (int j = 0; j < container->cardinality; j++) {
+                position_list_add(out, row_position(base + container->array[j]));
+            }
+        }
+    }
+}
+
+void roaring_free(Roaring* bitmap) {
+    for (int i = 0; i < bitmap->count; i++) {
+        free(bitmap->containers[i].array);
+        free(bitmap->containers[i].bits);
+    }
+    free(bitmap->containers);
+    memset(bitmap, 0, sizeof(Roaring));
+}
+
+bool roaring_contains(const Roaring* bitmap, long row) {
+    uint32_t key = (uint32_t)(row >> 16);
+    uint16_t low = (uint16_t)(row & 0xFFFF);
+    int left = 0, right = bitmap->count - 1;
+    while (left <= right) {
+        int middle = (left + right) / 2;
+        const RoaringContainer* container = &bitmap->containers[middle];
+        if (container->key < key) {
+            left = middle + 1;
+        } else if (container->key > key) {
+            right = middle - 1;
+        } else if (container->bits) {
+            return (container->bits[low >> 6] >> (low & 63)) & 1;
+        } else {
+            int first = 0, last = container->cardinality - 1;
+            while (first <= last) {
+                int at = (first + last) / 2;
+                if (container->array[at] == low) return true;
+                if (container->array[at] < low) first = at + 1;
+                else last = at - 1;
+            }
+            return false;
+        }
+    }
+    return false;
+}
+
+// Bitsets that drop to ROARING_ARRAY_MAX rows turn back into arrays and
+// empty containers are dropped
+void roaring_remove(Roaring* bitmap, long row) {
+    if (!roaring_contains(bitmap, row)) return;
+    uint16_t low = (uint16_t)(row & 0xFFFF);
+    int index = 0;
+    while (bitmap->containers[index].key != (uint32_t)(row >> 16)) index++;
+    RoaringContainer* container = &bitmap->containers[index];
+    
+    if (container->bits) {
+        uint64_t words[ROARING_WORDS];
+        roaring_container_bits(container, words);
+        words[low >> 6] &= ~(1ULL << (low & 63));
+        roaring_container_store(container, words);
+    } else {
+        int position = 0;
+        while (container->array[position] != low) position++;
+        memmove(&container->array[position], &container->array[position + 1],
+                (container->cardinality - position - 1) * sizeof(uint16_t));
+        container->cardinality--;
+    }
+    if (container->cardinality > 0) return;
+    free(container->array);
+    free(container->bits);
+    memmove(container, container + 1, (bitmap->count - index - 1) * sizeof(RoaringContainer));
+    bitmap->count--;
+}
+
+// Smallest row in the bitmap, -1 when empty
+long roaring_first(const Roaring* bitmap) {
+    if (bitmap->count == 0) return -1;
+    const RoaringContainer* container = &bitmap->containers[0];
+    long base = (long)container->key << 16;
+    if (!container->bits) return base + container->array[0];
+    for (int w = 0; w < ROARING_WORDS; w++) {
+        if (container->bits[w]) return base + w * 64 + __builtin_ctzll(container->bits[w]);
+    }
+    return -1;
+}
+
+// Keeps only rows in [first_row, end_row); containers straddling a bound
+// are trimmed through their bitset
+void roaring_trim(Roaring* bitmap, long first_row, long end_row) {
+    int kept = 0;
+    for (int i = 0; i < bitmap->count; i++) {
+        RoaringContainer* container = &bitmap->containers[i];
+        long base = (long)container->key << 16;
+        if (base + 65536 > first_row && base < end_row) {
+            if (base < first_row || base + 65536 > end_row) {
+                uint64_t words[ROARING_WORDS];
+                roaring_container_bits(container, words);
+                for (long row = base; row < first_row; row++) words[(row - base) >> 6] &= ~(1ULL << ((row - base) & 63));
+                for (long row = end_row > base ? end_row : base; row < base + 65536; row++) {
+                    words[(row - base) >> 6] &= ~(1ULL << ((row - base) & 63));
+                }
+                roaring_container_store(container, words);
+            }
+            if (container->cardinality > 0) {
+                bitmap->containers[kept++] = *container;
+                continue;
+            }
+        }
+        free(container->array);
+        free(container->bits);
+    }
+    bitmap->count = kept;
+}
+
+bool roaring_save(const Roaring* bitmap, FILE* file) {
+    fwrite(&bitmap->count, sizeof(int), 1, file);
+    for (int i = 0; i < bitmap->count; i++) {
+        const RoaringContainer* container = &bitmap->containers[i];
+        bool dense = container->bits != NULL;
+        fwrite(&container->key, sizeof(uint32_t), 1, file);
+        fwrite(&container->cardinality, sizeof(int), 1, file);
+        fwrite(&dense, sizeof(bool), 1, file);
+        if (dense) fwrite(container->bits, sizeof(uint64_t), ROARING_WORDS, file);
+        else fwrite(container->array, sizeof(uint16_t), container->cardinality, file);
+    }
+    return !ferror(file);
+}
+
+bool roaring_load(Roaring* bitmap, FILE* file) {
+    memset(bitmap, 0, sizeof(Roaring));
+    int count;
+    if (fread(&count, sizeof(int), 1, file) != 1 || count < 0) return false;
+    for (int i = 0; i < count; i++) {
+        uint32_t key;
+        int cardinality;
+        bool dense;
+        if (fread(&key, sizeof(uint32_t), 1, file) != 1 || fread(&cardinality, sizeof(int), 1, file) != 1 ||
+            fread(&dense, sizeof(bool), 1, file) != 1 || cardinality <= 0 || cardinality > 65536) {
+            roaring_free(bitmap);
+            return false;
+        }
+        uint64_t words[ROARING_WORDS] = {0};
+        bool complete;
+        if (dense) {
+            complete = fread(words, sizeof(uint64_t), ROARING_WORDS, file) == ROARING_WORDS;
+        } else {
+            uint16_t* rows = malloc(cardinality * sizeof(uint16_t));
+            complete = fread(rows, sizeof(uint16_t), cardinality, file) == (size_t)cardinality;
+            for (int j = 0; complete && j < cardinality; j++) words[rows[j] >> 6] |= 1ULL << (rows[j] & 63);
+            free(rows);
+        }
+        if (!complete) {
+            roaring_free(bitmap);
+            return false;
+        }
+        roaring_container_store(roaring_container(bitmap, key), words);
+    }
+    return true;
+}
+
+// Bitmap indexes keep a short list of distinct keys, each with its rows
+void bitmap_index_add(BitmapIndex* index, const char* key, long row) {
+    int i = 0;
+    while (i < index->count && strcmp(index->values[i].key, key) != 0) i++;
+    if (i == index->count) {
+        if (index->count == index->capacity) {
+            index->capacity = index->capacity ? index->capacity * 2 : 8;
+            index->values = realloc(index->values, index->capacity * sizeof(BitmapValue));
+        }
+        memset(&index->values[i], 0, sizeof(BitmapValue));
+        snprintf(index->values[i].key, sizeof(index->values[i].key), "%s", key);
+        index->count++;
+    }
+    roaring_add(&index->values[i].rows, row);
+}
+
+void bitmap_index_remove(BitmapIndex* index, const char* key, long row) {
+    for (int i = 0; i < index->count; i++) {
+        if (strcmp(index->values[i].key, key) == 0) {
+            roaring_remove(&index->values[i].rows, row);
+            return;
+        }
+    }
+}
+
+void bitmap_index_free(BitmapIndex* index) {
+    if (!index) return;
+    for (int i = 0; i < index->count; i++) roaring_free(&index->values[i].rows);
+    free(index->values);
+    free(index);
+}
+
+void bitmap_index_prune(BitmapIndex* index, long first_row, long end_row) {
+    for (int v = 0; v < index->count; v++) roaring_trim(&index->values[v].rows, first_row, end_row);
+}
+
+// Rows matching one condition on a bitmap-indexed field: the union of the
+// bitmaps of every key the condition accepts. Each row has exactly one key,
+// so negated conditions come out exact as well.
+bool bitmap_condition(const WhereCondition* condition, Roaring* out) {
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, condition->field_name) != 0) continue;
+        BitmapIndex* index = current_table.bitmap_indexes[i];
+        if (current_table.fields[i].index != INDEX_BITMAP || !index) return false;
+        
+        memset(out, 0, sizeof(Roaring));
+        for (int v = 0; v < index->count; v++) {
+            if (condition_matches_value(condition, index->values[v].key, current_table.fields[i].type)) {
+                roaring_combine(out, &index->values[v].rows, ROARING_OR);
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+// Folds the whole WHERE clause left to right, like check_complex_conditions(),
+// when every condition is on a bitmap-indexed field
+bool bitmap_evaluate(WhereCondition* conditions, int condition_count, Roaring* out) {
+    if (conditions == NULL || condition_count == 0) return false;
+    for (int c = 0; c < condition_count; c++) {
+        bool indexed = false;
+        for (int i = 0; i < current_table.field_count; i++) {
+            if (strcmp(current_table.fields[i].name, conditions[c].field_name) == 0) {
+                indexed = current_table.fields[i].index == INDEX_BITMAP;
+            }
+        }
+        if (!indexed) return false;
+    }
+    
+    bitmap_condition(&conditions[0], out);
+    for (int c = 1; c < condition_count; c++) {
+        Roaring rows;
+        bitmap_condition(&conditions[c], &rows);
+        roaring_combine(out, &rows, conditions[c].is_and ? ROARING_AND : ROARING_OR);
+        roaring_free(&rows);
+    }
+    if (has_tombstones()) roaring_combine(out, current_table.tombstones, ROARING_AND_NOT);
+    return true;
+}
+
+// Hash indexes
+static uint32_t hash_index_tag(const char* key) {
+    uint64_t hash = group_key_hash((const unsigned char*)key, strlen(key));
+    return (uint32_t)(hash ^ (hash >> 32)) | 1;
+}
+
+static long hash_index_home(const HashIndex* index, uint32_t tag) {
+    return (long)(((uint64_t)tag * 0x9E3779B97F4A7C15ULL) >> (64 - index->bucket_bits));
+}
+
+HashIndex* hash_index_create(int bucket_bits) {
+    HashIndex* index = calloc(1, sizeof(HashIndex));
+    index->bucket_bits = bucket_bits;
+    index->buckets = aligned_alloc(64, (1L << bucket_bits) * sizeof(HashBucket));
+    memset(index->buckets, 0, (1L << bucket_bits) * sizeof(HashBucket));
+    return index;
+}
+
+static void hash_index_place(HashIndex* index, uint32_t tag, uint32_t row) {
+    long mask = (1L << index->bucket_bits) - 1;
+    for (long b = hash_index_home(index, tag); ; b = (b + 1) & mask) {
+        HashBucket* bucket = &index->buckets[b];
+        for (int i = 0; i < HASH_BUCKET_SLOTS; i++) {
+            if (bucket->tags[i] == 0) {
+                bucket->tags[i] = tag;
+                bucket->rows[i] = row;
+                return;
+            }
+        }
+    }
+}
+
+// Doubles the table once it is three quarters full; tags are enough to rehash
+void hash_index_add(HashIndex* index, const char* key, long row) {
+    long slots = (1L << index->bucket_bits) * HASH_BUCKET_SLOTS;
+    if ((index->used + 1) * 4 > slots * 3) {
+        HashBucket* old = index->buckets;
+        long old_count = 1L << index->bucket_bits;
+        index->bucket_bits++;
+        index->buckets = aligned_alloc(64, (1L << index->bucket_bits) * sizeof(HashBucket));
+        memset(index->buckets, 0, (1L << index->bucket_bits) * sizeof(HashBucket));
+        index->used = 0;
+        for (long b = 0; b < old_count; b++) {
+            for (int i = 0; i < HASH_BUCKET_SLOTS; i++) {
+                if (old[b].tags[i] & 1) {
+                    hash_index_place(index, old[b].tags[i], old[b].rows[i]);
+                    index->used++;
+                }
+            }
+        }
+        free(old);
+    }
+    hash_index_place(index, hash_index_tag(key), (uint32_t)row);
+    index->used++;
+    index->dirty = true;
+}
+
+// Usually a single bucket; probing stops at the first bucket with a free slot
+void hash_index_lookup(const HashIndex* index, const char* key, PositionList* out) {
+    uint32_t tag = hash_index_tag(key);
+    long mask = (1L << index->bucket_bits) - 1;
+    for (long b = hash_index_home(index, tag); ; b = (b + 1) & mask) {
+        const HashBucket* bucket = &index->buckets[b];
+        bool full = true;
+        for (int i = 0; i < HASH_BUCKET_SLOTS; i++) {
+            if (bucket->tags[i] == tag) position_list_add(out, row_position(bucket->rows[i]));
+            full = full && bucket->tags[i] != 0;
+        }
+        if (!full) return;
+    }
+}
+
+// The slot stays taken, so used is left alone
+void hash_index_remove(HashIndex* index, const char* key, long row) {
+    uint32_t tag = hash_index_tag(key);
+    long mask = (1L << index->bucket_bits) - 1;
+    for (long b = hash_index_home(index, tag); ; b = (b + 1) & mask) {
+        HashBucket* bucket = &index->buckets[b];
+        bool full = true;
+        for (int i = 0; i < HASH_BUCKET_SLOTS; i++) {
+            if (bucket->tags[i] == tag && bucket->rows[i] == (uint32_t)row) {
+                bucket->tags[i] = HASH_TAG_REMOVED;
+                index->dirty = true;
+                return;
+            }
+            full = full && bucket->tags[i] != 0;
+        }
+        if (!full) return;
+    }
+}
+
+bool hash_index_save(HashIndex* index, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) return false;
+    
+    fwrite("ODQHSH1", 8, 1, file);
+    fwrite(&index->bucket_bits, sizeof(int), 1, file);
+    fwrite(&index->used, sizeof(long), 1, file);
+    fwrite(&index->indexed_rows, sizeof(long), 1, file);
+    fwrite(index->buckets, sizeof(HashBucket), 1L << index->bucket_bits, file);
+    bool written = !ferror(file);
+    fclose(file);
+    if (written) index->dirty = false;
+    return written;
+}
+
+// Returns NULL when the file is missing or was written for a different row count
+HashIndex* hash_index_load(const char* filename, long expected_rows) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return NULL;
+    
+    char magic[8];
+    int bucket_bits;
+    long used, indexed_rows;
+    if (fread(magic, 8, 1, file) != 1 || memcmp(magic, "ODQHSH1", 8) != 0 ||
+        fread(&bucket_bits, sizeof(int), 1, file) != 1 || bucket_bits < 1 || bucket_bits > 40 ||
+        fread(&used, sizeof(long), 1, file) != 1 ||
+        fread(&indexed_rows, sizeof(long), 1, file) != 1 || indexed_rows != expected_rows) {
+        fclose(file);
+        return NULL;
+    }
+    
+    HashIndex* index = hash_index_create(bucket_bits);
+    index->used = used;
+    index->indexed_rows = indexed_rows;
+    long buckets = 1L << bucket_bits;
+    bool complete = fread(index->buckets, sizeof(HashBucket), buckets, file) == (size_t)buckets;
+    fclose(file);
+    
+    if (!complete) {
+        hash_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+// Rehashes the slots of rows in [first_row, end_row); the tags are enough
+void hash_index_prune(HashIndex* index, long first_row, long end_row) {
+    HashBucket* old = index->buckets;
+    long bucket_count = 1L << index->bucket_bits;
+    index->buckets = aligned_alloc(64, bucket_count * sizeof(HashBucket));
+    memset(index->buckets, 0, bucket_count * sizeof(HashBucket));
+    index->used = 0;
+    for (long b = 0; b < bucket_count; b++) {
+        for (int i = 0; i < HASH_BUCKET_SLOTS; i++) {
+            if ((old[b].tags[i] & 1) && old[b].rows[i] >= first_row && old[b].rows[i] < end_row) {
+                hash_index_place(index, old[b].tags[i], old[b].rows[i]);
+                index->used++;
+            }
+        }
+    }
+    free(old);
+    index->dirty = true;
+}
+
+void hash_index_free(HashIndex* index) {
+    if (!index) return;
+    free(index->buckets);
+    free(index);
+}
+
+// Zone maps
+static void bloom_add(uint64_t* bloom, const char* key) {
+    uint64_t hash = group_key_hash((const unsigned char*)key, strlen(key));
+    uint64_t step = (hash >> 32) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++, hash += step) {
+        uint64_t bit = hash & (BLOOM_WORDS * 64 - 1);
+        bloom[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static bool bloom_may_contain(const uint64_t* bloom, const char* key) {
+    uint64_t hash = group_key_hash((const unsigned char*)key, strlen(key));
+    uint64_t step = (hash >> 32) | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++, hash += step) {
+        uint64_t bit = hash & (BLOOM_WORDS * 64 - 1);
+        if (!(bloom[bit / 64] & (1ULL << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+// Also called for rows already covered, after an UPDATE: the block bounds
+// only widen and the bloom gains the new key
+void zone_map_add(ZoneMap* map, long row, const char* record) {
+    long block = row / ZONE_ROWS;
+    bool first = block >= map->count;
+    if (first) {
+        map->zones = realloc(map->zones, (block + 1) * sizeof(Zone));
+        memset(map->zones + map->count, 0, (block + 1 - map->count) * sizeof(Zone));
+        for (int i = 0; i < current_table.field_count; i++) {
+            if (current_table.fields[i].index != INDEX_BLOOM) continue;
+            map->blooms[i] = realloc(map->blooms[i], (block + 1) * BLOOM_WORDS * sizeof(uint64_t));
+            memset(map->blooms[i] + map->count * BLOOM_WORDS, 0,
+                   (block + 1 - map->count) * BLOOM_WORDS * sizeof(uint64_t));
+        }
+        map->count = block + 1;
+    }
+    
+    Zone* zone = &map->zones[block];
+    int offset = 0;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.fields[i].type == FIELD_INT) {
+            int value;
+            memcpy(&value, record + offset, sizeof(int));
+            if (first || value < zone->min[i]) zone->min[i] = value;
+            if (first || value > zone->max[i]) zone->max[i] = value;
+        }
+        if (map->blooms[i]) {
+            char key[256];
+            record_field_key(record, i, key, sizeof(key));
+            bloom_add(map->blooms[i] + block * BLOOM_WORDS, key);
+        }
+        offset += current_table.fields[i].size;
+    }
+    if (row >= map->indexed_rows) map->indexed_rows = row + 1;
+    map->dirty = true;
+}
+
+bool zone_map_save(ZoneMap* map, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) return false;
+    
+    fwrite("ODQZON2", 8, 1, file);
+    fwrite(&map->indexed_rows, sizeof(long), 1, file);
+    fwrite(&map->count, sizeof(long), 1, file);
+    fwrite(map->zones, sizeof(Zone), map->count, file);
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (map->blooms[i]) fwrite(map->blooms[i], sizeof(uint64_t), map->count * BLOOM_WORDS, file);
+    }
+    bool written = !ferror(file);
+    fclose(file);
+    if (written) map->dirty = false;
+    return written;
+}
+
+// Returns NULL when the file is missing or was written for a different row count
+ZoneMap* zone_map_load(const char* filename, long expected_rows) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return NULL;
+    
+    char magic[8];
+    ZoneMap* map = calloc(1, sizeof(ZoneMap));
+    if (fread(magic, 8, 1, file) != 1 || memcmp(magic, "ODQZON2", 8) != 0 ||
+        fread(&map->indexed_rows, sizeof(long), 1, file) != 1 || map->indexed_rows != expected_rows ||
+        fread(&map->count, sizeof(long), 1, file) != 1 ||
+        map->count != (expected_rows + ZONE_ROWS - 1) / ZONE_ROWS) {
+        fclose(file);
+        free(map);
+        return NULL;
+    }
+    
+    map->zones = malloc((map->count ? map->count : 1) * sizeof(Zone));
+    bool complete = fread(map->zones, sizeof(Zone), map->count, file) == (size_t)map->count;
+    for (int i = 0; i < current_table.field_count && complete; i++) {
+        if (current_table.fields[i].index != INDEX_BLOOM) continue;
+        size_t words = map->count * BLOOM_WORDS;
+        map->blooms[i] = malloc((words ? words : 1) * sizeof(uint64_t));
+        complete = fread(map->blooms[i], sizeof(uint64_t), words, file) == words;
+    }
+    fclose(file);
+    
+    if (!complete) {
+        zone_map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void zone_map_free(ZoneMap* map) {
+    if (!map) return;
+    for (int i = 0; i < MAX_FIELDS; i++) free(map->blooms[i]);
+    free(map->zones);
+    free(map);
+}
+
+void zone_filename(char* out, size_t size) {
+    snprintf(out, size, "%s_%s.zone", TABLE_PREFIX, current_table.name);
+}
+
+// Deleted rows are kept as a roaring bitmap of row numbers in ODQ_<table>.del
+void tombstone_filename(char* out, size_t size, const char* table_name) {
+    snprintf(out, size, "%s_%s.del", TABLE_PREFIX, table_name);
+}
+
+// Always returns a bitmap, empty when the table has no deleted rows
+Roaring* tombstones_load(const char* table_name) {
+    char filename[150];
+    tombstone_filename(filename, sizeof(filename), table_name);
+    Roaring* tombstones = calloc(1, sizeof(Roaring));
+    FILE* file = fopen(filename, "rb");
+    if (!file) return tombstones;
+    
+    char magic[8];
+    if (fread(magic, 8, 1, file) != 1 || memcmp(magic, "ODQDEL1", 8) != 0 || !roaring_load(tombstones, file)) {
+        printf("Error reading deleted rows from '%s'\n", filename);
+    }
+    fclose(file);
+    return tombstones;
+}
+
+// Written on every DELETE; the file goes away once VACUUM empties the bitmap
+void tombstones_save() {
+    char filename[150];
+    tombstone_filename(filename, sizeof(filename), current_table.name);
+    if (!has_tombstones()) {
+        unlink(filename);
+        return;
+    }
+    
+    FILE* file = fopen(filename, "wb");
+    bool written = file != NULL;
+    if (file) {
+        fwrite("ODQDEL1", 8, 1, file);
+        written = roaring_save(current_table.tombstones, file);
+        written = fclose(file) == 0 && written;
+    }
+    if (!written) printf("Error saving deleted rows of '%s'\n", current_table.name);
+}
+
+bool has_tombstones() {
+    return current_table.tombstones && current_table.tombstones->count > 0;
+}
+
+bool row_deleted(long row) {
+    return has_tombstones() && roaring_contains(current_table.tombstones, row);
+}
+
+// False only when no int value between the block's min and max, or no key
+// in its Bloom filter, can satisfy the condition; anything the zone map
+// cannot judge may match
+static bool zone_condition_may_match(long block, const WhereCondition* condition) {
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, condition->field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    if (field_index == -1 || condition->negated) return true;
+    
+    Field field = current_table.fields[field_index];
+    const uint64_t* bloom = current_table.zone_map->blooms[field_index];
+    if (bloom) {
+        bloom += block * BLOOM_WORDS;
+        if (condition->in_list) {
+            for (int v = 0; v < condition->in_list->count; v++) {
+                if (bloom_may_contain(bloom, condition->in_list->values[v])) return true;
+            }
+            return false;
+        }
+        // Equality compares the formatted value verbatim, as the filter does
+        if ((strcmp(condition->operator, "=") == 0 || strcmp(condition->operator, "==") == 0) &&
+            !bloom_may_contain(bloom, condition->value)) {
+            return false;
+        }
+    }
+    if (field.type != FIELD_INT) return true;
+    
+    const Zone* zone = &current_table.zone_map->zones[block];
+    long min = zone->min[field_index], max = zone->max[field_index];
+    
+    if (condition->in_list) {
+        for (int v = 0; v < condition->in_list->count; v++) {
+            long value = atol(condition->in_list->values[v]);
+            if (value >= min && value <= max) return true;
+        }
+        return false;
+    }
+    if (strcmp(condition->operator, "!=") == 0) {
+        return min != max || min != atol(condition->value);
+    }
+    
+    KeyRange range;
+    bool exact;
+    if (!condition_key_range(condition, FIELD_INT, &range, &exact)) return true;
+    if (range.has_lower) {
+        long lower = atol(range.lower);
+        if (max < lower || (max == lower && !range.lower_inclusive)) return false;
+    }
+    if (range.has_upper) {
+        long upper = atol(range.upper);
+        if (min > upper || (min == upper && !range.upper_inclusive)) return false;
+    }
+    return true;
+}
+
+// Folds the conditions left to right like check_complex_conditions()
+bool zone_may_match(long block, WhereCondition* conditions, int condition_count) {
+    if (condition_count == 0) return true;
+    bool result = zone_condition_may_match(block, &conditions[0]);
+    for (int i = 1; i < condition_count; i++) {
+        bool current_result = zone_condition_may_match(block, &conditions[i]);
+        result = conditions[i].is_and ? result && current_result : result || current_result;
+    }
+    return result;
+}
+
+// Called as a sequential scan reaches a block boundary: returns the first
+// row of the next block the zone map does not rule out
+long zone_next_row(long row, WhereCondition* conditions, int condition_count) {
+    ZoneMap* map = current_table.zone_map;
+    if (!map || condition_count == 0 || row % ZONE_ROWS != 0) return row;
+    
+    long next = row;
+    while (next / ZONE_ROWS < map->count &&
+           !zone_may_match(next / ZONE_ROWS, conditions, condition_count)) {
+        next += ZONE_ROWS;
+    }
+    return next;
+}
+
+// Strips a trailing "LIMIT n [OFFSET m]" outside quotes from the query
+bool parse_limit_clause(char* query, RowLimit* limit) {
+    limit->limit = -1;
+    limit->offset = 0;
+    limit->skipped = 0;
+    limit->returned = 0;
+    
+    char* clause = NULL;
+    bool quoted = false;
+    for (char* p = query; *p; p++) {
+        if (*p == '\'') quoted = !quoted;
+        else if (!quoted && strncmp(p, "LIMIT", 5) == 0 && (p == query || p[-1] == ' ') &&
+                 (p[5] == ' ' || p[5] == '\0')) {
+            clause = p;
+        }
+    }
+    if (!clause) return true;
+    
+    int consumed = 0;
+    if (sscanf(clause, "LIMIT %ld %n", &limit->limit, &consumed) != 1 || limit->limit < 0) return false;
+    if (clause[consumed] != '\0') {
+        int rest = 0;
+        if (sscanf(clause + consumed, "OFFSET %ld %n", &limit->offset, &rest) != 1 ||
+            limit->offset < 0 || clause[consumed + rest] != '\0') {
+            return false;
+        }
+    }
+    *clause = '\0';
+    while (clause > query && clause[-1] == ' ') *--clause = '\0';
+    return true;
+}
+
+// Counts a matching row against the limit; false means the row is skipped
+bool row_limit_take(RowLimit* limit) {
+    if (limit->skipped < limit->offset) {
+        limit->skipped++;
+        return false;
+    }
+    limit->returned++;
+    return true;
+}
+
+bool row_limit_done(const RowLimit* limit) {
+    return limit->limit >= 0 && limit->returned >= limit->limit;
+}
+
+// Strips a trailing "ORDER BY field [ASC|DESC]" outside quotes
+bool parse_order_clause(char* query, OrderBy* order) {
+    order->field_name[0] = '\0';
+    order->descending = false;
+    
+    char* clause = NULL;
+    bool quoted = false;
+    for (char* p = query; *p; p++) {
+        if (*p == '\'') quoted = !quoted;
+        else if (!quoted && strncmp(p, "ORDER BY", 8) == 0 && (p == query || p[-1] == ' ')) clause = p;
+    }
+    if (!clause) return true;
+    
+    char direction[8] = {0};
+    int consumed = 0;
+    int parsed = sscanf(clause + 8, " %29s %7s %n", order->field_name, direction, &consumed);
+    if (parsed < 1) return false;
+    if (parsed == 2) {
+        if (strcasecmp(direction, "DESC") == 0) order->descending = true;
+        else if (strcasecmp(direction, "ASC") != 0) return false;
+        if (clause[8 + consumed] != '\0') return false;
+    }
+    
+    *clause = '\0';
+    while (clause > query && clause[-1] == ' ') *--clause = '\0';
+    return true;
+}
+
+// Trigram index functions
+static unsigned int trigram_code(const char* p) {
+    return ((unsigned char)p[0] << 16) | ((unsigned char)p[1] << 8) | (unsigned char)p[2];
+}
+
+TrigramIndex* trigram_index_create() {
+    TrigramIndex* index = calloc(1, sizeof(TrigramIndex));
+    index->slot_count = TRIGRAM_INITIAL_SLOTS;
+    index->slots = calloc(index->slot_count, sizeof(TrigramPosting));
+    return index;
+}
+
+void trigram_index_free(TrigramIndex* index) {
+    if (!index) return;
+    for (int i = 0; i < index->slot_count; i++) {
+        free(index->slots[i].positions);
+    }
+    free(index->slots);
+    free(index);
+}
+
+static TrigramPosting* trigram_slot(TrigramIndex* index, unsigned int trigram) {
+    unsigned int mask = index->slot_count - 1;
+    unsigned int slot = (trigram * 2654435761u) & mask;
+    while (index->slots[slot].trigram != 0 && index->slots[slot].trigram != trigram) {
+        slot = (slot + 1) & mask;
+    }
+    return &index->slots[slot];
+}
+
+static void trigram_index_grow(TrigramIndex* index) {
+    TrigramPosting* old_slots = index->slots;
+    int old_count = index->slot_count;
+
+    index->slot_count *= 2;
+    index->slots = calloc(index->slot_count, sizeof(TrigramPosting));
+    for (int i = 0; i < old_count; i++) {
+        if (old_slots[i].trigram != 0) {
+            *trigram_slot(index, old_slots[i].trigram) = old_slots[i];
+        }
+    }
+    free(old_slots);
+}
+
+static TrigramPosting* trigram_find(TrigramIndex* index, unsigned int trigram, bool create) {
+    TrigramPosting* posting = trigram_slot(index, trigram);
+    if (posting->trigram != 0 || !create) {
+        return posting->trigram != 0 ? posting : NULL;
+    }
+
+    if ((index->used + 1) * 10 > index->slot_count * 7) {
+        trigram_index_grow(index);
+        posting = trigram_slot(index, trigram);
+    }
+    posting->trigram = trigram;
+    index->used++;
+    return posting;
+}
+
+// Positions arrive in file order, so posting lists stay sorted
+static int trigram_posting_bound(const TrigramPosting* posting, long position) {
+    int low = 0, high = posting->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (posting->positions[middle] < position) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Postings stay sorted; rows usually arrive in file order, so this appends
+void trigram_index_add(TrigramIndex* index, const char* text, int size, long position) {
+    for (int i = 0; i + 2 < size && text[i + 2] != '\0'; i++) {
+        if (text[i] == '\0' || text[i + 1] == '\0') break;
+
+        TrigramPosting* posting = trigram_find(index, trigram_code(text + i), true);
+        int slot = posting->count;
+        if (slot > 0 && posting->positions[slot - 1] >= position) {
+            slot = trigram_posting_bound(posting, position);
+            if (posting->positions[slot] == position) continue;
+        }
+
+        if (posting->count == posting->capacity) {
+            posting->capacity = posting->capacity ? posting->capacity * 2 : 4;
+            posting->positions = realloc(posting->positions, posting->capacity * sizeof(long));
+        }
+        memmove(&posting->positions[slot + 1], &posting->positions[slot], (posting->count - slot) * sizeof(long));
+        posting->positions[slot] = position;
+        posting->count++;
+    }
+    index->dirty = true;
+}
+
+void trigram_index_remove(TrigramIndex* index, const char* text, int size, long position) {
+    for (int i = 0; i + 2 < size && text[i + 2] != '\0'; i++) {
+        if (text[i] == '\0' || text[i + 1] == '\0') break;
+
+        TrigramPosting* posting = trigram_find(index, trigram_code(text + i), false);
+        if (!posting) continue;
+        int slot = trigram_posting_bound(posting, position);
+        if (slot == posting->count || posting->positions[slot] != position) continue;
+        memmove(&posting->positions[slot], &posting->positions[slot + 1], (posting->count - slot - 1) * sizeof(long));
+        posting->count--;
+    }
+    index->dirty = true;
+}
+
+// Cuts the sorted posting lists down to positions in [from, to)
+void trigram_index_prune(TrigramIndex* index, long from, long to) {
+    for (int i = 0; i < index->slot_count; i++) {
+        TrigramPosting* posting = &index->slots[i];
+        int first = trigram_posting_bound(posting, from);
+        int end = trigram_posting_bound(posting, to);
+        memmove(posting->positions, posting->positions + first, (end - first) * sizeof(long));
+        posting->count = end - first;
+    }
+    index->dirty = true;
+}
+
+// Rows that can contain the literal; false when it is too short to use the index
+bool trigram_candidates(TrigramIndex* index, const char* literal, int length, PositionList* out) {
+    if (length < 3) return false;
+
+    TrigramPosting* shortest = NULL;
+    for (int i = 0; i + 2 < length; i++) {
+        TrigramPosting* posting = trigram_find(index, trigram_code(literal + i), false);
+        if (!posting) {
+            out->count = 0;
+            return true;
+        }
+        if (!shortest || posting->count < shortest->count) shortest = posting;
+    }
+
+    out->count = 0;
+    for (int i = 0; i < shortest->count; i++) {
+        position_list_add(out, shortest->positions[i]);
+    }
+
+    for (int i = 0; i + 2 < length && out->count > 0; i++) {
+        TrigramPosting* posting = trigram_find(index, trigram_code(literal + i), false);
+        if (posting == shortest) continue;
+        PositionList other = { posting->positions, posting->count, posting->capacity };
+        position_list_intersect(out, &other);
+    }
+    return true;
+}
+
+bool trigram_index_save(TrigramIndex* index, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) return false;
+
+    fwrite("ODQTRI1", 8, 1, file);
+    fwrite(&index->indexed_rows, sizeof(long), 1, file);
+    fwrite(&index->used, sizeof(int), 1, file);
+    for (int i = 0; i < index->slot_count; i++) {
+        TrigramPosting* posting = &index->slots[i];
+        if (posting->trigram == 0) continue;
+        fwrite(&posting->trigram, sizeof(unsigned int), 1, file);
+        fwrite(&posting->count, sizeof(int), 1, file);
+        fwrite(posting->positions, sizeof(long), posting->count, file);
+    }
+    fclose(file);
+    index->dirty = false;
+    return true;
+}
+
+// Returns NULL when the file is missing or was written for a different row count
+TrigramIndex* trigram_index_load(const char* filename, long expected_rows) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return NULL;
+
+    char magic[8];
+    long indexed_rows;
+    int used;
+    if (fread(magic, 8, 1, file) != 1 || memcmp(magic, "ODQTRI1", 8) != 0 ||
+        fread(&indexed_rows, sizeof(long), 1, file) != 1 || indexed_rows != expected_rows ||
+        fread(&used, sizeof(int), 1, file) != 1) {
+        fclose(file);
+        return NULL;
+    }
+
+    TrigramIndex* index = trigram_index_create();
+    bool complete = true;
+    for (int i = 0; i < used && complete; i++) {
+        unsigned int trigram;
+        int count;
+        if (fread(&trigram, sizeof(unsigned int), 1, file) != 1 ||
+            fread(&count, sizeof(int), 1, file) != 1 || trigram == 0 || count <= 0) {
+            complete = false;
+            break;
+        }
+        TrigramPosting* posting = trigram_find(index, trigram, true);
+        posting->positions = malloc(count * sizeof(long));
+        posting->capacity = count;
+        posting->count = fread(posting->positions, sizeof(long), count, file);
+        complete = posting->count == count;
+    }
+    fclose(file);
+
+    if (!complete) {
+        trigram_index_free(index);
+        return NULL;
+    }
+    index->indexed_rows = indexed_rows;
+    return index;
+}
+
+// FM-index functions
+// Suffix array by prefix doubling with radix sort, O(n log n)
+static void fm_suffix_array(const unsigned char* text, int32_t n, int32_t* sa) {
+    int32_t* rank = malloc(n * sizeof(int32_t));
+    int32_t* tmp = malloc(n * sizeof(int32_t));
+    int32_t buckets = n > 256 ? n : 256;
+    int32_t* count = calloc(buckets + 1, sizeof(int32_t));
+    
+    for (int32_t i = 0; i < n; i++) count[text[i]]++;
+    for (int32_t c = 1; c < 256; c++) count[c] += count[c - 1];
+    for (int32_t i = n - 1; i >= 0; i--) sa[--count[text[i]]] = i;
+    rank[sa[0]] = 0;
+    for (int32_t i = 1; i < n; i++) {
+        rank[sa[i]] = rank[sa[i - 1]] + (text[sa[i]] != text[sa[i - 1]]);
+    }
+    
+    for (int32_t k = 1; rank[sa[n - 1]] < n - 1; k *= 2) {
+        // Order by the second half first: suffixes without one come first
+        int32_t p = 0;
+        for (int32_t i = n - k; i < n; i++) tmp[p++] = i;
+        for (int32_t i = 0; i < n; i++) {
+            if (sa[i] >= k) tmp[p++] = sa[i] - k;
+        }
+        
+        memset(count, 0, (buckets + 1) * sizeof(int32_t));
+        for (int32_t i = 0; i < n; i++) count[rank[i]]++;
+        for (int32_t i = 1; i < n; i++) count[i] += count[i - 1];
+        for (int32_t i = n - 1; i >= 0; i--) sa[--count[rank[tmp[i]]]] = tmp[i];
+        
+        tmp[sa[0]] = 0;
+        for (int32_t i = 1; i < n; i++) {
+            int32_t a = sa[i - 1], b = sa[i];
+            int32_t second_a = a + k < n ? rank[a + k] : -1;
+            int32_t second_b = b + k < n ? rank[b + k] : -1;
+            tmp[b] = tmp[a] + (rank[a] != rank[b] || second_a != second_b);
+        }
+        int32_t* swap = rank;
+        rank = tmp;
+        tmp = swap;
+    }
+    
+    free(rank);
+    free(tmp);
+    free(count);
+}
+
+static void fm_write_section(FILE* file, long* offset, const void* data, size_t size) {
+    static const char padding[64] = {0};
+    long aligned = (*offset + 63) & ~63L;
+    fwrite(padding, aligned - *offset, 1, file);
+    fwrite(data, size, 1, file);
+    *offset = aligned + size;
+}
+
+// Rows are concatenated with a separator so matches never span two rows
+bool fm_index_build(int field_index, const char* filename) {
+    Field field = current_table.fields[field_index];
+    int offset = 0;
+    for (int i = 0; i < field_index; i++) {
+        offset += current_table.fields[i].size;
+    }
+    
+    long first_row = current_table.first_row;
+    long rows = table_row_count() - first_row;
+    long capacity = rows * (field.size + 1) + 1;
+    if (capacity >= INT32_MAX) {
+        printf("Text column is too large for an FM index\n");
+        return false;
+    }
+    
+    unsigned char* text = malloc(capacity);
+    uint32_t* row_starts = malloc((rows ? rows : 1) * sizeof(uint32_t));
+    int32_t n = 0;
+    
+    fseek(current_table.data_file, table_data_start(), SEEK_SET);
+    char record[MAX_RECORD_SIZE];
+    long row = 0;
+    for (; row < rows && fread(record, current_table.record_size, 1, current_table.data_file); row++) {
+        row_starts[row] = n;
+        int length = strnlen(record + offset, field.size);
+        for (int i = 0; i < length; i++) {
+            unsigned char c = record[offset + i];
+            text[n++] = c == FM_ROW_SEPARATOR ? ' ' : c;
+        }
+        text[n++] = FM_ROW_SEPARATOR;
+    }
+    // Row numbers are positions in the text, so a damaged page cannot be left out
+    if (row < rows) {
+        printf("Cannot build the FM index: row %ld could not be read\n", first_row + row);
+        free(text);
+        free(row_starts);
+        return false;
+    }
+    text[n++] = '\0';
+    
+    int32_t* sa = malloc(n * sizeof(int32_t));
+    fm_suffix_array(text, n, sa);
+    
+    FMHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ODQFM2", 7);
+    header.first_row = first_row;
+    header.indexed_rows = first_row + rows;
+    header.text_length = n;
+    header.block = FM_BLOCK;
+    header.sample_rate = FM_SAMPLE_RATE;
+    
+    long frequency[256] = {0};
+    for (int32_t i = 0; i < n; i++) frequency[text[i]]++;
+    memset(header.symbol_of, 255, sizeof(header.symbol_of));
+    for (int c = 0; c < 256; c++) {
+        if (frequency[c] == 0) continue;
+        header.counts[header.sigma + 1] = header.counts[header.sigma] + frequency[c];
+        header.symbol_of[c] = header.sigma++;
+    }
+    
+    unsigned char* bwt = malloc(n);
+    long blocks = n / FM_BLOCK + 1;
+    uint32_t* occ = calloc(blocks * header.sigma, sizeof(uint32_t));
+    long words = n / 64 + 1;
+    uint64_t* sampled = calloc(words, sizeof(uint64_t));
+    uint32_t* sampled_rank = malloc(words * sizeof(uint32_t));
+    uint32_t* samples = malloc((n / FM_SAMPLE_RATE + 1) * sizeof(uint32_t));
+    uint32_t running[256] = {0};
+    
+    for (int32_t i = 0; i < n; i++) {
+        if (i % FM_BLOCK == 0) {
+            memcpy(occ + (i / FM_BLOCK) * header.sigma, running, header.sigma * sizeof(uint32_t));
+        }
+        bwt[i] = text[sa[i] > 0 ? sa[i] - 1 : n - 1];
+        running[header.symbol_of[bwt[i]]]++;
+        if (sa[i] % FM_SAMPLE_RATE == 0) sampled[i / 64] |= 1ULL << (i % 64);
+    }
+    if (n % FM_BLOCK == 0) {
+        memcpy(occ + (n / FM_BLOCK) * header.sigma, running, header.sigma * sizeof(uint32_t));
+    }
+    
+    long sample_count = 0;
+    for (long w = 0; w < words; w++) {
+        sampled_rank[w] = sample_count;
+        for (int b = 0; b < 64 && w * 64 + b < n; b++) {
+            if (sampled[w] & (1ULL << b)) samples[sample_count++] = sa[w * 64 + b];
+        }
+    }
+    free(sa);
+    free(text);
+    
+    FILE* file = fopen(filename, "wb");
+    bool written = file != NULL;
+    if (file) {
+        long position = sizeof(FMHeader);
+        fwrite(&header, sizeof(FMHeader), 1, file);
+        header.bwt_offset = (position + 63) & ~63L;
+        fm_write_section(file, &position, bwt, n);
+        header.occ_offset = (position + 63) & ~63L;
+        fm_write_section(file, &position, occ, blocks * header.sigma * sizeof(uint32_t));
+        header.sampled_offset = (position + 63) & ~63L;
+        fm_write_section(file, &position, sampled, words * sizeof(uint64_t));
+        header.sampled_rank_offset = (position + 63) & ~63L;
+        fm_write_section(file, &position, sampled_rank, words * sizeof(uint32_t));
+        header.samples_offset = (position + 63) & ~63L;
+        fm_write_section(file, &position, samples, sample_count * sizeof(uint32_t));
+        header.rows_offset = (position + 63) & ~63L;
+        fm_write_section(file, &position, row_starts, rows * sizeof(uint32_t));
+        header.file_size = position;
+        
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof(FMHeader), 1, file);
+        written = !ferror(file);
+        fclose(file);
+    }
+    
+    free(bwt);
+    free(occ);
+    free(sampled);
+    free(sampled_rank);
+    free(samples);
+    free(row_starts);
+    return written;
+}
+
+FMIndex* fm_index_open(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(FMHeader)) {
+        close(fd);
+        return NULL;
+    }
+    
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    
+    const FMHeader* header = map;
+    if (memcmp(header->magic, "ODQFM2", 7) != 0 || header->file_size != st.st_size ||
+        header->block != FM_BLOCK || header->sample_rate != FM_SAMPLE_RATE) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    
+    FMIndex* index = malloc(sizeof(FMIndex));
+    const char* base = map;
+    index->map = map;
+    index->map_size = st.st_size;
+    index->header = header;
+    index->bwt = (const unsigned char*)(base + header->bwt_offset);
+    index->occ = (const uint32_t*)(base + header->occ_offset);
+    index->sampled = (const uint64_t*)(base + header->sampled_offset);
+    index->sampled_rank = (const uint32_t*)(base + header->sampled_rank_offset);
+    index->samples = (const uint32_t*)(base + header->samples_offset);
+    index->row_starts = (const uint32_t*)(base + header->rows_offset);
+    return index;
+}
+
+void fm_index_close(FMIndex* index) {
+    if (!index) return;
+    munmap(index->map, index->map_size);
+    free(index);
+}
+
+// Occurrences of symbol c in bwt[0, i)
+static long fm_occ(const FMIndex* index, unsigned char c, long i) {
+    long block = i / FM_BLOCK;
+    long result = index->occ[block * index->header->sigma + index->header->symbol_of[c]];
+    for (long j = block * FM_BLOCK; j < i; j++) {
+        result += index->bwt[j] == c;
+    }
+    return result;
+}
+
+// Backward search; [sp, ep) is the suffix array range of the pattern
+static bool fm_range(const FMIndex* index, const char* pattern, int length, long* sp, long* ep) {
+    *sp = 0;
+    *ep = index->header->text_length;
+    for (int i = length - 1; i >= 0 && *sp < *ep; i--) {
+        unsigned char c = pattern[i];
+        int symbol = index->header->symbol_of[c];
+        if (symbol == 255) return false;
+        *sp = index->header->counts[symbol] + fm_occ(index, c, *sp);
+        *ep = index->header->counts[symbol] + fm_occ(index, c, *ep);
+    }
+    return *sp < *ep;
+}
+
+long fm_count(const FMIndex* index, const char* pattern, int length) {
+    long sp, ep;
+    return fm_range(index, pattern, length, &sp, &ep) ? ep - sp : 0;
+}
+
+// Walks LF until a sampled text position, at most FM_SAMPLE_RATE steps
+static long fm_locate(const FMIndex* index, long i) {
+    long steps = 0;
+    while (!(index->sampled[i / 64] & (1ULL << (i % 64)))) {
+        unsigned char c = index->bwt[i];
+        i = index->header->counts[index->header->symbol_of[c]] + fm_occ(index, c, i);
+        steps++;
+    }
+    uint64_t below = index->sampled[i / 64] & ((1ULL << (i % 64)) - 1);
+    return index->samples[index->sampled_rank[i / 64] + __builtin_popcountll(below)] + steps;
+}
+
+void fm_candidates(const FMIndex* index, const char* pattern, int length, PositionList* out) {
+    out->count = 0;
+    long sp, ep;
+    if (!fm_range(index, pattern, length, &sp, &ep)) return;
+    
+    for (long i = sp; i < ep; i++) {
+        long text_offset = fm_locate(index, i);
+        long low = 0, high = index->header->indexed_rows - index->header->first_row - 1;
+        while (low < high) {
+            long middle = (low + high + 1) / 2;
+            if (index->row_starts[middle] <= text_offset) low = middle;
+            else high = middle - 1;
+        }
+        position_list_add(out, row_position(index->header->first_row + low));
+    }
+    
+    qsort(out->items, out->count, sizeof(long), compare_positions);
+    long unique = 0;
+    for (long i = 0; i < out->count; i++) {
+        if (unique == 0 || out->items[unique - 1] != out->items[i]) {
+            out->items[unique++] = out->items[i];
+        }
+    }
+    out->count = unique;
+}
+
+// Candidate rows for a literal from whichever text index covers the field
+bool text_index_candidates(int field_index, const char* literal, int length, PositionList* out) {
+    switch (current_table.fields[field_index].text_index) {
+        case TEXT_INDEX_TRIGRAM:
+            if (!current_table.trigram_indexes[field_index]) return false;
+            return trigram_candidates(current_table.trigram_indexes[field_index], literal, length, out);
+        case TEXT_INDEX_FM: {
+            FMIndex* index = current_table.fm_indexes[field_index];
+            if (!index || length == 0) return false;
+            fm_candidates(index, literal, length, out);
+            // Rows appended after the index was built are checked directly
+            long rows = table_row_count();
+            for (long row = index->header->indexed_rows; row < rows; row++) {
+                position_list_add(out, row_position(row));
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// SQL LIKE with % and _ wildcards
+bool like_match(const char* text, const char* pattern) {
+    const char* star_pattern = NULL;
+    const char* star_text = NULL;
+
+    while (*text) {
+        if (*pattern == '%') {
+            star_pattern = ++pattern;
+            star_text = text;
+        } else if (*pattern == '_' || *pattern == *text) {
+            pattern++;
+            text++;
+        } else if (star_pattern) {
+            pattern = star_pattern;
+            text = ++star_text;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '%') pattern++;
+    return *pattern == '\0';
+}
+
+// CRC-32C (Castagnoli), the polynomial of the SSE4.2 crc32 instruction
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_table_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char* data, size_t size) {
+    pthread_once(&crc32c_table_once, crc32c_table_init);
+    for (size_t i = 0; i < size; i++) crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t size) {
+    uint64_t value = crc;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    crc = (uint32_t)value;
+    for (; i < size; i++) crc = _mm_crc32_u8(crc, data[i]);
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const void* data, size_t size) {
+#if defined(__x86_64__)
+    static int use_sse42 = -1;
+    if (use_sse42 < 0) use_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+    if (use_sse42) return ~crc32c_sse42(~0u, data, size);
+#endif
+    return ~crc32c_scalar(~0u, data, size);
+}
+
+// Fills one TABLE_HEADER_BYTES page with the header of the table
+void table_header_encode(const Table* table, char* page) {
+    memset(page, 0, TABLE_HEADER_BYTES);
+    TableHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TABLE_MAGIC, 8);
+    header.version = TABLE_FORMAT_VERSION;
+    header.header_bytes = TABLE_HEADER_BYTES;
+    header.field_count = table->field_count;
+    header.record_size = table->record_size;
+    header.page_size = table->page_size;
+    header.page_records = table->page_records;
+    header.auto_increment = table->auto_increment;
+    strncpy(header.name, table->name, sizeof(header.name) - 1);
+    header.row_count = table->row_count;
+    header.segment_rows = table->segment_rows;
+    header.first_row = table->first_row;
+    header.retention_days = table->retention_days;
+    header.retention_rows = table->retention_rows;
+    
+    uint32_t offset = 0;
+    for (int i = 0; i < table->field_count; i++) {
+        DiskField* field = &header.fields[i];
+        strncpy(field->name, table->fields[i].name, sizeof(field->name) - 1);
+        field->offset = offset;
+        field->size = table->fields[i].size;
+        field->type = table->fields[i].type;
+        field->index = table->fields[i].index;
+        field->text_index = table->fields[i].text_index;
+        offset += table->fields[i].size;
+    }
+    header.checksum = crc32c(&header, sizeof(header));
+    memcpy(page, &header, sizeof(header));
+}
+
+// Validates a header page and fills the persistent part of the table; the
+// caller sets the filename and the in-memory state
+bool table_header_decode(const char* page, Table* table) {
+    TableHeader header;
+    memcpy(&header, page, sizeof(header));
+    if (memcmp(header.magic, TABLE_MAGIC, 8) != 0) return false;
+    if (header.version != TABLE_FORMAT_VERSION || header.header_bytes != TABLE_HEADER_BYTES) return false;
+    uint32_t checksum = header.checksum;
+    header.checksum = 0;
+    if (crc32c(&header, sizeof(header)) != checksum) return false;
+    if (header.field_count > MAX_FIELDS || header.record_size == 0 || header.record_size > MAX_RECORD_SIZE) return false;
+    if (header.page_size < PAGE_MIN_BYTES || header.page_size > PAGE_MAX_BYTES || header.page_records == 0 ||
+        header.page_records * header.record_size + sizeof(PageHeader) > header.page_size ||
+        header.segment_rows <= 0 || header.segment_rows % header.page_records != 0) return false;
+    
+    memset(table, 0, sizeof(Table));
+    memcpy(table->name, header.name, MAX_TABLE_NAME - 1);
+    table->field_count = header.field_count;
+    table->record_size = header.record_size;
+    table->page_size = header.page_size;
+    table->page_records = header.page_records;
+    table->auto_increment = header.auto_increment;
+    table->row_count = header.row_count;
+    table->segment_rows = header.segment_rows;
+    table->first_row = header.first_row;
+    table->retention_days = header.retention_days;
+    table->retention_rows = header.retention_rows;
+    
+    uint32_t offset = 0;
+    for (int i = 0; i < table->field_count; i++) {
+        const DiskField* disk = &header.fields[i];
+        if (disk->offset != offset || disk->type > FIELD_BOOL || disk->index > INDEX_LSM ||
+            disk->text_index > TEXT_INDEX_FM) return false;
+        Field* field = &table->fields[i];
+        memcpy(field->name, disk->name, MAX_FIELD_NAME - 1);
+        field->type = disk->type;
+        field->size = disk->size;
+        field->index = disk->index;
+        field->text_index = disk->text_index;
+        offset += disk->size;
+    }
+    return offset == header.record_size;
+}
+
+// Smallest page size that loses at most an eighth of the page to the slack
+// behind the last row, otherwise the one losing the smallest share
+static int table_page_size(int record_size) {
+    int best = PAGE_MAX_BYTES;
+    long best_slack = LONG_MAX;
+    for (int size = PAGE_MIN_BYTES; size <= PAGE_MAX_BYTES; size *= 2) {
+        long usable = size - sizeof(PageHeader);
+        if (usable < record_size) continue;
+        long slack = usable % record_size;
+        if (slack * 8 <= size) return size;
+        if (slack * (PAGE_MAX_BYTES / size) < best_slack) {
+            best = size;
+            best_slack = slack * (PAGE_MAX_BYTES / size);
+        }
+    }
+    return best;
+}
+
+// Table functions
+void create_table(const char* table_name, const char* field_definitions) {
+    char filename[100];
+    snprintf(filename, sizeof(filename), "%s_%s.bin", TABLE_PREFIX, table_name);
+    
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        printf("Error creating table\n");
+        return;
+    }
+    
+    Table table;
+    strcpy(table.name, table_name);
+    strcpy(table.filename, filename);
+    table.field_count = 0;
+    table.record_size = 0;
+    table.auto_increment = 1;
+    table.row_count = 0;
+    table.data_file = NULL;
+    table.zone_map = NULL;
+    table.tombstones = NULL;
+    table.segment_rows = SEGMENT_ROWS;
+    table.first_row = 0;
+    table.retention_days = 0;
+    table.retention_rows = 0;
+    table.segments = NULL;
+    for (int i = 0; i < MAX_FIELDS; i++) {
+        table.indexes[i] = NULL;
+        table.btrees[i] = NULL;
+        table.lsm_indexes[i] = NULL;
+        table.trigram_indexes[i] = NULL;
+        table.fm_indexes[i] = NULL;
+        table.bitmap_indexes[i] = NULL;
+        table.hash_indexes[i] = NULL;
+    }
+    
+    char def_copy[MAX_QUERY_LENGTH];
+    strcpy(def_copy, field_definitions);
+    char* token = strtok(def_copy, ",");
+    
+    while (token && table.field_count < MAX_FIELDS) {
+        while (*token == ' ') token++;
+        
+        char field_name[MAX_FIELD_NAME];
+        char field_type[20];
+        if (sscanf(token, "%s %s", field_name, field_type) == 2) {
+            Field field;
+            strcpy(field.name, field_name);
+            field.text_index = TEXT_INDEX_NONE;
+            field.index = INDEX_AVL;
+            if (strstr(token, " noindex")) field.index = INDEX_NONE;
+            if (strstr(token, " bitmap")) field.index = INDEX_BITMAP;
+            if (strstr(token, " hash")) field.index = INDEX_HASH;
+            if (strstr(token, " btree")) field.index = INDEX_BTREE;
+            if (strstr(token, " bloom")) field.index = INDEX_BLOOM;
+            if (strstr(token, " lsm")) field.index = INDEX_LSM;
+            
+            if (strcmp(field_type, "int") == 0) {
+                field.type = FIELD_INT;
+                field.size = sizeof(int);
+            } else if (strncmp(field_type, "text", 4) == 0) {
+                field.type = FIELD_TEXT;
+                field.size = 255;
+                char* bracket = strchr(token, '(');
+                if (bracket && sscanf(bracket, "(%d)", &field.size) == 1) {}
+            } else if (strcmp(field_type, "bool") == 0) {
+                field.type = FIELD_BOOL;
+                field.size = sizeof(bool);
+            } else {
+                printf("Unknown field type: %s\n", field_type);
+                fclose(file);
+                return;
+            }
+            
+            table.record_size += field.size;
+            table.fields[table.field_count++] = field;
+        }
+        token = strtok(NULL, ",");
+    }
+    
+    if (table.record_size <= 0 || table.record_size > MAX_RECORD_SIZE) {
+        printf("Record size must be between 1 and %d bytes\n", MAX_RECORD_SIZE);
+        fclose(file);
+        return;
+    }
+    table.page_size = table_page_size(table.record_size);
+    table.page_records = (table.page_size - sizeof(PageHeader)) / table.record_size;
+    table.segment_rows = SEGMENT_ROWS / table.page_records * table.page_records;
+    
+    char page[TABLE_HEADER_BYTES];
+    table_header_encode(&table, page);
+    fwrite(page, TABLE_HEADER_BYTES, 1, file);
+    fclose(file);
+    
+    // Segments left behind by an older table of the same name
+    char directory_name[150];
+    segment_directory(directory_name, sizeof(directory_name), table_name);
+    DIR* directory = opendir(directory_name);
+    if (directory) {
+        struct dirent* entry;
+        while ((entry = readdir(directory)) != NULL) {
+            if (strstr(entry->d_name, ".seg")) {
+                char path[512];
+                snprintf(path, sizeof(path), "%s/%s", directory_name, entry->d_name);
+                unlink(path);
+            }
+        }
+        closedir(directory);
+    }
+    char tombstone_file[150];
+    tombstone_filename(tombstone_file, sizeof(tombstone_file), table_name);
+    unlink(tombstone_file);
+    printf("Table '%s' created\n", table_name);
+}
+
+bool load_table(const char* table_name) {
+    char filename[100];
+    snprintf(filename, sizeof(filename), "%s_%s.bin", TABLE_PREFIX, table_name);
+    
+    FILE* file = fopen(filename, "rb+");
+    if (!file) {
+        printf("Table '%s' not found\n", table_name);
+        return false;
+    }
+    
+    close_table();
+    char page[TABLE_HEADER_BYTES];
+    if (fread(page, TABLE_HEADER_BYTES, 1, file) != 1 || !table_header_decode(page, &current_table)) {
+        fclose(file);
+        printf("Table '%s' is not a valid ODQ table (version %d)\n", table_name, TABLE_FORMAT_VERSION);
+        return false;
+    }
+    strcpy(current_table.filename, filename);
+    
+    if (current_table.segment_rows > 0) {
+        fclose(file);
+        file = segment_store_open(&current_table, &current_table.segments);
+        if (!file) {
+            printf("Error opening segments of table '%s'\n", table_name);
+            return false;
+        }
+    }
+    
+    current_table.data_file = file;
+    current_table.tombstones = tombstones_load(table_name);
+    for (int i = 0; i < MAX_FIELDS; i++) {
+        current_table.indexes[i] = NULL;
+        current_table.btrees[i] = NULL;
+        current_table.lsm_indexes[i] = NULL;
+        current_table.trigram_indexes[i] = NULL;
+        current_table.fm_indexes[i] = NULL;
+        current_table.bitmap_indexes[i] = NULL;
+        current_table.hash_indexes[i] = NULL;
+        if (i < current_table.field_count && current_table.fields[i].index == INDEX_BITMAP) {
+            current_table.bitmap_indexes[i] = calloc(1, sizeof(BitmapIndex));
+        }
+        if (i < current_table.field_count && current_table.fields[i].index == INDEX_BTREE) {
+            current_table.btrees[i] = btree_create(current_table.fields[i].type);
+        }
+        if (i < current_table.field_count && current_table.fields[i].index == INDEX_LSM) {
+            current_table.lsm_indexes[i] = lsm_create(current_table.fields[i].type);
+        }
+    }
+    
+    // Persisted trigram indexes are reused when they cover every row,
+    // otherwise they are rebuilt during the scan below
+    long row_count = table_row_count();
+    bool rebuild_trigrams[MAX_FIELDS] = {false};
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.fields[i].text_index != TEXT_INDEX_TRIGRAM) continue;
+        char index_file[150];
+        index_filename(index_file, sizeof(index_file), i, "tri");
+        current_table.trigram_indexes[i] = trigram_index_load(index_file, row_count);
+        if (!current_table.trigram_indexes[i]) {
+            current_table.trigram_indexes[i] = trigram_index_create();
+            rebuild_trigrams[i] = true;
+        }
+    }
+    
+    // Hash indexes follow the same rule
+    bool rebuild_hashes[MAX_FIELDS] = {false};
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.fields[i].index != INDEX_HASH) continue;
+        char index_file[150];
+        index_filename(index_file, sizeof(index_file), i, "hash");
+        current_table.hash_indexes[i] = hash_index_load(index_file, row_count);
+        if (!current_table.hash_indexes[i]) {
+            current_table.hash_indexes[i] = hash_index_create(4);
+            rebuild_hashes[i] = true;
+        }
+    }
+    
+    // So does the zone map
+    char zone_file[150];
+    zone_filename(zone_file, sizeof(zone_file));
+    current_table.zone_map = zone_map_load(zone_file, row_count);
+    bool rebuild_zones = current_table.zone_map == NULL;
+    if (rebuild_zones) current_table.zone_map = calloc(1, sizeof(ZoneMap));
+    
+    // Rows on a damaged page are reported and left out
+    TableScan scan;
+    long row;
+    char* record;
+    long rows_read = 0;
+    table_scan_begin(&scan, NULL, 0);
+    scan.with_deleted = true;
+    
+    while (table_scan_next(&scan, &row, &record)) {
+        long position = row_position(row);
+        if (rebuild_zones) zone_map_add(current_table.zone_map, row, record);
+        if (row_deleted(row)) continue;
+        rows_read++;
+        int offset = 0;
+        for (int i = 0; i < current_table.field_count; i++) {
+            Field field = current_table.fields[i];
+            char key[256] = {0};
+            
+            if (rebuild_trigrams[i]) {
+                trigram_index_add(current_table.trigram_indexes[i], record + offset, field.size, position);
+            }
+            
+            switch (field.type) {
+                case FIELD_INT: {
+                    int value;
+                    memcpy(&value, record + offset, sizeof(int));
+                    snprintf(key, sizeof(key), "%d", value);
+                    break;
+                }
+                case FIELD_TEXT:
+                    strncpy(key, record + offset, field.size);
+                    key[field.size] = '\0';
+                    break;
+                case FIELD_BOOL: {
+                    bool value;
+                    memcpy(&value, record + offset, sizeof(bool));
+                    strcpy(key, value ? "true" : "false");
+                    break;
+                }
+            }
+            
+            if (ordered_index(i)) {
+                ordered_insert(i, key, position);
+            } else if (field.index == INDEX_BITMAP) {
+                bitmap_index_add(current_table.bitmap_indexes[i], key, row);
+            } else if (rebuild_hashes[i]) {
+                hash_index_add(current_table.hash_indexes[i], key, row);
+            }
+            offset += field.size;
+        }
+    }
+    table_scan_end(&scan);
+    
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.trigram_indexes[i]) {
+            current_table.trigram_indexes[i]->indexed_rows = row_count;
+        }
+        if (current_table.hash_indexes[i]) {
+            current_table.hash_indexes[i]->indexed_rows = row_count;
+        }
+    }
+    
+    // Sidecars rebuilt around a damaged page are kept in memory only, and
+    // the stored row count stays as it is
+    long damaged = current_table.segments->damaged_pages;
+    if (damaged > 0) {
+        printf("Table '%s' has %ld damaged page(s); their rows are missing from queries\n", table_name, damaged);
+        for (int i = 0; i < current_table.field_count; i++) {
+            if (rebuild_trigrams[i]) current_table.trigram_indexes[i]->dirty = false;
+            if (rebuild_hashes[i]) current_table.hash_indexes[i]->dirty = false;
+        }
+        if (rebuild_zones) current_table.zone_map->dirty = false;
+    } else if (current_table.row_count != rows_read) {
+        // The stored row count can lag behind the data after a crash
+        current_table.row_count = rows_read;
+        save_row_count();
+    }
+    
+    // FM indexes are mapped from disk; a missing or foreign file is rebuilt
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.fields[i].text_index != TEXT_INDEX_FM) continue;
+        char index_file[150];
+        index_filename(index_file, sizeof(index_file), i, "fm");
+        FMIndex* index = fm_index_open(index_file);
+        if (index && (index->header->indexed_rows > row_count ||
+                      index->header->first_row != current_table.first_row)) {
+            fm_index_close(index);
+            index = NULL;
+        }
+        if (!index && fm_index_build(i, index_file)) {
+            index = fm_index_open(index_file);
+        }
+        current_table.fm_indexes[i] = index;
+    }
+    
+    table_loaded = true;
+    printf("Table '%s' loaded with indexes\n", table_name);
+    apply_retention();
+    return true;
+}
+
+// Persists dirty sidecar indexes and releases the current table
+void close_table() {
+    if (!table_loaded) return;
+    
+    for (int i = 0; i < current_table.field_count; i++) {
+        TrigramIndex* trigram = current_table.trigram_indexes[i];
+        if (trigram && trigram->dirty) {
+            char index_file[150];
+            index_filename(index_file, sizeof(index_file), i, "tri");
+            if (!trigram_index_save(trigram, index_file)) {
+                printf("Error saving text index for '%s'\n", current_table.fields[i].name);
+            }
+        }
+        trigram_index_free(trigram);
+        current_table.trigram_indexes[i] = NULL;
+        freeAVL(current_table.indexes[i]);
+        current_table.indexes[i] = NULL;
+        btree_free(current_table.btrees[i]);
+        current_table.btrees[i] = NULL;
+        lsm_free(current_table.lsm_indexes[i]);
+        current_table.lsm_indexes[i] = NULL;
+        fm_index_close(current_table.fm_indexes[i]);
+        current_table.fm_indexes[i] = NULL;
+        bitmap_index_free(current_table.bitmap_indexes[i]);
+        current_table.bitmap_indexes[i] = NULL;
+        
+        HashIndex* hash = current_table.hash_indexes[i];
+        if (hash && hash->dirty) {
+            char index_file[150];
+            index_filename(index_file, sizeof(index_file), i, "hash");
+            if (!hash_index_save(hash, index_file)) {
+                printf("Error saving hash index for '%s'\n", current_table.fields[i].name);
+            }
+        }
+        hash_index_free(hash);
+        current_table.hash_indexes[i] = NULL;
+    }
+    
+    if (current_table.zone_map && current_table.zone_map->dirty) {
+        char zone_file[150];
+        zone_filename(zone_file, sizeof(zone_file));
+        if (!zone_map_save(current_table.zone_map, zone_file)) {
+            printf("Error saving zone map\n");
+        }
+    }
+    zone_map_free(current_table.zone_map);
+    current_table.zone_map = NULL;
+    if (current_table.tombstones) roaring_free(current_table.tombstones);
+    free(current_table.tombstones);
+    current_table.tombstones = NULL;
+    
+    if (current_table.data_file) fclose(current_table.data_file);
+    current_table.data_file = NULL;
+    current_table.segments = NULL;
+    table_loaded = false;
+}
+
+void save_table_header() {
+    char page[TABLE_HEADER_BYTES];
+    table_header_encode(&current_table, page);
+    fseek(current_table.data_file, 0, SEEK_SET);
+    fwrite(page, TABLE_HEADER_BYTES, 1, current_table.data_file);
+    fflush(current_table.data_file);
+}
+
+// The checksum covers the whole header, so the counter cannot be patched alone
+void save_row_count() {
+    save_table_header();
+}
+
+long table_row_count() {
+    if (current_table.record_size <= 0) return 0;
+    fseek(current_table.data_file, 0, SEEK_END);
+    return (ftell(current_table.data_file) - TABLE_HEADER_BYTES) / current_table.record_size;
+}
+
+// Deleted rows read as missing. Lookups bypass the stdio buffer, so a row
+// on a cached page costs a buffer pool probe instead of a 64KB refill.
+bool read_record_at(long position, char* record) {
+    if (row_deleted(position_row(position))) return false;
+    return table_pread(record, current_table.record_size, position) == current_table.record_size;
+}
+
+// Segmented storage
+void segment_directory(char* out, size_t size, const char* table_name) {
+    snprintf(out, size, "%s_%s.seg", TABLE_PREFIX, table_name);
+}
+
+// Header page of a new segment file
+static void segment_header_page(const SegmentStore* store, long segment, char* page) {
+    memset(page, 0, SEGMENT_HEADER_BYTES);
+    SegmentHeader header = {0};
+    memcpy(header.magic, "ODQSEG2", 8);
+    header.segment = segment;
+    header.first_row = segment * store->segment_rows;
+    header.record_size = store->record_size;
+    header.page_size = store->page_size;
+    header.page_records = store->page_records;
+    header.created = time(NULL);
+    memcpy(page, &header, sizeof(header));
+}
+
+static void page_seal(char* page, int page_size) {
+    PageHeader* header = (PageHeader*)page;
+    header->checksum = crc32c(page + sizeof(uint32_t), page_size - sizeof(uint32_t));
+}
+
+static bool page_verify(const char* page, int page_size, long first_row) {
+    const PageHeader* header = (const PageHeader*)page;
+    return header->first_row == first_row &&
+           header->checksum == crc32c(page + sizeof(uint32_t), page_size - sizeof(uint32_t));
+}
+
+static int segment_fd(SegmentStore* store, long segment, bool create) {
+    pthread_mutex_lock(&store->lock);
+    if (segment >= store->segment_capacity) {
+        long capacity = store->segment_capacity ? store->segment_capacity : 16;
+        while (capacity <= segment) capacity *= 2;
+        store->segment_fds = realloc(store->segment_fds, capacity * sizeof(int));
+        for (long i = store->segment_capacity; i < capacity; i++) store->segment_fds[i] = -1;
+        store->segment_capacity = capacity;
+    }
+    
+    if (store->segment_fds[segment] < 0) {
+        char path[200];
+        snprintf(path, sizeof(path), "%s/%06ld.seg", store->directory, segment);
+        int fd = open(path, O_RDWR);
+        if (fd < 0 && create) {
+            mkdir(store->directory, 0755);
+            fd = open(path, O_RDWR | O_CREAT, 0644);
+            char header[SEGMENT_HEADER_BYTES];
+            segment_header_page(store, segment, header);
+            if (fd >= 0 && pwrite(fd, header, SEGMENT_HEADER_BYTES, 0) != SEGMENT_HEADER_BYTES) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        store->segment_fds[segment] = fd;
+    }
+    int fd = store->segment_fds[segment];
+    pthread_mutex_unlock(&store->lock);
+    return fd;
+}
+
+BufferPool* buffer_pool_create(long bytes, int page_size) {
+    long frame_count = bytes / page_size;
+    if (frame_count <= 0) return NULL;
+    char* memory = malloc(frame_count * page_size);
+    if (!memory) return NULL;
+    
+    BufferPool* pool = calloc(1, sizeof(BufferPool));
+    pool->memory = memory;
+    pool->page_size = page_size;
+    pool->frame_count = frame_count;
+    pool->pages = malloc(frame_count * sizeof(long));
+    pool->next = malloc(frame_count * sizeof(long));
+    pool->referenced = calloc(frame_count, 1);
+    long bucket_count = 1;
+    while (bucket_count < frame_count) bucket_count *= 2;
+    pool->buckets = malloc(bucket_count * sizeof(long));
+    pool->bucket_mask = bucket_count - 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    buffer_pool_clear(pool);
+    return pool;
+}
+
+static long buffer_pool_find(const BufferPool* pool, long page) {
+    long frame = pool->buckets[page & pool->bucket_mask];
+    while (frame >= 0 && pool->pages[frame] != page) frame = pool->next[frame];
+    return frame;
+}
+
+// Copies bytes of a cached page; false on a miss
+bool buffer_pool_copy(BufferPool* pool, long page, long from, long length, char* out) {
+    if (!pool) return false;
+    pthread_mutex_lock(&pool->lock);
+    long frame = buffer_pool_find(pool, page);
+    if (frame >= 0) {
+        memcpy(out, pool->memory + frame * pool->page_size + from, length);
+        pool->referenced[frame] = 1;
+        pool->hits++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return frame >= 0;
+}
+
+// Advances the clock hand to a free frame or to the first one not
+// referenced since the hand last passed, clearing reference bits on the way
+static long buffer_pool_victim(BufferPool* pool) {
+    while (true) {
+        long frame = pool->hand;
+        pool->hand = (pool->hand + 1) % pool->frame_count;
+        if (pool->pages[frame] < 0) return frame;
+        if (pool->referenced[frame]) {
+            pool->referenced[frame] = 0;
+            continue;
+        }
+        
+        long* link = &pool->buckets[pool->pages[frame] & pool->bucket_mask];
+        while (*link != frame) link = &pool->next[*link];
+        *link = pool->next[frame];
+        pool->pages[frame] = -1;
+        pool->used--;
+        pool->evictions++;
+        return frame;
+    }
+}
+
+// Caches a page read from disk. Pages of scans come in unreferenced, so
+// the clock takes them before the pages point lookups keep hitting.
+void buffer_pool_put(BufferPool* pool, long page, const char* data, bool referenced) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    long frame = buffer_pool_find(pool, page);
+    if (frame < 0) {
+        frame = buffer_pool_victim(pool);
+        long bucket = page & pool->bucket_mask;
+        pool->pages[frame] = page;
+        pool->next[frame] = pool->buckets[bucket];
+        pool->buckets[bucket] = frame;
+        pool->used++;
+    }
+    memcpy(pool->memory + frame * pool->page_size, data, pool->page_size);
+    if (referenced) pool->referenced[frame] = 1;
+    pool->misses++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Refreshes a cached page after a write; pages not cached stay out
+void buffer_pool_update(BufferPool* pool, long page, const char* data) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    long frame = buffer_pool_find(pool, page);
+    if (frame >= 0) memcpy(pool->memory + frame * pool->page_size, data, pool->page_size);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void buffer_pool_clear(BufferPool* pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    for (long i = 0; i < pool->frame_count; i++) {
+        pool->pages[i] = -1;
+        pool->referenced[i] = 0;
+    }
+    for (long i = 0; i <= pool->bucket_mask; i++) pool->buckets[i] = -1;
+    pool->hand = 0;
+    pool->used = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void buffer_pool_free(BufferPool* pool) {
+    if (!pool) return;
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->memory);
+    free(pool->pages);
+    free(pool->next);
+    free(pool->referenced);
+    free(pool->buckets);
+    free(pool);
+}
+
+// Reads rows from data offset data onward. Cached pages are copied from the
+// buffer pool; on a miss a batch of whole pages is read with one pread and
+// every page is checked before its rows are copied out.
+static ssize_t segment_read(SegmentStore* store, char* buffer, size_t size, long data) {
+    char pages[SEGMENT_IO_BUFFER];
+    int page_size = store->page_size;
+    long page_bytes = (long)store->page_records * store->record_size;
+    long pages_per_segment = store->segment_rows / store->page_records;
+    long end = data + (long)size < store->data_bytes ? data + (long)size : store->data_bytes;
+    long at = data;
+    while (at < end) {
+        long page = at / page_bytes;
+        long from = at - page * page_bytes;
+        long length = page_bytes - from < end - at ? page_bytes - from : end - at;
+        if (buffer_pool_copy(store->pool, page, sizeof(PageHeader) + from, length, buffer + (at - data))) {
+            at += length;
+            continue;
+        }
+        
+        long segment = page / pages_per_segment;
+        long within = page % pages_per_segment;
+        long count = (end - 1) / page_bytes - page + 1;
+        if (count > SEGMENT_IO_BUFFER / page_size) count = SEGMENT_IO_BUFFER / page_size;
+        if (count > pages_per_segment - within) count = pages_per_segment - within;
+        
+        int fd = segment_fd(store, segment, false);
+        if (fd < 0) break;
+        ssize_t bytes = pread(fd, pages, count * page_size, SEGMENT_HEADER_BYTES + within * page_size);
+        if (bytes <= 0) break;
+        // The newest page ends at its last row on disk
+        count = (bytes + page_size - 1) / page_size;
+        memset(pages + bytes, 0, count * page_size - bytes);
+        
+        for (long i = 0; i < count && at < end; i++, page++) {
+            if (!page_verify(pages + i * page_size, page_size, page * store->page_records)) {
+                __atomic_add_fetch(&store->damaged_pages, 1, __ATOMIC_RELAXED);
+                printf("Checksum mismatch in page %ld of segment %ld\n", within + i, segment);
+                return at > data ? at - data : -1;
+            }
+            buffer_pool_put(store->pool, page, pages + i * page_size, count == 1);
+            from = at - page * page_bytes;
+            length = page_bytes - from < end - at ? page_bytes - from : end - at;
+            memcpy(buffer + (at - data), pages + i * page_size + sizeof(PageHeader) + from, length);
+            at += length;
+        }
+    }
+    return at - data;
+}
+
+// Patches rows from data offset data onward. Each page is updated in the
+// page buffer, resealed, and its header and changed bytes are written back.
+static ssize_t segment_write(SegmentStore* store, const char* buffer, size_t size, long data) {
+    int page_size = store->page_size;
+    int record_size = store->record_size;
+    long page_bytes = (long)store->page_records * record_size;
+    long pages_per_segment = store->segment_rows / store->page_records;
+    PageHeader* header = (PageHeader*)store->page;
+    size_t done = 0;
+    while (done < size) {
+        long at = data + done;
+        long page = at / page_bytes;
+        long segment = page / pages_per_segment;
+        long offset = SEGMENT_HEADER_BYTES + (page % pages_per_segment) * page_size;
+        long from = at - page * page_bytes;
+        long length = page_bytes - from < (long)(size - done) ? page_bytes - from : (long)(size - done);
+        
+        int fd = segment_fd(store, segment, true);
+        if (fd < 0) break;
+        if (store->page_number != page && buffer_pool_copy(store->pool, page, 0, page_size, store->page)) {
+            store->page_number = page;
+        }
+        if (store->page_number != page) {
+            store->page_number = -1;
+            ssize_t bytes = pread(fd, store->page, page_size, offset);
+            if (bytes < 0) break;
+            memset(store->page + bytes, 0, page_size - bytes);
+            if (header->slot_count == 0) {
+                memset(store->page, 0, page_size);
+                header->first_row = page * store->page_records;
+            } else if (!page_verify(store->page, page_size, page * store->page_records)) {
+                printf("Checksum mismatch in page %ld of segment %ld\n", page % pages_per_segment, segment);
+                break;
+            }
+            store->page_number = page;
+        }
+        
+        memcpy(store->page + sizeof(PageHeader) + from, buffer + done, length);
+        long slots = (from + length + record_size - 1) / record_size;
+        if (slots > header->slot_count) header->slot_count = slots;
+        page_seal(store->page, page_size);
+        if (from == 0) {
+            long bytes = sizeof(PageHeader) + length;
+            if (pwrite(fd, store->page, bytes, offset) != bytes) break;
+        } else if (pwrite(fd, store->page, sizeof(PageHeader), offset) != sizeof(PageHeader) ||
+                   pwrite(fd, store->page + sizeof(PageHeader) + from, length, offset + sizeof(PageHeader) + from) != length) {
+            break;
+        }
+        buffer_pool_update(store->pool, page, store->page);
+        done += length;
+        if (data + (long)done > store->data_bytes) store->data_bytes = data + done;
+    }
+    return done;
+}
+
+// Maps a byte range of the single-file layout onto the header file and the
+// pages of the segment files. Reads stop at the end of the data like a
+// regular file.
+static ssize_t segment_io(SegmentStore* store, char* buffer, size_t size, long position, bool write) {
+    size_t done = 0;
+    if (position < TABLE_HEADER_BYTES) {
+        long length = TABLE_HEADER_BYTES - position < (long)size ? TABLE_HEADER_BYTES - position : (long)size;
+        ssize_t bytes = write ? pwrite(store->header_fd, buffer, length, position) : pread(store->header_fd, buffer, length, position);
+        if (bytes < 0) return -1;
+        if (bytes < length) return bytes;
+        done = length;
+    }
+    if (done < size) {
+        long data = position + done - TABLE_HEADER_BYTES;
+        ssize_t bytes = write ? segment_write(store, buffer + done, size - done, data) : segment_read(store, buffer + done, size - done, data);
+        if (bytes < 0 && done == 0) return -1;
+        if (bytes > 0) done += bytes;
+    }
+    if (done == 0 && write) return -1;
+    return done;
+}
+
+static ssize_t segment_cookie_read(void* cookie, char* buffer, size_t size) {
+    SegmentStore* store = cookie;
+    ssize_t bytes = segment_io(store, buffer, size, store->offset, false);
+    if (bytes > 0) store->offset += bytes;
+    return bytes;
+}
+
+static ssize_t segment_cookie_write(void* cookie, const char* buffer, size_t size) {
+    SegmentStore* store = cookie;
+    ssize_t bytes = segment_io(store, (char*)buffer, size, store->offset, true);
+    if (bytes > 0) store->offset += bytes;
+    return bytes;
+}
+
+static int segment_cookie_seek(void* cookie, off64_t* offset, int whence) {
+    SegmentStore* store = cookie;
+    long base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? store->offset : TABLE_HEADER_BYTES + store->data_bytes;
+    if (base + *offset < 0) return -1;
+    store->offset = base + *offset;
+    *offset = store->offset;
+    return 0;
+}
+
+static int segment_cookie_close(void* cookie) {
+    SegmentStore* store = cookie;
+    for (long i = 0; i < store->segment_capacity; i++) {
+        if (store->segment_fds[i] >= 0) close(store->segment_fds[i]);
+    }
+    close(store->header_fd);
+    pthread_mutex_destroy(&store->lock);
+    free(store->segment_fds);
+    free(store->page);
+    buffer_pool_free(store->pool);
+    free(store);
+    return 0;
+}
+
+// Opens a segmented table as one FILE. The data ends in the highest
+// numbered segment, which is the only one ever appended to.
+FILE* segment_store_open(const Table* table, SegmentStore** store_out) {
+    int header_fd = open(table->filename, O_RDWR);
+    if (header_fd < 0) return NULL;
+    
+    SegmentStore* store = calloc(1, sizeof(SegmentStore));
+    segment_directory(store->directory, sizeof(store->directory), table->name);
+    store->header_fd = header_fd;
+    store->record_size = table->record_size;
+    store->page_size = table->page_size;
+    store->page_records = table->page_records;
+    store->segment_rows = table->segment_rows;
+    store->page = malloc(table->page_size);
+    store->page_number = -1;
+    store->pool = buffer_pool_create(buffer_pool_megabytes * 1024 * 1024, table->page_size);
+    pthread_mutex_init(&store->lock, NULL);
+    
+    long last = -1;
+    DIR* directory = opendir(store->directory);
+    if (directory) {
+        struct dirent* entry;
+        while ((entry = readdir(directory)) != NULL) {
+            long segment;
+            char extension[8];
+            if (sscanf(entry->d_name, "%ld.%7s", &segment, extension) == 2 &&
+                strcmp(extension, "seg") == 0 && segment > last) {
+                last = segment;
+            }
+        }
+        closedir(directory);
+    }
+    // The rows of the last segment are the full pages before its last one
+    // plus the slots of that one
+    if (last >= 0) {
+        long rows = last * store->segment_rows;
+        int fd = segment_fd(store, last, false);
+        struct stat info;
+        if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > SEGMENT_HEADER_BYTES) {
+            long pages = (info.st_size - SEGMENT_HEADER_BYTES + store->page_size - 1) / store->page_size;
+            PageHeader header;
+            if (pread(fd, &header, sizeof(header), SEGMENT_HEADER_BYTES + (pages - 1) * store->page_size) == sizeof(header)) {
+                rows += (pages - 1) * store->page_records + header.slot_count;
+            }
+        }
+        store->data_bytes = rows * store->record_size;
+    }
+    
+    cookie_io_functions_t functions = {
+        segment_cookie_read, segment_cookie_write, segment_cookie_seek, segment_cookie_close
+    };
+    FILE* file = fopencookie(store, "r+", functions);
+    if (!file) {
+        segment_cookie_close(store);
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, SEGMENT_IO_BUFFER);
+    if (store_out) *store_out = store;
+    return file;
+}
+
+// Read-only handle on another table's data, used by joins
+FILE* open_table_file(const Table* table) {
+    if (table->segment_rows > 0) return segment_store_open(table, NULL);
+    return fopen(table->filename, "rb");
+}
+
+// pread() on the current table's data for readers keeping their own offsets
+ssize_t table_pread(void* buffer, size_t size, long position) {
+    if (current_table.segments) return segment_io(current_table.segments, buffer, size, position, false);
+    return pread(fileno(current_table.data_file), buffer, size, position);
+}
+
+// Writes behind the stdio buffer of data_file; callers drop that buffer
+// with fflush() once they are done
+ssize_t table_pwrite(const void* buffer, size_t size, long position) {
+    if (current_table.segments) return segment_io(current_table.segments, (char*)buffer, size, position, true);
+    return pwrite(fileno(current_table.data_file), buffer, size, position);
+}
+
+// SET BUFFER POOL n MB: the size applies to tables opened from now on and
+// replaces the pool of the current one, which starts out empty
+void set_buffer_pool(long megabytes) {
+    buffer_pool_megabytes = megabytes;
+    if (table_loaded && current_table.segments) {
+        SegmentStore* store = current_table.segments;
+        buffer_pool_free(store->pool);
+        store->pool = buffer_pool_create(megabytes * 1024 * 1024, store->page_size);
+    }
+    printf("Buffer pool set to %ld MB\n", megabytes);
+}
+
+void show_buffer_pool() {
+    BufferPool* pool = table_loaded && current_table.segments ? current_table.segments->pool : NULL;
+    if (!pool) {
+        printf("Buffer pool: %ld MB, no pages cached\n", buffer_pool_megabytes);
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    long requests = pool->hits + pool->misses;
+    printf("Buffer pool: %ld MB, %ld of %ld pages of %d bytes cached\n",
+           buffer_pool_megabytes, pool->used, pool->frame_count, pool->page_size);
+    printf("  hits %ld, misses %ld (%.1f%% hit rate), evictions %ld\n",
+           pool->hits, pool->misses, requests ? 100.0 * pool->hits / requests : 0.0, pool->evictions);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Expired rows stay numbered; scans start at the first live one
+long table_data_start() {
+    return row_position(current_table.first_row);
+}
+
+// Asynchronous reads
+static AsyncIO async_io = {.ring_fd = -1};
+static pthread_once_t async_io_once = PTHREAD_ONCE_INIT;
+
+#ifdef HAVE_IO_URING
+static bool async_ring_setup() {
+    struct io_uring_params params = {0};
+    int fd = syscall(__NR_io_uring_setup, ASYNC_RING_ENTRIES, &params);
+    if (fd < 0) return false;
+    
+    size_t sq_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    char* sq = mmap(NULL, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char* cq = mmap(NULL, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    
+    async_io.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    async_io.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    async_io.sq_array = (unsigned*)(sq + params.sq_off.array);
+    async_io.cq_head = (unsigned*)(cq + params.cq_off.head);
+    async_io.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    async_io.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    async_io.sqes = sqes;
+    async_io.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    async_io.ring_fd = fd;
+    return true;
+}
+
+// Moves every posted completion onto its read
+static void async_ring_reap() {
+    unsigned head = *async_io.cq_head;
+    unsigned tail = __atomic_load_n(async_io.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe* cqe = &async_io.cqes[head & *async_io.cq_mask];
+        AsyncRead* read = (AsyncRead*)(uintptr_t)cqe->user_data;
+        read->result = cqe->res;
+        read->done = true;
+    }
+    __atomic_store_n(async_io.cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+static void* async_read_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&async_io.lock);
+    while (true) {
+        while (!async_io.queue) pthread_cond_wait(&async_io.requested, &async_io.lock);
+        AsyncRead* read = async_io.queue;
+        async_io.queue = read->next;
+        if (!async_io.queue) async_io.queue_tail = NULL;
+        pthread_mutex_unlock(&async_io.lock);
+        
+        ssize_t result = pread(read->fd, read->buffer, read->length, read->offset);
+        
+        pthread_mutex_lock(&async_io.lock);
+        read->result = result < 0 ? -errno : result;
+        read->done = true;
+        pthread_cond_broadcast(&async_io.completed);
+    }
+    return NULL;
+}
+
+// io_uring when the kernel allows it, a small pread thread pool otherwise
+static void async_io_init() {
+    pthread_mutex_init(&async_io.lock, NULL);
+    pthread_cond_init(&async_io.requested, NULL);
+    pthread_cond_init(&async_io.completed, NULL);
+#ifdef HAVE_IO_URING
+    if (async_ring_setup()) return;
+#endif
+    for (int i = 0; i < ASYNC_READ_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, async_read_worker, NULL) == 0) pthread_detach(thread);
+    }
+}
+
+// Starts reading; read->buffer must stay allocated until async_read_wait()
+void async_read_submit(AsyncRead* read) {
+    pthread_once(&async_io_once, async_io_init);
+    read->result = 0;
+    read->done = false;
+    read->next = NULL;
+    
+#ifdef HAVE_IO_URING
+    if (async_io.ring_fd >= 0) {
+        unsigned tail = *async_io.sq_tail;
+        unsigned index = tail & *async_io.sq_mask;
+        struct io_uring_sqe* sqe = &async_io.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = read->fd;
+        sqe->addr = (uintptr_t)read->buffer;
+        sqe->len = read->length;
+        sqe->off = read->offset;
+        sqe->user_data = (uintptr_t)read;
+        async_io.sq_array[index] = index;
+        __atomic_store_n(async_io.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        
+        int submitted;
+        do {
+            submitted = syscall(__NR_io_uring_enter, async_io.ring_fd, 1, 0, 0, NULL, 0);
+        } while (submitted < 0 && errno == EINTR);
+        if (submitted < 0) {
+            // The kernel took nothing, so the entry is withdrawn and read here
+            __atomic_store_n(async_io.sq_tail, tail, __ATOMIC_RELEASE);
+            ssize_t result = pread(read->fd, read->buffer, read->length, read->offset);
+            read->result = result < 0 ? -errno : result;
+            read->done = true;
+        }
+        return;
+    }
+#endif
+    pthread_mutex_lock(&async_io.lock);
+    if (async_io.queue_tail) async_io.queue_tail->next = read;
+    else async_io.queue = read;
+    async_io.queue_tail = read;
+    pthread_cond_signal(&async_io.requested);
+    pthread_mutex_unlock(&async_io.lock);
+}
+
+// Reads the rest of a short read. io_uring and pread may stop early, e.g.
+// when interrupted, so only a read returning nothing marks the end of file.
+static void async_read_complete(AsyncRead* read) {
+    size_t done = read->result;
+    while (read->result > 0 && done < read->length) {
+        ssize_t result = pread(read->fd, read->buffer + done, read->length - done, read->offset + done);
+        if (result < 0 && errno == EINTR) continue;
+        if (result < 0) read->result = -errno;
+        if (result <= 0) break;
+        done += result;
+    }
+    if (read->result > 0) read->result = done;
+}
+
+// Blocks until the read completes; read->result is the byte count, short
+// only at the end of file, or -errno
+void async_read_wait(AsyncRead* read) {
+#ifdef HAVE_IO_URING
+    if (async_io.ring_fd >= 0) {
+        async_ring_reap();
+        while (!read->done) {
+            int waited = syscall(__NR_io_uring_enter, async_io.ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (waited < 0 && errno != EINTR) {
+                read->result = -errno;
+                read->done = true;
+                break;
+            }
+            async_ring_reap();
+        }
+        // Kernels without IORING_OP_READ reject it; read synchronously then
+        if (read->result == -EINVAL || read->result == -EOPNOTSUPP) {
+            ssize_t result = pread(read->fd, read->buffer, read->length, read->offset);
+            read->result = result < 0 ? -errno : result;
+        }
+        async_read_complete(read);
+        return;
+    }
+#endif
+    pthread_mutex_lock(&async_io.lock);
+    while (!read->done) pthread_cond_wait(&async_io.completed, &async_io.lock);
+    pthread_mutex_unlock(&async_io.lock);
+    async_read_complete(read);
+}
+
+// Verifies a page read directly from its segment; a damaged page is
+// counted and reported, and the caller skips its rows
+static bool page_check(SegmentStore* store, const char* page_data, long page) {
+    if (page_verify(page_data, store->page_size, page * store->page_records)) return true;
+    long pages_per_segment = store->segment_rows / store->page_records;
+    __atomic_add_fetch(&store->damaged_pages, 1, __ATOMIC_RELAXED);
+    printf("Checksum mismatch in page %ld of segment %ld, its rows are skipped\n",
+           page % pages_per_segment, page / pages_per_segment);
+    return false;
+}
+
+// Sequential scans
+static void table_scan_submit(TableScan* scan, ScanChunk* chunk) {
+    SegmentStore* store = current_table.segments;
+    long page_records = store->page_records;
+    long segment_rows = store->segment_rows;
+    chunk->pending = false;
+    chunk->ready = false;
+    
+    long row = zone_next_row(scan->next_row, scan->conditions, scan->condition_count);
+    if (row >= scan->end_row) {
+        scan->next_row = scan->end_row;
+        return;
+    }
+    long end = row + scan->chunk_rows;
+    long segment_end = (row / segment_rows + 1) * segment_rows;
+    if (end > segment_end) end = segment_end;
+    // Every block starts a chunk, so zone_next_row() sees each boundary
+    long block_end = (row / ZONE_ROWS + 1) * ZONE_ROWS;
+    if (scan->condition_count > 0 && current_table.zone_map && end > block_end) end = block_end;
+    if (end > scan->end_row) end = scan->end_row;
+    scan->next_row = end;
+    
+    long pages_per_segment = segment_rows / page_records;
+    long segment = row / segment_rows;
+    chunk->first_row = row;
+    chunk->end_row = end;
+    chunk->first_page = row / page_records;
+    chunk->read.fd = segment_fd(store, segment, false);
+    chunk->read.length = ((end - 1) / page_records - chunk->first_page + 1) * store->page_size;
+    chunk->read.offset = SEGMENT_HEADER_BYTES + (chunk->first_page % pages_per_segment) * store->page_size;
+    chunk->pending = true;
+    if (chunk->read.fd < 0) {
+        chunk->read.result = -ENOENT;
+        chunk->read.done = true;
+        return;
+    }
+    async_read_submit(&chunk->read);
+}
+
+// Waits for the chunk. Reads are only short at the end of the segment file,
+// so rows of the chunk still missing were lost from the table: they are
+// reported and skipped, and the scan goes on with the next chunk.
+static bool table_scan_ready(TableScan* scan, ScanChunk* chunk) {
+    SegmentStore* store = current_table.segments;
+    int page_size = store->page_size;
+    long page_records = store->page_records;
+    async_read_wait(&chunk->read);
+    if (chunk->read.result < 0) {
+        printf("Error reading table data: %s\n", strerror(-chunk->read.result));
+        return false;
+    }
+    
+    long bytes = chunk->read.result;
+    long count = (bytes + page_size - 1) / page_size;
+    memset(chunk->read.buffer + bytes, 0, count * page_size - bytes);
+    long end_row = (chunk->first_page + count) * page_records;
+    if (end_row < chunk->end_row) {
+        if (end_row < chunk->first_row) end_row = chunk->first_row;
+        long missing_pages = (chunk->end_row - 1) / page_records - end_row / page_records + 1;
+        __atomic_add_fetch(&store->damaged_pages, missing_pages, __ATOMIC_RELAXED);
+        printf("Rows %ld to %ld are missing from segment %ld, they are skipped\n",
+               end_row, chunk->end_row - 1, chunk->first_row / store->segment_rows);
+        chunk->end_row = end_row;
+    }
+    chunk->ready = true;
+    scan->row = chunk->first_row;
+    return true;
+}
+
+// Reads rows from the first live one to the end of the table, skipping
+// blocks the zone map rules out for the given conditions
+void table_scan_begin(TableScan* scan, WhereCondition* conditions, int condition_count) {
+    memset(scan, 0, sizeof(TableScan));
+    scan->checked_page = -1;
+    scan->conditions = conditions;
+    scan->condition_count = condition_count;
+    scan->next_row = current_table.first_row;
+    scan->end_row = table_row_count();
+    SegmentStore* store = current_table.segments;
+    if (!store || scan->next_row >= scan->end_row) return;
+    
+    fflush(current_table.data_file);
+    scan->chunk_rows = SCAN_CHUNK_BYTES / store->page_size * store->page_records;
+    if (scan->chunk_rows > store->segment_rows) scan->chunk_rows = store->segment_rows;
+    // An unaligned first row can spill into one extra page
+    scan->chunk_bytes = (scan->chunk_rows / store->page_records + 1) * store->page_size;
+    if (posix_memalign((void**)&scan->memory, 4096, SCAN_QUEUE_DEPTH * scan->chunk_bytes) != 0) {
+        scan->memory = NULL;
+        printf("Out of memory for table scan\n");
+        return;
+    }
+    for (int i = 0; i < SCAN_QUEUE_DEPTH; i++) {
+        scan->chunks[i].read.buffer = scan->memory + i * scan->chunk_bytes;
+        table_scan_submit(scan, &scan->chunks[i]);
+    }
+}
+
+// Next live row and its record, which stays valid until the next call
+bool table_scan_next(TableScan* scan, long* row, char** record) {
+    if (!scan->memory) return false;
+    SegmentStore* store = current_table.segments;
+    
+    while (true) {
+        ScanChunk* chunk = &scan->chunks[scan->head];
+        if (!chunk->pending || chunk->first_row >= scan->end_row) return false;
+        if (!chunk->ready && !table_scan_ready(scan, chunk)) {
+            chunk->pending = false;
+            return false;
+        }
+        
+        while (scan->row < chunk->end_row) {
+            long current = scan->row++;
+            long page = current / store->page_records;
+            char* page_data = chunk->read.buffer + (page - chunk->first_page) * store->page_size;
+            if (page != scan->checked_page) {
+                scan->checked_page = page;
+                scan->page_valid = page_check(store, page_data, page);
+            }
+            if (!scan->page_valid) {
+                scan->row = (page + 1) * store->page_records;
+                continue;
+            }
+            if (!scan->with_deleted && row_deleted(current)) continue;
+            *row = current;
+            *record = page_data + sizeof(PageHeader) + (current % store->page_records) * store->record_size;
+            return true;
+        }
+        
+        // Done with this chunk: reuse its buffer for the next range
+        table_scan_submit(scan, chunk);
+        scan->head = (scan->head + 1) % SCAN_QUEUE_DEPTH;
+    }
+}
+
+void table_scan_end(TableScan* scan) {
+    for (int i = 0; i < SCAN_QUEUE_DEPTH; i++) {
+        if (scan->chunks[i].pending && !scan->chunks[i].ready) async_read_wait(&scan->chunks[i].read);
+    }
+    free(scan->memory);
+    scan->memory = NULL;
+}
+
+// Row fetches
+static void row_fetch_submit(RowFetch* fetch, FetchRange* range) {
+    SegmentStore* store = current_table.segments;
+    long page_records = store->page_records;
+    long pages_per_segment = store->segment_rows / page_records;
+    range->pending = false;
+    range->ready = false;
+    if (fetch->planned >= fetch->count) return;
+    
+    // A larger gap, a position out of order, a segment boundary or a full
+    // buffer ends the range
+    long first = position_row(fetch->positions[fetch->planned]) / page_records;
+    long last = first;
+    long end = fetch->planned + 1;
+    while (end < fetch->count) {
+        long page = position_row(fetch->positions[end]) / page_records;
+        if (page < last || page - last > ROW_FETCH_GAP_PAGES || page - first >= fetch->range_pages ||
+            page / pages_per_segment != first / pages_per_segment) break;
+        last = page;
+        end++;
+    }
+    range->begin = fetch->planned;
+    range->end = end;
+    range->first_page = first;
+    range->page_count = last - first + 1;
+    range->pending = true;
+    fetch->planned = end;
+    
+    // Hot pages come from the buffer pool; the read spans the first to the
+    // last miss, so a range of hits needs no I/O at all
+    long first_miss = -1, last_miss = -1;
+    for (long i = 0; i < range->page_count; i++) {
+        range->cached[i] = buffer_pool_copy(store->pool, first + i, 0, store->page_size,
+                                            range->buffer + i * store->page_size);
+        if (range->cached[i]) continue;
+        if (first_miss < 0) first_miss = i;
+        last_miss = i;
+    }
+    range->read_page = first_miss < 0 ? -1 : first + first_miss;
+    if (first_miss < 0) return;
+    
+    range->read.fd = segment_fd(store, first / pages_per_segment, false);
+    range->read.buffer = range->buffer + first_miss * store->page_size;
+    range->read.length = (last_miss - first_miss + 1) * store->page_size;
+    range->read.offset = SEGMENT_HEADER_BYTES + (range->read_page % pages_per_segment) * store->page_size;
+    if (range->read.fd < 0) {
+        range->read.result = -ENOENT;
+        range->read.done = true;
+        return;
+    }
+    async_read_submit(&range->read);
+}
+
+// Waits for the range; rows past the end of what was read count as missing
+static void row_fetch_ready(FetchRange* range) {
+    int page_size = current_table.segments->page_size;
+    range->ready = true;
+    range->pages = range->page_count;
+    if (range->read_page < 0) return;
+    
+    async_read_wait(&range->read);
+    long read_from = range->read_page - range->first_page;
+    if (range->read.result < 0) {
+        if (range->read.fd >= 0) printf("Error reading table data: %s\n", strerror(-range->read.result));
+        range->pages = read_from;
+        return;
+    }
+    
+    long bytes = range->read.result;
+    long count = (bytes + page_size - 1) / page_size;
+    memset(range->read.buffer + bytes, 0, count * page_size - bytes);
+    if (read_from + count < range->pages) range->pages = read_from + count;
+}
+
+void row_fetch_begin(RowFetch* fetch, const PositionList* positions) {
+    memset(fetch, 0, sizeof(RowFetch));
+    fetch->checked_page = -1;
+    fetch->positions = positions->items;
+    fetch->count = positions->count;
+    SegmentStore* store = current_table.segments;
+    if (!store || fetch->count == 0) return;
+    
+    fflush(current_table.data_file);
+    fetch->range_pages = ROW_FETCH_BUFFER / store->page_size;
+    if (fetch->range_pages < 1) fetch->range_pages = 1;
+    size_t range_bytes = (size_t)fetch->range_pages * store->page_size;
+    size_t buffer_bytes = ROW_FETCH_QUEUE_DEPTH * range_bytes;
+    if (posix_memalign((void**)&fetch->memory, 4096, buffer_bytes + ROW_FETCH_QUEUE_DEPTH * fetch->range_pages) != 0) {
+        fetch->memory = NULL;
+        printf("Out of memory for row fetch\n");
+        return;
+    }
+    for (int i = 0; i < ROW_FETCH_QUEUE_DEPTH; i++) {
+        fetch->ranges[i].buffer = fetch->memory + i * range_bytes;
+        fetch->ranges[i].cached = fetch->memory + buffer_bytes + i * fetch->range_pages;
+        row_fetch_submit(fetch, &fetch->ranges[i]);
+    }
+}
+
+// Next live row in position order; record stays valid until the next call
+bool row_fetch_next(RowFetch* fetch, long* position, char** record) {
+    if (!fetch->memory) return false;
+    SegmentStore* store = current_table.segments;
+    
+    while (fetch->next < fetch->count) {
+        FetchRange* range = &fetch->ranges[fetch->head];
+        if (!range->pending) return false;
+        if (fetch->next == range->end) {
+            // Done with this range: reuse its buffer for the next one
+            row_fetch_submit(fetch, range);
+            fetch->head = (fetch->head + 1) % ROW_FETCH_QUEUE_DEPTH;
+            continue;
+        }
+        if (!range->ready) row_fetch_ready(range);
+        
+        long row = position_row(fetch->positions[fetch->next]);
+        *position = fetch->positions[fetch->next++];
+        long page = row / store->page_records;
+        if (page - range->first_page >= range->pages || row_deleted(row)) continue;
+        char* page_data = range->buffer + (page - range->first_page) * store->page_size;
+        if (page != fetch->checked_page) {
+            // Pages read from disk join the pool once checked; lone pages of
+            // sparse lookups come in referenced, as in segment_read()
+            bool cached = range->cached[page - range->first_page];
+            fetch->checked_page = page;
+            fetch->page_valid = cached || page_check(store, page_data, page);
+            if (fetch->page_valid && !cached) {
+                buffer_pool_put(store->pool, page, page_data, range->read.length == (size_t)store->page_size);
+            }
+        }
+        if (!fetch->page_valid) continue;
+        *record = page_data + sizeof(PageHeader) + (row % store->page_records) * store->record_size;
+        return true;
+    }
+    return false;
+}
+
+void row_fetch_end(RowFetch* fetch) {
+    for (int i = 0; i < ROW_FETCH_QUEUE_DEPTH; i++) {
+        FetchRange* range = &fetch->ranges[i];
+        if (range->pending && !range->ready && range->read_page >= 0) async_read_wait(&range->read);
+    }
+    free(fetch->memory);
+    fetch->memory = NULL;
+}
+
+// Keeps only the index entries of rows in [first_row, end_row); used when
+// rows leave the table in bulk, so nothing is read back from the data
+static void prune_indexes(long first_row, long end_row) {
+    long from = row_position(first_row);
+    long to = end_row == LONG_MAX ? LONG_MAX : row_position(end_row);
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.indexes[i]) current_table.indexes[i] = pruneAVL(current_table.indexes[i], from, to);
+        if (current_table.btrees[i]) btree_prune(current_table.btrees[i], from, to);
+        if (current_table.lsm_indexes[i]) lsm_prune(current_table.lsm_indexes[i], from, to);
+        if (current_table.bitmap_indexes[i]) bitmap_index_prune(current_table.bitmap_indexes[i], first_row, end_row);
+        if (current_table.hash_indexes[i]) hash_index_prune(current_table.hash_indexes[i], first_row, end_row);
+        if (current_table.trigram_indexes[i]) trigram_index_prune(current_table.trigram_indexes[i], from, to);
+    }
+}
+
+// The BWT cannot be cut, so FM indexes are rebuilt after rows move or leave
+static void rebuild_fm_indexes() {
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (!current_table.fm_indexes[i]) continue;
+        char index_file[150];
+        index_filename(index_file, sizeof(index_file), i, "fm");
+        fm_index_close(current_table.fm_indexes[i]);
+        current_table.fm_indexes[i] = fm_index_build(i, index_file) ? fm_index_open(index_file) : NULL;
+    }
+}
+
+// Retention drops whole segments from the front of the table: each one is a
+// single unlink. The indexes are trimmed in memory, the FM index is rebuilt.
+void apply_retention() {
+    if (!current_table.segments || (current_table.retention_days <= 0 && current_table.retention_rows <= 0)) return;
+    
+    SegmentStore* store = current_table.segments;
+    long end_row = table_row_count();
+    long segment = current_table.first_row / current_table.segment_rows;
+    long active = end_row > 0 ? (end_row - 1) / current_table.segment_rows : 0;
+    time_t cutoff_time = time(NULL) - current_table.retention_days * 86400;
+    long dropped = 0;
+    
+    fflush(current_table.data_file);
+    for (; segment < active; segment++) {
+        char path[200];
+        snprintf(path, sizeof(path), "%s/%06ld.seg", store->directory, segment);
+        if (current_table.retention_rows > 0) {
+            if ((segment + 1) * current_table.segment_rows > end_row - current_table.retention_rows) break;
+        } else {
+            struct stat info;
+            if (stat(path, &info) == 0 && info.st_mtime >= cutoff_time) break;
+        }
+        
+        pthread_mutex_lock(&store->lock);
+        if (segment < store->segment_capacity && store->segment_fds[segment] >= 0) {
+            close(store->segment_fds[segment]);
+            store->segment_fds[segment] = -1;
+        }
+        pthread_mutex_unlock(&store->lock);
+        unlink(path);
+        dropped++;
+    }
+    if (dropped == 0) return;
+    
+    long first_row = segment * current_table.segment_rows;
+    prune_indexes(first_row, LONG_MAX);
+    roaring_trim(current_table.tombstones, first_row, LONG_MAX);
+    tombstones_save();
+    
+    long expired = first_row - current_table.first_row;
+    current_table.first_row = first_row;
+    current_table.row_count = end_row - first_row - roaring_cardinality(current_table.tombstones);
+    save_table_header();
+    rebuild_fm_indexes();
+    printf("Retention: %ld segment(s) with %ld rows dropped\n", dropped, expired);
+}
+
+// ALTER TABLE t SET RETENTION n DAYS|ROWS, or NONE
+void set_retention(long amount, const char* unit) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    if (!current_table.segments) {
+        printf("Retention needs a segmented table\n");
+        return;
+    }
+    
+    current_table.retention_days = 0;
+    current_table.retention_rows = 0;
+    if (strncasecmp(unit, "DAY", 3) == 0) {
+        current_table.retention_days = amount;
+    } else if (strncasecmp(unit, "ROW", 3) == 0) {
+        current_table.retention_rows = amount;
+    }
+    save_table_header();
+    
+    if (amount > 0) printf("Retention of '%s' set to %ld %s\n", current_table.name, amount, unit);
+    else printf("Retention of '%s' removed\n", current_table.name);
+    apply_retention();
+}
+
+// Sidecar index files live next to the table: ODQ_<table>.<field>.<extension>
+void index_filename(char* out, size_t size, int field_index, const char* extension) {
+    snprintf(out, size, "%s_%s.%s.%s", TABLE_PREFIX, current_table.name,
+             current_table.fields[field_index].name, extension);
+}
+
+void create_text_index(const char* field_name, TextIndexKind kind) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    
+    if (field_index == -1) {
+        printf("Field '%s' not found\n", field_name);
+        return;
+    }
+    
+    Field* field = &current_table.fields[field_index];
+    if (field->type != FIELD_TEXT) {
+        printf("Text index requires a text field\n");
+        return;
+    }
+    
+    trigram_index_free(current_table.trigram_indexes[field_index]);
+    current_table.trigram_indexes[field_index] = NULL;
+    fm_index_close(current_table.fm_indexes[field_index]);
+    current_table.fm_indexes[field_index] = NULL;
+    
+    char index_file[150];
+    if (kind == TEXT_INDEX_FM) {
+        index_filename(index_file, sizeof(index_file), field_index, "fm");
+        if (!fm_index_build(field_index, index_file) ||
+            !(current_table.fm_indexes[field_index] = fm_index_open(index_file))) {
+            printf("Error building FM index on '%s'\n", field_name);
+            return;
+        }
+        field->text_index = TEXT_INDEX_FM;
+        save_table_header();
+        printf("FM index on '%s' created (%ld rows, %ld bytes)\n", field_name,
+               current_table.fm_indexes[field_index]->header->indexed_rows - current_table.first_row,
+               (long)current_table.fm_indexes[field_index]->map_size);
+        return;
+    }
+    
+    int offset = 0;
+    for (int i = 0; i < field_index; i++) {
+        offset += current_table.fields[i].size;
+    }
+    
+    TrigramIndex* index = trigram_index_create();
+    
+    fseek(current_table.data_file, table_data_start(), SEEK_SET);
+    char record[MAX_RECORD_SIZE];
+    long position = ftell(current_table.data_file);
+    long rows = 0;
+    
+    while (fread(record, current_table.record_size, 1, current_table.data_file)) {
+        if (!row_deleted(position_row(position))) trigram_index_add(index, record + offset, field->size, position);
+        position += current_table.record_size;
+        rows++;
+    }
+    // A damaged page would leave its rows out of the index for good
+    if (position_row(position) < table_row_count()) {
+        printf("Error building text index on '%s': row %ld could not be read\n", field_name, position_row(position));
+        trigram_index_free(index);
+        return;
+    }
+    index->indexed_rows = position_row(position);
+    
+    current_table.trigram_indexes[field_index] = index;
+    field->text_index = TEXT_INDEX_TRIGRAM;
+    save_table_header();
+    
+    index_filename(index_file, sizeof(index_file), field_index, "tri");
+    trigram_index_save(index, index_file);
+    printf("Text index on '%s' created (%d trigrams, %ld rows)\n", field_name, index->used, rows);
+}
+
+bool load_table_from_file(const char* filename, Table* table) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return false;
+    }
+    
+    char page[TABLE_HEADER_BYTES];
+    if (fread(page, TABLE_HEADER_BYTES, 1, file) != 1 || !table_header_decode(page, table)) {
+        fclose(file);
+        return false;
+    }
+    
+    fclose(file);
+    strncpy(table->filename, filename, sizeof(table->filename) - 1);
+    return true;
+}
+
+static long slot_occurrences(const char* slot, int size, const char* text, int length) {
+    long occurrences = 0;
+    for (int i = 0; i + length <= size; i++) {
+        if (slot[i] == text[0] && memcmp(slot + i, text, length) == 0) occurrences++;
+    }
+    return occurrences;
+}
+
+// Number of occurrences of the text in one field; O(pattern length) with an FM index
+void count_text(const char* search_text, const char* field_name) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    
+    if (field_index == -1 || current_table.fields[field_index].type != FIELD_TEXT) {
+        printf("Text field '%s' not found\n", field_name);
+        return;
+    }
+    
+    int offset = 0;
+    for (int i = 0; i < field_index; i++) {
+        offset += current_table.fields[i].size;
+    }
+    
+    int length = strlen(search_text);
+    Field field = current_table.fields[field_index];
+    FMIndex* index = current_table.fm_indexes[field_index];
+    long occurrences = 0;
+    long first_row = current_table.first_row;
+    char record[MAX_RECORD_SIZE];
+    
+    if (index && length > 0) {
+        occurrences = fm_count(index, search_text, length);
+        first_row = index->header->indexed_rows;
+        
+        // The FM index still holds deleted rows; their matches are taken back
+        PositionList deleted = {0};
+        if (has_tombstones()) roaring_positions(current_table.tombstones, &deleted);
+        for (long i = 0; i < deleted.count && deleted.items[i] < row_position(first_row); i++) {
+            if (table_pread(record, current_table.record_size, deleted.items[i]) == current_table.record_size) {
+                occurrences -= slot_occurrences(record + offset, field.size, search_text, length);
+            }
+        }
+        free(deleted.items);
+    }
+    
+    fseek(current_table.data_file, row_position(first_row), SEEK_SET);
+    long row = first_row;
+    for (; length > 0 && fread(record, current_table.record_size, 1, current_table.data_file); row++) {
+        if (!row_deleted(row)) occurrences += slot_occurrences(record + offset, field.size, search_text, length);
+    }
+    if (length > 0 && row < table_row_count()) {
+        printf("Error counting '%s': row %ld could not be read\n", search_text, row);
+        return;
+    }
+    
+    printf("OCCURRENCES: %ld\n", occurrences);
+}
+
+// Adds a record stored at the given position to the zone map and to every
+// index of the table
+void index_add_record(const char* record, long position) {
+    zone_map_add(current_table.zone_map, position_row(position), record);
+    
+    int offset = 0;
+    for (int i = 0; i < current_table.field_count; i++) {
+        Field field = current_table.fields[i];
+        char key[256] = {0};
+        
+        switch (field.type) {
+            case FIELD_INT: {
+                int value;
+                memcpy(&value, record + offset, sizeof(int));
+                snprintf(key, sizeof(key), "%d", value);
+                break;
+            }
+            case FIELD_TEXT:
+                strncpy(key, record + offset, field.size);
+                key[field.size] = '\0';
+                break;
+            case FIELD_BOOL: {
+                bool value;
+                memcpy(&value, record + offset, sizeof(bool));
+                strcpy(key, value ? "true" : "false");
+                break;
+            }
+        }
+        
+        if (ordered_index(i)) {
+            ordered_insert(i, key, position);
+        } else if (field.index == INDEX_BITMAP) {
+            bitmap_index_add(current_table.bitmap_indexes[i], key, position_row(position));
+        } else if (field.index == INDEX_HASH) {
+            hash_index_add(current_table.hash_indexes[i], key, position_row(position));
+            current_table.hash_indexes[i]->indexed_rows = position_row(position) + 1;
+        }
+        if (current_table.trigram_indexes[i]) {
+            trigram_index_add(current_table.trigram_indexes[i], record + offset, field.size, position);
+            current_table.trigram_indexes[i]->indexed_rows = position_row(position) + 1;
+        }
+        offset += field.size;
+    }
+}
+
+// Encodes a trimmed literal into the field's fixed-width slot
+void store_field_value(const Field* field, const char* value, char* slot) {
+    switch (field->type) {
+        case FIELD_INT: {
+            int number = atoi(value);
+            memcpy(slot, &number, sizeof(int));
+            break;
+        }
+        case FIELD_TEXT:
+            strncpy(slot, value, field->size);
+            break;
+        case FIELD_BOOL: {
+            bool flag = (strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0);
+            memcpy(slot, &flag, sizeof(bool));
+            break;
+        }
+    }
+}
+
+void insert_into_table(const char* values) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    char values_copy[MAX_QUERY_LENGTH];
+    strcpy(values_copy, values);
+    char* token = strtok(values_copy, ",");
+    
+    char record[MAX_RECORD_SIZE] = {0};
+    int offset = 0;
+    
+    for (int i = 0; i < current_table.field_count && token; i++) {
+        while (*token == ' ' || *token == '\'') token++;
+        char* end = token + strlen(token) - 1;
         while (end > token && (*end == ' ' || *end == '\'')) *end-- = '\0';
         
-        Field field = current_table.fields[i];
+        store_field_value(&current_table.fields[i], token, record + offset);
+        offset += current_table.fields[i].size;
+        token = strtok(NULL, ",");
+    }
+    
+    fseek(current_table.data_file, 0, SEEK_END);
+    long position = ftell(current_table.data_file);
+    fwrite(record, current_table.record_size, 1, current_table.data_file);
+    current_table.row_count++;
+    save_row_count();
+    index_add_record(record, position);
+    
+    printf("1 row inserted\n");
+    
+    // A new segment was started, so the oldest one may have expired
+    if (current_table.segments && position_row(position) % current_table.segment_rows == 0) {
+        apply_retention();
+    }
+}
+
+// A rewritten segment takes the modification time of the newest segment
+// its rows came from, which is what retention by days looks at
+static bool vacuum_close_segment(SegmentStore* store, FILE* out, long source_segment) {
+    char source[200];
+    struct stat info;
+    snprintf(source, sizeof(source), "%s/%06ld.seg", store->directory, source_segment);
+    bool written = fflush(out) == 0;
+    if (written && stat(source, &info) == 0) {
+        struct timespec times[2] = { info.st_atim, info.st_mtim };
+        futimens(fileno(out), times);
+    }
+    return fclose(out) == 0 && written;
+}
+
+// Marks matching rows in the tombstone bitmap. Neither the data nor the
+// indexes change; scans and lookups skip the rows until VACUUM drops them.
+void delete_rows(const char* where_clause) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    int condition_count = 0;
+    WhereCondition* conditions = parse_where_conditions(where_clause, &condition_count);
+    if (conditions == NULL || condition_count == 0) {
+        printf("Syntax: DELETE FROM tablename WHERE condition\n");
+        free_where_conditions(conditions, condition_count);
+        return;
+    }
+    
+    long deleted = 0;
+    PositionList candidates = {0};
+    
+    if (plan_index_candidates(conditions, condition_count, &candidates)) {
+        RowFetch fetch;
+        long position;
+        char* row_record;
+        row_fetch_begin(&fetch, &candidates);
+        while (row_fetch_next(&fetch, &position, &row_record)) {
+            if (check_complex_conditions(row_record, conditions, condition_count)) {
+                roaring_add(current_table.tombstones, position_row(position));
+                deleted++;
+            }
+        }
+        row_fetch_end(&fetch);
+        free(candidates.items);
+    } else {
+        TableScan scan;
+        long row;
+        char* row_record;
+        table_scan_begin(&scan, conditions, condition_count);
+        while (table_scan_next(&scan, &row, &row_record)) {
+            if (check_complex_conditions(row_record, conditions, condition_count)) {
+                roaring_add(current_table.tombstones, row);
+                deleted++;
+            }
+        }
+        table_scan_end(&scan);
+    }
+    free_where_conditions(conditions, condition_count);
+    
+    if (deleted > 0) {
+        current_table.row_count -= deleted;
+        save_row_count();
+        tombstones_save();
+    }
+    printf("%ld rows deleted\n", deleted);
+}
+
+// Moves one row's entry in the indexes of a field from its old key to the
+// new one; other fields' indexes are left alone
+static void index_update_field(int field_index, const char* old_record, const char* new_record, long position) {
+    Field field = current_table.fields[field_index];
+    int offset = 0;
+    for (int i = 0; i < field_index; i++) offset += current_table.fields[i].size;
+    if (memcmp(old_record + offset, new_record + offset, field.size) == 0) return;
+    
+    char old_key[256], new_key[256];
+    record_field_key(old_record, field_index, old_key, sizeof(old_key));
+    record_field_key(new_record, field_index, new_key, sizeof(new_key));
+    long row = position_row(position);
+    
+    if (ordered_index(field_index)) {
+        ordered_delete(field_index, old_key, position);
+        ordered_insert(field_index, new_key, position);
+    } else if (field.index == INDEX_BITMAP) {
+        bitmap_index_remove(current_table.bitmap_indexes[field_index], old_key, row);
+        bitmap_index_add(current_table.bitmap_indexes[field_index], new_key, row);
+    } else if (field.index == INDEX_HASH) {
+        hash_index_remove(current_table.hash_indexes[field_index], old_key, row);
+        hash_index_add(current_table.hash_indexes[field_index], new_key, row);
+    }
+    if (current_table.trigram_indexes[field_index]) {
+        trigram_index_remove(current_table.trigram_indexes[field_index], old_record + offset, field.size, position);
+        trigram_index_add(current_table.trigram_indexes[field_index], new_record + offset, field.size, position);
+    }
+}
+
+// UPDATE rewrites only the assigned fields of each matching row, in place.
+// Matches are collected first, so an assignment cannot make a row match
+// again further on. Zone bounds widen to cover the new values.
+void update_rows(const char* assignments, const char* where_clause) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    int fields[MAX_FIELDS];
+    char values[MAX_FIELDS][MAX_RECORD_SIZE];
+    int offsets[MAX_FIELDS];
+    int assigned = 0;
+    char list[MAX_QUERY_LENGTH];
+    snprintf(list, sizeof(list), "%s", assignments);
+    
+    // Split on commas outside quotes
+    char* part = list;
+    while (part && *part) {
+        char* next = part;
+        bool quoted = false;
+        while (*next && (quoted || *next != ',')) {
+            if (*next == '\'') quoted = !quoted;
+            next++;
+        }
+        if (*next) *next++ = '\0';
+        else next = NULL;
+        
+        char name[50];
+        char* equals = strchr(part, '=');
+        if (!equals || sscanf(part, " %49[^= ]", name) != 1 || assigned == MAX_FIELDS) {
+            printf("Syntax: UPDATE tablename SET field = value [, ...] [WHERE condition]\n");
+            return;
+        }
+        int field_index = -1;
+        int offset = 0;
+        for (int i = 0; i < current_table.field_count && field_index < 0; i++) {
+            if (strcmp(current_table.fields[i].name, name) == 0) field_index = i;
+            else offset += current_table.fields[i].size;
+        }
+        if (field_index < 0) {
+            printf("Field '%s' not found\n", name);
+            return;
+        }
+        
+        char* value = equals + 1;
+        while (*value == ' ' || *value == '\'') value++;
+        char* end = value + strlen(value) - 1;
+        while (end >= value && (*end == ' ' || *end == '\'')) *end-- = '\0';
+        memset(values[assigned], 0, current_table.fields[field_index].size);
+        store_field_value(&current_table.fields[field_index], value, values[assigned]);
+        fields[assigned] = field_index;
+        offsets[assigned++] = offset;
+        part = next;
+    }
+    if (assigned == 0) {
+        printf("Syntax: UPDATE tablename SET field = value [, ...] [WHERE condition]\n");
+        return;
+    }
+    
+    int condition_count = 0;
+    WhereCondition* conditions = NULL;
+    if (where_clause) {
+        conditions = parse_where_conditions(where_clause, &condition_count);
+        if (conditions == NULL || condition_count == 0) {
+            printf("Error parsing WHERE clause\n");
+            free_where_conditions(conditions, condition_count);
+            return;
+        }
+    }
+    
+    char record[MAX_RECORD_SIZE];
+    PositionList matches = {0};
+    PositionList candidates = {0};
+    if (conditions && plan_index_candidates(conditions, condition_count, &candidates)) {
+        RowFetch fetch;
+        long position;
+        char* row_record;
+        row_fetch_begin(&fetch, &candidates);
+        while (row_fetch_next(&fetch, &position, &row_record)) {
+            if (check_complex_conditions(row_record, conditions, condition_count)) {
+                position_list_add(&matches, position);
+            }
+        }
+        row_fetch_end(&fetch);
+        free(candidates.items);
+    } else {
+        TableScan scan;
+        long row;
+        char* row_record;
+        table_scan_begin(&scan, conditions, conditions ? condition_count : 0);
+        while (table_scan_next(&scan, &row, &row_record)) {
+            if (!conditions || check_complex_conditions(row_record, conditions, condition_count)) {
+                position_list_add(&matches, row_position(row));
+            }
+        }
+        table_scan_end(&scan);
+    }
+    free_where_conditions(conditions, condition_count);
+    
+    bool rebuild_fm = false;
+    for (int a = 0; a < assigned; a++) rebuild_fm = rebuild_fm || current_table.fm_indexes[fields[a]];
+    
+    // Retention by days goes by the segments' modification times, so the
+    // segments written here get theirs back, as VACUUM does for its own
+    SegmentStore* store = current_table.segments;
+    long segments = table_row_count() / current_table.segment_rows + 1;
+    struct timespec (*times)[2] = calloc(segments, sizeof(*times));
+    bool* touched = calloc(segments, sizeof(bool));
+    
+    long updated = 0;
+    fflush(current_table.data_file);
+    for (long i = 0; i < matches.count; i++) {
+        long position = matches.items[i];
+        char changed[MAX_RECORD_SIZE];
+        if (table_pread(record, current_table.record_size, position) != current_table.record_size) continue;
+        memcpy(changed, record, current_table.record_size);
+        
+        long segment = position_row(position) / current_table.segment_rows;
+        struct stat info;
+        if (segment < segments && !touched[segment] && fstat(segment_fd(store, segment, false), &info) == 0) {
+            times[segment][0] = info.st_atim;
+            times[segment][1] = info.st_mtim;
+            touched[segment] = true;
+        }
+        
+        bool written = true;
+        for (int a = 0; a < assigned; a++) {
+            int size = current_table.fields[fields[a]].size;
+            memcpy(changed + offsets[a], values[a], size);
+            written = written && table_pwrite(values[a], size, position + offsets[a]) == size;
+        }
+        if (!written) {
+            printf("Error writing row %ld\n", position_row(position));
+            break;
+        }
+        for (int a = 0; a < assigned; a++) index_update_field(fields[a], record, changed, position);
+        zone_map_add(current_table.zone_map, position_row(position), changed);
+        updated++;
+    }
+    free(matches.items);
+    fflush(current_table.data_file);
+    for (long segment = 0; segment < segments; segment++) {
+        if (touched[segment]) futimens(segment_fd(store, segment, false), times[segment]);
+    }
+    free(times);
+    free(touched);
+    
+    if (updated > 0 && rebuild_fm) rebuild_fm_indexes();
+    printf("%ld rows updated\n", updated);
+}
+
+// Rewrites the segments from the first one holding a deleted row onward,
+// packing the live rows together. Earlier rows keep their positions and
+// their index entries; the entries of moved rows are dropped and added
+// again at the new positions while the rows are copied.
+void vacuum_table() {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    if (!has_tombstones()) {
+        printf("Nothing to vacuum\n");
+        return;
+    }
+    if (!current_table.segments) {
+        printf("VACUUM needs a segmented table\n");
+        return;
+    }
+    
+    SegmentStore* store = current_table.segments;
+    long segment_rows = current_table.segment_rows;
+    int record_size = current_table.record_size;
+    long end_row = table_row_count();
+    long first_segment = roaring_first(current_table.tombstones) / segment_rows;
+    long last_segment = (end_row - 1) / segment_rows;
+    long start_row = first_segment * segment_rows;
+    
+    fflush(current_table.data_file);
+    prune_indexes(current_table.first_row, start_row);
+    ZoneMap* map = current_table.zone_map;
+    if (map->count > start_row / ZONE_ROWS) map->count = start_row / ZONE_ROWS;
+    
+    long chunk_rows = SEGMENT_IO_BUFFER / record_size > 0 ? SEGMENT_IO_BUFFER / record_size : 1;
+    char* buffer = malloc(chunk_rows * record_size);
+    int page_size = store->page_size;
+    int page_records = store->page_records;
+    char* page = malloc(page_size);
+    PageHeader* page_header = (PageHeader*)page;
+    char path[200], temporary[220];
+    FILE* out = NULL;
+    long written = start_row;
+    long source_segment = first_segment;
+    bool failed = false;
+    
+    // Segments hold whole pages, so start_row need not open a zone block:
+    // the block is rebuilt from its rows ahead of start_row, which stay put
+    long block_start = start_row / ZONE_ROWS * ZONE_ROWS;
+    if (block_start < current_table.first_row) block_start = current_table.first_row;
+    for (long row = block_start; row < start_row && !failed; ) {
+        long rows = start_row - row < chunk_rows ? start_row - row : chunk_rows;
+        if (table_pread(buffer, rows * record_size, row_position(row)) != rows * record_size) {
+            failed = true;
+            break;
+        }
+        for (long i = 0; i < rows; i++, row++) zone_map_add(map, row, buffer + i * record_size);
+    }
+    
+    for (long row = start_row; row < end_row && !failed; ) {
+        long rows = end_row - row < chunk_rows ? end_row - row : chunk_rows;
+        if (table_pread(buffer, rows * record_size, row_position(row)) != rows * record_size) {
+            failed = true;
+            break;
+        }
+        for (long i = 0; i < rows && !failed; i++, row++) {
+            if (roaring_contains(current_table.tombstones, row)) continue;
+            
+            if (written % page_records == 0 && out) {
+                page_seal(page, page_size);
+                failed = fwrite(page, page_size, 1, out) != 1;
+            }
+            if (written % segment_rows == 0 || !out) {
+                if (out) failed = !vacuum_close_segment(store, out, source_segment) || failed;
+                snprintf(temporary, sizeof(temporary), "%s/%06ld.seg.tmp", store->directory, written / segment_rows);
+                out = fopen(temporary, "wb");
+                char header[SEGMENT_HEADER_BYTES];
+                segment_header_page(store, written / segment_rows, header);
+                failed = failed || !out || fwrite(header, SEGMENT_HEADER_BYTES, 1, out) != 1;
+            }
+            if (written % page_records == 0) {
+                memset(page, 0, page_size);
+                page_header->first_row = written;
+            }
+            if (failed) break;
+            source_segment = row / segment_rows;
+            memcpy(page + sizeof(PageHeader) + page_header->slot_count++ * record_size, buffer + i * record_size, record_size);
+            index_add_record(buffer + i * record_size, row_position(written));
+            written++;
+        }
+    }
+    if (out && !failed) {
+        page_seal(page, page_size);
+        failed = fwrite(page, page_size, 1, out) != 1;
+    }
+    if (out && !vacuum_close_segment(store, out, source_segment)) failed = true;
+    free(buffer);
+    free(page);
+    
+    long new_last_segment = written > start_row ? (written - 1) / segment_rows : first_segment - 1;
+    if (failed) {
+        for (long s = first_segment; s <= new_last_segment; s++) {
+            snprintf(temporary, sizeof(temporary), "%s/%06ld.seg.tmp", store->directory, s);
+            unlink(temporary);
+        }
+        printf("Error writing segments, VACUUM aborted\n");
+        char table_name[MAX_TABLE_NAME];
+        strcpy(table_name, current_table.name);
+        load_table(table_name);
+        return;
+    }
+    
+    // Swap the new segments in and drop the ones left empty
+    pthread_mutex_lock(&store->lock);
+    for (long s = first_segment; s <= last_segment; s++) {
+        if (s < store->segment_capacity && store->segment_fds[s] >= 0) {
+            close(store->segment_fds[s]);
+            store->segment_fds[s] = -1;
+        }
+        snprintf(path, sizeof(path), "%s/%06ld.seg", store->directory, s);
+        snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+        if (s <= new_last_segment) rename(temporary, path);
+        else unlink(path);
+    }
+    store->data_bytes = written * record_size;
+    store->page_number = -1;
+    pthread_mutex_unlock(&store->lock);
+    buffer_pool_clear(store->pool);
+    fseek(current_table.data_file, 0, SEEK_SET);
+    
+    long removed = end_row - written;
+    roaring_free(current_table.tombstones);
+    tombstones_save();
+    current_table.row_count = written - current_table.first_row;
+    save_row_count();
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.hash_indexes[i]) current_table.hash_indexes[i]->indexed_rows = written;
+        if (current_table.trigram_indexes[i]) current_table.trigram_indexes[i]->indexed_rows = written;
+    }
+    map->indexed_rows = written;
+    map->dirty = true;
+    rebuild_fm_indexes();
+    
+    printf("VACUUM: %ld deleted rows removed, %ld segment(s) rewritten\n", removed, last_segment - first_segment + 1);
+}
+
+void select_all() {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    TableScan scan;
+    long row;
+    char* record;
+    int count = 0;
+    
+    table_scan_begin(&scan, NULL, 0);
+    while (table_scan_next(&scan, &row, &record)) {
+        int offset = 0;
+        for (int i = 0; i < current_table.field_count; i++) {
+            Field field = current_table.fields[i];
+            
+            switch (field.type) {
+                case FIELD_INT: {
+                    int value;
+                    memcpy(&value, record + offset, sizeof(int));
+                    printf("%s: %d", field.name, value);
+                    break;
+                }
+                case FIELD_TEXT: {
+                    char text[field.size + 1];
+                    strncpy(text, record + offset, field.size);
+                    text[field.size] = '\0';
+                    printf("%s: '%s'", field.name, text);
+                    break;
+                }
+                case FIELD_BOOL: {
+                    bool value;
+                    memcpy(&value, record + offset, sizeof(bool));
+                    printf("%s: %s", field.name, value ? "true" : "false");
+                    break;
+                }
+            }
+            offset += field.size;
+            if (i < current_table.field_count - 1) printf(" | ");
+        }
+        printf("\n");
+        count++;
+    }
+    table_scan_end(&scan);
+    
+    printf("%d rows returned\n", count);
+}
+
+void select_field(const char* field_name) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    
+    if (field_index == -1) {
+        printf("Field '%s' not found\n", field_name);
+        return;
+    }
+    
+    TableScan scan;
+    long row;
+    char* record;
+    int count = 0;
+    
+    table_scan_begin(&scan, NULL, 0);
+    while (table_scan_next(&scan, &row, &record)) {
+        int offset = 0;
+        for (int i = 0; i < field_index; i++) {
+            offset += current_table.fields[i].size;
+        }
+        
+        Field field = current_table.fields[field_index];
+        
+        switch (field.type) {
+            case FIELD_INT: {
+                int value;
+                memcpy(&value, record + offset, sizeof(int));
+                printf("%s: %d\n", field.name, value);
+                break;
+            }
+            case FIELD_TEXT: {
+                char text[field.size + 1];
+                strncpy(text, record + offset, field.size);
+                text[field.size] = '\0';
+                printf("%s: '%s'\n", field.name, text);
+                break;
+            }
+            case FIELD_BOOL: {
+                bool value;
+                memcpy(&value, record + offset, sizeof(bool));
+                printf("%s: %s\n", field.name, value ? "true" : "false");
+                break;
+            }
+        }
+        count++;
+    }
+    table_scan_end(&scan);
+    
+    printf("%d rows returned\n", count);
+}
+
+bool compare_values(const char* field_value, const char* operator, const char* compare_value, FieldType field_type) {
+    if (strcasecmp(operator, "LIKE") == 0) {
+        return like_match(field_value, compare_value);
+    }
+    if (strcmp(operator, "=") == 0 || strcmp(operator, "==") == 0) {
+        return strcmp(field_value, compare_value) == 0;
+    }
+    else if (strcmp(operator, "!=") == 0) {
+        return strcmp(field_value, compare_value) != 0;
+    }
+    
+    // Text is ordered by strcmp, the same order its index keys use
+    if (field_type == FIELD_TEXT) {
+        int cmp = strcmp(field_value, compare_value);
+        if (strcmp(operator, ">") == 0) return cmp > 0;
+        if (strcmp(operator, "<") == 0) return cmp < 0;
+        if (strcmp(operator, ">=") == 0) return cmp >= 0;
+        if (strcmp(operator, "<=") == 0) return cmp <= 0;
+    }
+    
+    // Parsed as long like index keys and zone bounds, so literals beyond the
+    // int range compare the same way everywhere
+    if (field_type == FIELD_INT || field_type == FIELD_BOOL) {
+        long field_val = atol(field_value);
+        long cmp_val = atol(compare_value);
+        
+        if (strcmp(operator, ">") == 0) {
+            return field_val > cmp_val;
+        }
+        else if (strcmp(operator, "<") == 0) {
+            return field_val < cmp_val;
+        }
+        else if (strcmp(operator, ">=") == 0) {
+            return field_val >= cmp_val;
+        }
+        else if (strcmp(operator, "<=") == 0) {
+            return field_val <= cmp_val;
+        }
+    }
+    
+    return false;
+}
+
+static long in_list_slot(const InList* list, const char* value) {
+    long mask = list->slot_count - 1;
+    long slot = group_key_hash((const unsigned char*)value, strlen(value)) & mask;
+    while (list->slots[slot] != 0 && strcmp(list->values[list->slots[slot] - 1], value) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Parses "(v1, 'v2', ...)". Int values are normalised to the form
+// compare_values() sees, so 007 matches a stored 7.
+InList* in_list_parse(const char* text, FieldType type) {
+    const char* p = strchr(text, '(');
+    if (!p) return NULL;
+    p++;
+    
+    InList* list = calloc(1, sizeof(InList));
+    int capacity = 0;
+    list->slot_count = 16;
+    list->slots = calloc(list->slot_count, sizeof(int));
+    
+    while (*p && *p != ')') {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == ')' || *p == '\0') break;
+        
+        char value[100] = {0};
+        int length = 0;
+        if (*p == '\'') {
+            p++;
+            while (*p && *p != '\'' && length < (int)sizeof(value) - 1) value[length++] = *p++;
+            if (*p == '\'') p++;
+        } else {
+            while (*p && *p != ',' && *p != ')' && *p != ' ' && length < (int)sizeof(value) - 1) value[length++] = *p++;
+        }
+        if (type == FIELD_INT) snprintf(value, sizeof(value), "%ld", atol(value));
+        
+        if ((list->count + 1) * 2 > list->slot_count) {
+            free(list->slots);
+            list->slot_count *= 2;
+            list->slots = calloc(list->slot_count, sizeof(int));
+            for (int i = 0; i < list->count; i++) {
+                list->slots[in_list_slot(list, list->values[i])] = i + 1;
+            }
+        }
+        long slot = in_list_slot(list, value);
+        if (list->slots[slot] == 0) {
+            if (list->count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                list->values = realloc(list->values, capacity * sizeof(char*));
+            }
+            list->values[list->count] = strdup(value);
+            list->slots[slot] = ++list->count;
+        }
+        while (*p == ' ') p++;
+    }
+    return list;
+}
+
+bool in_list_contains(const InList* list, const char* value) {
+    return list->slots[in_list_slot(list, value)] != 0;
+}
+
+void in_list_free(InList* list) {
+    if (!list) return;
+    for (int i = 0; i < list->count; i++) free(list->values[i]);
+    free(list->values);
+    free(list->slots);
+    free(list);
+}
+
+void free_where_conditions(WhereCondition* conditions, int condition_count) {
+    if (!conditions) return;
+    for (int i = 0; i < condition_count; i++) in_list_free(conditions[i].in_list);
+    free(conditions);
+}
+
+static FieldType condition_field_type(const WhereCondition* condition) {
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, condition->field_name) == 0) return current_table.fields[i].type;
+    }
+    return FIELD_TEXT;
+}
+
+WhereCondition* parse_where_conditions(const char* where_clause, int* condition_count) {
+    WhereCondition* conditions = malloc(10 * sizeof(WhereCondition));
+    *condition_count = 0;
+    
+    char clause_copy[MAX_QUERY_LENGTH];
+    strcpy(clause_copy, where_clause);
+    
+    char* token = strtok(clause_copy, " ");
+    int state = 0;
+    
+    WhereCondition current_condition;
+    memset(&current_condition, 0, sizeof(WhereCondition));
+    
+    while (token != NULL && *condition_count < 10) {
+        if (state == 0 && strcasecmp(token, "NOT") == 0) {
+            current_condition.negated = !current_condition.negated;
+        }
+        else if (state == 0) {
+            strcpy(current_condition.field_name, token);
+            state = 1;
+        }
+        else if (state == 1) {
+            strcpy(current_condition.operator, token);
+            state = 2;
+        }
+        else if (state == 2 && strcasecmp(current_condition.operator, "IN") == 0) {
+            // The list runs until a closing bracket outside quotes
+            char list_text[MAX_QUERY_LENGTH] = {0};
+            bool closed = false;
+            while (token != NULL) {
+                if (list_text[0]) strcat(list_text, " ");
+                strcat(list_text, token);
+                bool quoted = false;
+                for (char* p = list_text; *p; p++) {
+                    if (*p == '\'') quoted = !quoted;
+                    else if (*p == ')' && !quoted) closed = true;
+                }
+                if (closed) break;
+                token = strtok(NULL, " ");
+            }
+            
+            current_condition.in_list = in_list_parse(list_text, condition_field_type(&current_condition));
+            conditions[(*condition_count)++] = current_condition;
+            memset(&current_condition, 0, sizeof(WhereCondition));
+            state = 3;
+            if (token == NULL) break;
+        }
+        else if (state == 2 || state == 5) {
+            char value[100] = {0};
+            if (token[0] == '\'') {
+                strcpy(value, token + 1);
+                while (token != NULL && value[strlen(value)-1] != '\'') {
+                    token = strtok(NULL, " ");
+                    if (token) {
+                        strcat(value, " ");
+                        strcat(value, token);
+                    }
+                }
+                if (value[strlen(value)-1] == '\'') {
+                    value[strlen(value)-1] = '\0';
+                }
+            } else {
+                strcpy(value, token);
+            }
+            // Int literals take the form compare_values(), the index and the
+            // zone map all see, so 007 matches a stored 7
+            if (condition_field_type(&current_condition) == FIELD_INT &&
+                strcasecmp(current_condition.operator, "LIKE") != 0) {
+                snprintf(value, sizeof(value), "%ld", atol(value));
+            }
+            
+            // BETWEEN low AND high keeps reading after the first value
+            if (state == 2 && strcasecmp(current_condition.operator, "BETWEEN") == 0) {
+                strcpy(current_condition.value, value);
+                state = 4;
+            } else {
+                strcpy(state == 5 ? current_condition.value2 : current_condition.value, value);
+                conditions[(*condition_count)++] = current_condition;
+                memset(&current_condition, 0, sizeof(WhereCondition));
+                state = 3;
+            }
+            if (token == NULL) break;
+        }
+        else if (state == 4) {
+            if (strcasecmp(token, "AND") == 0) state = 5;
+        }
+        else if (state == 3) {
+            if (strcasecmp(token, "AND") == 0) {
+                current_condition.is_and = true;
+            } else if (strcasecmp(token, "OR") == 0) {
+                current_condition.is_and = false;
+            }
+            state = 0;
+        }
+        
+        token = strtok(NULL, " ");
+    }
+    
+    return conditions;
+}
+
+bool check_single_condition(char* record, WhereCondition* condition) {
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, condition->field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    
+    if (field_index == -1) return false;
+    
+    int offset = 0;
+    for (int i = 0; i < field_index; i++) {
+        offset += current_table.fields[i].size;
+    }
+    
+    Field field = current_table.fields[field_index];
+    char field_value[256] = {0};
+    
+    switch (field.type) {
+        case FIELD_INT: {
+            int val;
+            memcpy(&val, record + offset, sizeof(int));
+            snprintf(field_value, sizeof(field_value), "%d", val);
+            break;
+        }
+        case FIELD_TEXT:
+            strncpy(field_value, record + offset, field.size);
+            field_value[field.size] = '\0';
+            break;
+        case FIELD_BOOL: {
+            bool val;
+            memcpy(&val, record + offset, sizeof(bool));
+            strcpy(field_value, val ? "true" : "false");
+            break;
+        }
+    }
+    
+    return condition_matches_value(condition, field_value, field.type);
+}
+
+// Evaluates one condition against a formatted field value or index key
+bool condition_matches_value(const WhereCondition* condition, const char* value, FieldType type) {
+    bool matches;
+    if (strcasecmp(condition->operator, "IN") == 0) {
+        matches = condition->in_list && in_list_contains(condition->in_list, value);
+    } else if (strcasecmp(condition->operator, "BETWEEN") == 0) {
+        matches = compare_values(value, ">=", condition->value, type) &&
+                  compare_values(value, "<=", condition->value2, type);
+    } else {
+        matches = compare_values(value, condition->operator, condition->value, type);
+    }
+    return condition->negated ? !matches : matches;
+}
+
+bool check_complex_conditions(char* record, WhereCondition* conditions, int condition_count) {
+    if (condition_count == 0) return true;
+    
+    bool result = check_single_condition(record, &conditions[0]);
+    
+    for (int i = 1; i < condition_count; i++) {
+        bool current_result = check_single_condition(record, &conditions[i]);
+        
+        if (conditions[i].is_and) {
+            result = result && current_result;
+        } else {
+            result = result || current_result;
+        }
+    }
+    
+    return result;
+}
+
+void select_where(const char* field_name, const char* operator, const char* value) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    
+    if (field_index == -1) {
+        printf("Field '%s' not found\n", field_name);
+        return;
+    }
+    
+    Field field = current_table.fields[field_index];
+    
+    char clean_value[100];
+    strcpy(clean_value, value);
+    if (clean_value[0] == '\'' && clean_value[strlen(clean_value)-1] == '\'') {
+        memmove(clean_value, clean_value + 1, strlen(clean_value) - 2);
+        clean_value[strlen(clean_value) - 2] = '\0';
+    }
+    
+    TableScan scan;
+    long row;
+    char* record;
+    int count = 0;
+    
+    table_scan_begin(&scan, NULL, 0);
+    while (table_scan_next(&scan, &row, &record)) {
+        int offset = 0;
+        for (int i = 0; i < field_index; i++) {
+            offset += current_table.fields[i].size;
+        }
+        
+        char field_value[256] = {0};
         
         switch (field.type) {
             case FIELD_INT: {
-                int value = atoi(token);
-                memcpy(record + offset, &value, sizeof(int));
+                int val;
+                memcpy(&val, record + offset, sizeof(int));
+                snprintf(field_value, sizeof(field_value), "%d", val);
                 break;
             }
             case FIELD_TEXT:
-                strncpy(record + offset, token, field.size);
+                strncpy(field_value, record + offset, field.size);
+                field_value[field.size] = '\0';
                 break;
             case FIELD_BOOL: {
-                bool value = (strcasecmp(token, "true") == 0 || strcmp(token, "1") == 0);
-                memcpy(record + offset, &value, sizeof(bool));
+                bool val;
+                memcpy(&val, record + offset, sizeof(bool));
+                strcpy(field_value, val ? "true" : "false");
                 break;
             }
         }
-        offset += field.size;
-        token = strtok(NULL, ",");
+        
+        if (compare_values(field_value, operator, clean_value, field.type)) {
+            int print_offset = 0;
+            for (int i = 0; i < current_table.field_count; i++) {
+                Field f = current_table.fields[i];
+                
+                switch (f.type) {
+                    case FIELD_INT: {
+                        int val;
+                        memcpy(&val, record + print_offset, sizeof(int));
+                        printf("%s: %d", f.name, val);
+                        break;
+                    }
+                    case FIELD_TEXT: {
+                        char text[f.size + 1];
+                        strncpy(text, record + print_offset, f.size);
+                        text[f.size] = '\0';
+                        printf("%s: '%s'", f.name, text);
+                        break;
+                    }
+                    case FIELD_BOOL: {
+                        bool val;
+                        memcpy(&val, record + print_offset, sizeof(bool));
+                        printf("%s: %s", f.name, val ? "true" : "false");
+                        break;
+                    }
+                }
+                print_offset += f.size;
+                if (i < current_table.field_count - 1) printf(" | ");
+            }
+            printf("\n");
+            count++;
+        }
+    }
+    table_scan_end(&scan);
+    
+    printf("%d rows returned\n", count);
+}
+
+// Ordered output
+static int order_offset;
+static Field order_field;
+static bool order_descending;
+
+// Compares two sort entries by the ORDER BY field, then by row position
+static int compare_order_entries(const void* a, const void* b) {
+    const char* left = (const char*)a + sizeof(long) + order_offset;
+    const char* right = (const char*)b + sizeof(long) + order_offset;
+    int cmp = 0;
+    
+    switch (order_field.type) {
+        case FIELD_INT: {
+            int x, y;
+            memcpy(&x, left, sizeof(int));
+            memcpy(&y, right, sizeof(int));
+            cmp = (x > y) - (x < y);
+            break;
+        }
+        case FIELD_TEXT:
+            cmp = strncmp(left, right, order_field.size);
+            break;
+        case FIELD_BOOL: {
+            bool x, y;
+            memcpy(&x, left, sizeof(bool));
+            memcpy(&y, right, sizeof(bool));
+            cmp = (int)x - (int)y;
+            break;
+        }
+    }
+    if (order_descending) cmp = -cmp;
+    if (cmp != 0) return cmp;
+    
+    long x, y;
+    memcpy(&x, a, sizeof(long));
+    memcpy(&y, b, sizeof(long));
+    return (x > y) - (x < y);
+}
+
+static int compare_order_pointers(const void* a, const void* b) {
+    return compare_order_entries(*(char* const*)a, *(char* const*)b);
+}
+
+// Binary heap of entry pointers. With direction 1 the root is the entry
+// that sorts last (top-K), with -1 the one that sorts first (merge).
+static void order_heap_sift_down(char** heap, long count, long i, int direction) {
+    while (true) {
+        long best = i, left = 2 * i + 1, right = left + 1;
+        if (left < count && compare_order_entries(heap[left], heap[best]) * direction > 0) best = left;
+        if (right < count && compare_order_entries(heap[right], heap[best]) * direction > 0) best = right;
+        if (best == i) return;
+        char* swap = heap[i];
+        heap[i] = heap[best];
+        heap[best] = swap;
+        i = best;
+    }
+}
+
+static void order_heap_sift_up(char** heap, long i, int direction) {
+    while (i > 0) {
+        long parent = (i - 1) / 2;
+        if (compare_order_entries(heap[i], heap[parent]) * direction <= 0) return;
+        char* swap = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = swap;
+        i = parent;
+    }
+}
+
+static bool order_spill_run(OrderSort* sort) {
+    if (sort->count == 0) return true;
+    if (!sort->spill) sort->spill = tmpfile();
+    SortRun* runs = realloc(sort->runs, (sort->run_count + 1) * sizeof(SortRun));
+    if (!sort->spill || !runs) {
+        printf("Error creating ORDER BY sort file\n");
+        return false;
+    }
+    sort->runs = runs;
+    qsort(sort->buffer, sort->count, sort->entry_size, compare_order_entries);
+    
+    fseek(sort->spill, 0, SEEK_END);
+    SortRun run = {0};
+    run.next = ftell(sort->spill);
+    if (fwrite(sort->buffer, sort->entry_size, sort->count, sort->spill) != (size_t)sort->count) {
+        printf("Error writing ORDER BY sort file\n");
+        return false;
+    }
+    run.end = run.next + sort->count * sort->entry_size;
+    
+    sort->runs[sort->run_count++] = run;
+    sort->count = 0;
+    return true;
+}
+
+// Adds a matching row: bounded sorts keep the best K rows in a heap,
+// unbounded ones fill the buffer and spill it as a sorted run when full.
+// False when a run cannot be spilled.
+static bool order_sort_add(OrderSort* sort, long position, const char* record) {
+    char* entry;
+    if (sort->bounded && sort->count == sort->capacity) {
+        if (sort->capacity == 0) return true;
+        char candidate[sizeof(long) + MAX_RECORD_SIZE];
+        memcpy(candidate, &position, sizeof(long));
+        memcpy(candidate + sizeof(long), record, current_table.record_size);
+        if (compare_order_entries(candidate, sort->heap[0]) >= 0) return true;
+        memcpy(sort->heap[0], candidate, sort->entry_size);
+        order_heap_sift_down(sort->heap, sort->count, 0, 1);
+        return true;
+    }
+    if (!sort->bounded && sort->count == sort->capacity && !order_spill_run(sort)) return false;
+    
+    entry = sort->buffer + sort->count * sort->entry_size;
+    memcpy(entry, &position, sizeof(long));
+    memcpy(entry + sizeof(long), record, current_table.record_size);
+    if (sort->bounded) {
+        sort->heap[sort->count] = entry;
+        order_heap_sift_up(sort->heap, sort->count, 1);
+    }
+    sort->count++;
+    return true;
+}
+
+// Refills a run's block from the spill file; false once the run is drained
+static bool order_run_next(OrderSort* sort, SortRun* run) {
+    if (run->used < run->loaded) return true;
+    if (run->next >= run->end) return false;
+    
+    long entries = (run->end - run->next) / sort->entry_size;
+    if (entries > ORDER_MERGE_BLOCK) entries = ORDER_MERGE_BLOCK;
+    if (pread(fileno(sort->spill), run->block, entries * sort->entry_size, run->next) !=
+        (ssize_t)(entries * sort->entry_size)) {
+        return false;
+    }
+    run->next += entries * sort->entry_size;
+    run->loaded = entries;
+    run->used = 0;
+    return true;
+}
+
+static long order_sort_emit(OrderSort* sort, const int* selected_columns, int selected_count, RowLimit* limit) {
+    long count = 0;
+    
+    if (sort->run_count == 0) {
+        if (sort->bounded) {
+            qsort(sort->heap, sort->count, sizeof(char*), compare_order_pointers);
+        } else {
+            qsort(sort->buffer, sort->count, sort->entry_size, compare_order_entries);
+        }
+        for (long i = 0; i < sort->count && !row_limit_done(limit); i++) {
+            char* entry = sort->bounded ? sort->heap[i] : sort->buffer + i * sort->entry_size;
+            if (row_limit_take(limit)) {
+                print_selected_columns(entry + sizeof(long), selected_columns, selected_count);
+                count++;
+            }
+        }
+        return count;
+    }
+    
+    // k-way merge of the spilled runs through a min-heap of run heads
+    if (!order_spill_run(sort)) return 0;
+    fflush(sort->spill);
+    char** heads = malloc(sort->run_count * sizeof(char*));
+    long head_count = 0;
+    for (int r = 0; r < sort->run_count; r++) {
+        sort->runs[r].block = malloc(ORDER_MERGE_BLOCK * sort->entry_size);
+        if (!heads || !sort->runs[r].block) {
+            printf("Out of memory for ORDER BY\n");
+            head_count = 0;
+            break;
+        }
+        if (order_run_next(sort, &sort->runs[r])) {
+            heads[head_count] = sort->runs[r].block;
+            order_heap_sift_up(heads, head_count++, -1);
+        }
+    }
+    
+    while (head_count > 0 && !row_limit_done(limit)) {
+        char* entry = heads[0];
+        if (row_limit_take(limit)) {
+            print_selected_columns(entry + sizeof(long), selected_columns, selected_count);
+            count++;
+        }
+        
+        int r = 0;
+        while (entry < sort->runs[r].block || entry >= sort->runs[r].block + ORDER_MERGE_BLOCK * sort->entry_size) r++;
+        SortRun* run = &sort->runs[r];
+        run->used++;
+        if (order_run_next(sort, run)) {
+            heads[0] = run->block + run->used * sort->entry_size;
+        } else {
+            heads[0] = heads[--head_count];
+        }
+        order_heap_sift_down(heads, head_count, 0, -1);
+    }
+    
+    for (int r = 0; r < sort->run_count; r++) free(sort->runs[r].block);
+    free(heads);
+    return count;
+}
+
+typedef struct {
+    WhereCondition* conditions;
+    int condition_count;
+    const int* selected_columns;
+    int selected_count;
+    RowLimit* limit;
+    long count;
+} OrderedWalk;
+
+static bool order_walk_visit(long position, void* context) {
+    OrderedWalk* walk = context;
+    char record[MAX_RECORD_SIZE];
+    
+    if (read_record_at(position, record) &&
+        check_complex_conditions(record, walk->conditions, walk->condition_count) &&
+        row_limit_take(walk->limit)) {
+        print_selected_columns(record, walk->selected_columns, walk->selected_count);
+        walk->count++;
+    }
+    return !row_limit_done(walk->limit);
+}
+
+// ORDER BY: an indexed field streams rows in index order without sorting.
+// Otherwise a LIMIT keeps the top offset+limit rows in a bounded heap and
+// anything else goes through an external merge sort.
+long select_ordered(const int* selected_columns, int selected_count, WhereCondition* conditions,
+                    int condition_count, OrderBy order, RowLimit* limit) {
+    int field_index = -1;
+    order_offset = 0;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, order.field_name) == 0) {
+            field_index = i;
+            break;
+        }
+        order_offset += current_table.fields[i].size;
+    }
+    if (field_index == -1) {
+        printf("Field '%s' not found\n", order.field_name);
+        return 0;
+    }
+    
+    if (row_limit_done(limit)) return 0;
+    if (ordered_index(field_index)) {
+        OrderedWalk walk = { conditions, condition_count, selected_columns, selected_count, limit, 0 };
+        ordered_walk(field_index, order.descending, order_walk_visit, &walk);
+        return walk.count;
+    }
+    
+    order_field = current_table.fields[field_index];
+    order_descending = order.descending;
+    
+    // The heap holds offset+limit entries, so it is used only while they
+    // fit in the sort memory; larger limits fall back to the merge sort
+    OrderSort sort = {0};
+    sort.entry_size = sizeof(long) + current_table.record_size;
+    long memory_entries = ORDER_SORT_MEMORY / (sort.entry_size + (long)sizeof(char*));
+    sort.bounded = limit->limit >= 0 && limit->limit <= memory_entries &&
+                   limit->offset <= memory_entries - limit->limit;
+    sort.capacity = sort.bounded ? limit->limit + limit->offset : ORDER_SORT_MEMORY / sort.entry_size;
+    sort.buffer = malloc((sort.capacity ? sort.capacity : 1) * sort.entry_size);
+    if (sort.bounded) sort.heap = malloc((sort.capacity ? sort.capacity : 1) * sizeof(char*));
+    if (!sort.buffer || (sort.bounded && !sort.heap)) {
+        printf("Out of memory for ORDER BY\n");
+        free(sort.heap);
+        free(sort.buffer);
+        return 0;
+    }
+    
+    PositionList candidates = {0};
+    bool sorted = true;
+    if (plan_index_candidates(conditions, condition_count, &candidates)) {
+        RowFetch fetch;
+        long position;
+        char* row_record;
+        row_fetch_begin(&fetch, &candidates);
+        while (sorted && row_fetch_next(&fetch, &position, &row_record)) {
+            if (check_complex_conditions(row_record, conditions, condition_count)) {
+                sorted = order_sort_add(&sort, position, row_record);
+            }
+        }
+        row_fetch_end(&fetch);
+        free(candidates.items);
+    } else {
+        TableScan scan;
+        long row;
+        char* row_record;
+        table_scan_begin(&scan, conditions, conditions ? condition_count : 0);
+        while (sorted && table_scan_next(&scan, &row, &row_record)) {
+            if (conditions == NULL || check_complex_conditions(row_record, conditions, condition_count)) {
+                sorted = order_sort_add(&sort, row_position(row), row_record);
+            }
+        }
+        table_scan_end(&scan);
+    }
+    
+    long count = sorted ? order_sort_emit(&sort, selected_columns, selected_count, limit) : 0;
+    if (sort.spill) fclose(sort.spill);
+    free(sort.runs);
+    free(sort.heap);
+    free(sort.buffer);
+    return count;
+}
+
+void select_columns(const char* columns, const char* where_clause, OrderBy order, RowLimit limit) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    char cols_copy[MAX_QUERY_LENGTH];
+    strcpy(cols_copy, columns);
+    
+    int selected_columns[MAX_FIELDS];
+    int selected_count = 0;
+    bool select_all = false;
+    
+    if (strcmp(columns, "*") == 0) {
+        select_all = true;
+        selected_count = current_table.field_count;
+        for (int i = 0; i < selected_count; i++) {
+            selected_columns[i] = i;
+        }
+    } else {
+        char* token = strtok(cols_copy, ",");
+        while (token != NULL && selected_count < MAX_FIELDS) {
+            while (*token == ' ') token++;
+            char* end = token + strlen(token) - 1;
+            while (end > token && *end == ' ') *end-- = '\0';
+            
+            for (int i = 0; i < current_table.field_count; i++) {
+                if (strcmp(current_table.fields[i].name, token) == 0) {
+                    selected_columns[selected_count++] = i;
+                    break;
+                }
+            }
+            
+            token = strtok(NULL, ",");
+        }
     }
     
-    fseek(current_table.data_file, 0, SEEK_END);
-    long position = ftell(current_table.data_file);
-    fwrite(record, current_table.record_size, 1, current_table.data_file);
-    fflush(current_table.data_file);
+    int condition_count = 0;
+    WhereCondition* conditions = NULL;
     
-    offset = 0;
-    for (int i = 0; i < current_table.field_count; i++) {
-        Field field = current_table.fields[i];
-        char key[256] = {0};
-        
-        switch (field.type) {
-            case FIELD_INT: {
-                int value;
-                memcpy(&value, record + offset, sizeof(int));
-                snprintf(key, sizeof(key), "%d", value);
-                break;
+    if (where_clause != NULL && strlen(where_clause) > 0) {
+        conditions = parse_where_conditions(where_clause, &condition_count);
+    }
+    
+    int count = 0;
+    PositionList candidates = {0};
+    
+    if (order.field_name[0]) {
+        count = select_ordered(selected_columns, selected_count, conditions, condition_count, order, &limit);
+    } else if (plan_index_candidates(conditions, condition_count, &candidates)) {
+        RowFetch fetch;
+        long position;
+        char* row_record;
+        row_fetch_begin(&fetch, &candidates);
+        while (!row_limit_done(&limit) && row_fetch_next(&fetch, &position, &row_record)) {
+            if (check_complex_conditions(row_record, conditions, condition_count) && row_limit_take(&limit)) {
+                print_selected_columns(row_record, selected_columns, selected_count);
+                count++;
             }
-            case FIELD_TEXT:
-                strncpy(key, record + offset, field.size);
-                key[field.size] = '\0';
-                break;
-            case FIELD_BOOL: {
-                bool value;
-                memcpy(&value, record + offset, sizeof(bool));
-                strcpy(key, value ? "true" : "false");
-                break;
+        }
+        row_fetch_end(&fetch);
+        free(candidates.items);
+    } else {
+        // Stops reading as soon as the limit is filled
+        TableScan scan;
+        long row;
+        char* row_record;
+        table_scan_begin(&scan, conditions, conditions ? condition_count : 0);
+        while (!row_limit_done(&limit) && table_scan_next(&scan, &row, &row_record)) {
+            if ((conditions == NULL || check_complex_conditions(row_record, conditions, condition_count)) &&
+                row_limit_take(&limit)) {
+                print_selected_columns(row_record, selected_columns, selected_count);
+                count++;
             }
         }
+        table_scan_end(&scan);
+    }
+    
+    printf("%d rows returned\n", count);
+    
+    if (conditions != NULL) {
+        free_where_conditions(conditions, condition_count);
+    }
+}
+
+// Translates one condition into an index key range. exact is cleared when
+// the range is only a superset of the matches (LIKE with inner wildcards).
+bool condition_key_range(const WhereCondition* condition, FieldType type, KeyRange* range, bool* exact) {
+    const char* op = condition->operator;
+    memset(range, 0, sizeof(KeyRange));
+    *exact = true;
+    if (condition->negated) return false;
+    
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        snprintf(range->lower, sizeof(range->lower), "%s", condition->value);
+        snprintf(range->upper, sizeof(range->upper), "%s", condition->value);
+        range->has_lower = range->has_upper = true;
+        range->lower_inclusive = range->upper_inclusive = true;
+        return true;
+    }
+    
+    // Bool keys only support equality in compare_values()
+    if (type == FIELD_BOOL) return false;
+    
+    if (strcmp(op, ">") == 0 || strcmp(op, ">=") == 0) {
+        snprintf(range->lower, sizeof(range->lower), "%s", condition->value);
+        range->has_lower = true;
+        range->lower_inclusive = op[1] == '=';
+        return true;
+    }
+    if (strcmp(op, "<") == 0 || strcmp(op, "<=") == 0) {
+        snprintf(range->upper, sizeof(range->upper), "%s", condition->value);
+        range->has_upper = true;
+        range->upper_inclusive = op[1] == '=';
+        return true;
+    }
+    if (strcasecmp(op, "BETWEEN") == 0) {
+        snprintf(range->lower, sizeof(range->lower), "%s", condition->value);
+        snprintf(range->upper, sizeof(range->upper), "%s", condition->value2);
+        range->has_lower = range->has_upper = true;
+        range->lower_inclusive = range->upper_inclusive = true;
+        return true;
+    }
+    
+    // LIKE 'abc%' covers the keys from "abc" up to, not including, "abd"
+    if (strcasecmp(op, "LIKE") == 0 && type == FIELD_TEXT) {
+        int prefix = strcspn(condition->value, "%_");
+        if (prefix == 0) return false;
+        snprintf(range->lower, sizeof(range->lower), "%.*s", prefix, condition->value);
+        range->has_lower = true;
+        range->lower_inclusive = true;
         
-        current_table.indexes[i] = insertAVL(current_table.indexes[i], key, position);
-        offset += field.size;
+        // Without wildcards LIKE is plain equality
+        if (condition->value[prefix] == '\0') {
+            memcpy(range->upper, range->lower, sizeof(range->upper));
+            range->has_upper = true;
+            range->upper_inclusive = true;
+            return true;
+        }
+        *exact = strcmp(condition->value + prefix, "%") == 0;
+        
+        memcpy(range->upper, range->lower, sizeof(range->upper));
+        int last = prefix - 1;
+        while (last >= 0 && (unsigned char)range->upper[last] == 0xFF) range->upper[last--] = '\0';
+        if (last >= 0) {
+            range->upper[last]++;
+            range->has_upper = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+void key_range_intersect(KeyRange* range, const KeyRange* other, FieldType type) {
+    if (other->has_lower) {
+        int cmp = range->has_lower ? compare_keys(other->lower, range->lower, type) : 1;
+        if (cmp > 0 || (cmp == 0 && !other->lower_inclusive)) {
+            memcpy(range->lower, other->lower, sizeof(range->lower));
+            range->lower_inclusive = other->lower_inclusive;
+            range->has_lower = true;
+        }
+    }
+    if (other->has_upper) {
+        int cmp = range->has_upper ? compare_keys(other->upper, range->upper, type) : -1;
+        if (cmp < 0 || (cmp == 0 && !other->upper_inclusive)) {
+            memcpy(range->upper, other->upper, sizeof(range->upper));
+            range->upper_inclusive = other->upper_inclusive;
+            range->has_upper = true;
+        }
+    }
+}
+
+// Index-only COUNT for AND-ed conditions on a single field: the bounds are
+// turned into a key range and counted with subtree sizes in O(log n)
+bool index_count_conditions(WhereCondition* conditions, int condition_count, long* result) {
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, conditions[0].field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    // Index entries of deleted rows stay until VACUUM, so they cannot be
+    // counted blindly, nor can the entries missing for damaged pages
+    if (field_index == -1 || !ordered_index(field_index) || has_tombstones() ||
+        current_table.segments->damaged_pages > 0) {
+        return false;
     }
     
-    printf("1 row inserted\n");
+    FieldType type = current_table.fields[field_index].type;
+    
+    // A lone IN sums the point counts of its distinct values
+    if (condition_count == 1 && conditions[0].in_list && !conditions[0].negated) {
+        long count = 0;
+        KeyRange point = {0};
+        point.has_lower = point.has_upper = point.lower_inclusive = point.upper_inclusive = true;
+        for (int v = 0; v < conditions[0].in_list->count; v++) {
+            snprintf(point.lower, sizeof(point.lower), "%s", conditions[0].in_list->values[v]);
+            strcpy(point.upper, point.lower);
+            count += ordered_count_range(field_index, &point);
+        }
+        *result = count;
+        return true;
+    }
+    
+    // A lone != is the complement of the equality range
+    if (condition_count == 1 && strcmp(conditions[0].operator, "!=") == 0 && !conditions[0].negated) {
+        WhereCondition equal = conditions[0];
+        strcpy(equal.operator, "=");
+        KeyRange range;
+        bool exact;
+        condition_key_range(&equal, type, &range, &exact);
+        *result = ordered_size(field_index) - ordered_count_range(field_index, &range);
+        return true;
+    }
+    
+    KeyRange range = {0};
+    for (int c = 0; c < condition_count; c++) {
+        WhereCondition* condition = &conditions[c];
+        if ((c > 0 && !condition->is_and) || strcmp(condition->field_name, conditions[0].field_name) != 0) {
+            return false;
+        }
+        
+        KeyRange bounds;
+        bool exact;
+        if (!condition_key_range(condition, type, &bounds, &exact) || !exact) return false;
+        key_range_intersect(&range, &bounds, type);
+    }
+    
+    *result = ordered_count_range(field_index, &range);
+    return true;
 }
 
-void select_all() {
+void select_count(const char* where_clause) {
     if (!table_loaded) {
         printf("No table selected\n");
         return;
     }
     
-    fseek(current_table.data_file, sizeof(Table), SEEK_SET);
-    char record[MAX_RECORD_SIZE];
+    int condition_count = 0;
+    WhereCondition* conditions = NULL;
+    
+    if (where_clause != NULL && strlen(where_clause) > 0) {
+        conditions = parse_where_conditions(where_clause, &condition_count);
+    }
+    
+    // Unfiltered counts come from the header, simple filters from the index
+    long indexed_count;
+    if (conditions == NULL || condition_count == 0) {
+        printf("COUNT: %ld\n", current_table.row_count);
+        free_where_conditions(conditions, condition_count);
+        return;
+    }
+    Roaring matches;
+    if (bitmap_evaluate(conditions, condition_count, &matches)) {
+        printf("COUNT: %ld\n", roaring_cardinality(&matches));
+        roaring_free(&matches);
+        free_where_conditions(conditions, condition_count);
+        return;
+    }
+    if (index_count_conditions(conditions, condition_count, &indexed_count)) {
+        printf("COUNT: %ld\n", indexed_count);
+        free_where_conditions(conditions, condition_count);
+        return;
+    }
+    
     int count = 0;
+    PositionList candidates = {0};
     
-    while (fread(record, current_table.record_size, 1, current_table.data_file)) {
+    if (plan_index_candidates(conditions, condition_count, &candidates)) {
+        RowFetch fetch;
+        long position;
+        char* row_record;
+        row_fetch_begin(&fetch, &candidates);
+        while (row_fetch_next(&fetch, &position, &row_record)) {
+            if (check_complex_conditions(row_record, conditions, condition_count)) count++;
+        }
+        row_fetch_end(&fetch);
+        free(candidates.items);
+    } else {
+        TableScan scan;
+        long row;
+        char* row_record;
+        table_scan_begin(&scan, conditions, condition_count);
+        while (table_scan_next(&scan, &row, &row_record)) {
+            if (check_complex_conditions(row_record, conditions, condition_count)) count++;
+        }
+        table_scan_end(&scan);
+    }
+    
+    printf("COUNT: %d\n", count);
+    
+    if (conditions != NULL) {
+        free_where_conditions(conditions, condition_count);
+    }
+}
+
+// Aggregation functions
+static uint64_t group_key_hash(const unsigned char* key, int size) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (int i = 0; i < size; i++) {
+        hash = (hash ^ key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void group_table_init(GroupTable* groups, const AggregatePlan* plan, long capacity) {
+    groups->capacity = capacity;
+    groups->used = 0;
+    groups->keys = malloc(capacity * (plan->key_size ? plan->key_size : 1));
+    groups->counts = calloc(capacity, sizeof(long));
+    groups->states = malloc(capacity * (plan->aggregate_count ? plan->aggregate_count : 1) * sizeof(AggregateState));
+}
+
+static void group_table_free(GroupTable* groups) {
+    free(groups->keys);
+    free(groups->counts);
+    free(groups->states);
+}
+
+static long group_table_slot(GroupTable* groups, const AggregatePlan* plan, const unsigned char* key) {
+    long mask = groups->capacity - 1;
+    long slot = group_key_hash(key, plan->key_size) & mask;
+    while (groups->counts[slot] != 0 &&
+           memcmp(groups->keys + slot * plan->key_size, key, plan->key_size) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Finds or creates the group; new groups start with zero rows
+static long group_table_find(GroupTable* groups, const AggregatePlan* plan, const unsigned char* key) {
+    if ((groups->used + 1) * 10 > groups->capacity * 7) {
+        GroupTable grown;
+        group_table_init(&grown, plan, groups->capacity * 2);
+        for (long i = 0; i < groups->capacity; i++) {
+            if (groups->counts[i] == 0) continue;
+            long slot = group_table_slot(&grown, plan, groups->keys + i * plan->key_size);
+            memcpy(grown.keys + slot * plan->key_size, groups->keys + i * plan->key_size, plan->key_size);
+            memcpy(grown.states + slot * plan->aggregate_count, groups->states + i * plan->aggregate_count,
+                   plan->aggregate_count * sizeof(AggregateState));
+            grown.counts[slot] = groups->counts[i];
+        }
+        grown.used = groups->used;
+        group_table_free(groups);
+        *groups = grown;
+    }
+    
+    long slot = group_table_slot(groups, plan, key);
+    if (groups->counts[slot] == 0) {
+        memcpy(groups->keys + slot * plan->key_size, key, plan->key_size);
+        for (int i = 0; i < plan->aggregate_count; i++) {
+            AggregateState* state = &groups->states[slot * plan->aggregate_count + i];
+            state->sum = 0;
+            state->min = INT32_MAX;
+            state->max = INT32_MIN;
+        }
+        groups->used++;
+    }
+    return slot;
+}
+
+static int aggregate_value(const char* record, const AggregateColumn* column) {
+    if (current_table.fields[column->field_index].type == FIELD_BOOL) {
+        bool value;
+        memcpy(&value, record + column->offset, sizeof(bool));
+        return value ? 1 : 0;
+    }
+    int value;
+    memcpy(&value, record + column->offset, sizeof(int));
+    return value;
+}
+
+static void group_table_accumulate(GroupTable* groups, const AggregatePlan* plan, const char* record) {
+    unsigned char key[MAX_RECORD_SIZE];
+    int key_offset = 0;
+    for (int i = 0; i < plan->group_count; i++) {
+        int size = current_table.fields[plan->group_fields[i]].size;
+        memcpy(key + key_offset, record + plan->group_offsets[i], size);
+        key_offset += size;
+    }
+    
+    long slot = group_table_find(groups, plan, key);
+    groups->counts[slot]++;
+    for (int i = 0; i < plan->aggregate_count; i++) {
+        const AggregateColumn* column = &plan->aggregates[i];
+        if (column->field_index < 0) continue;
+        AggregateState* state = &groups->states[slot * plan->aggregate_count + i];
+        int value = aggregate_value(record, column);
+        state->sum += value;
+        if (value < state->min) state->min = value;
+        if (value > state->max) state->max = value;
+    }
+}
+
+typedef struct {
+    long first_row;
+    long last_row;
+    WhereCondition* conditions;
+    int condition_count;
+    const AggregatePlan* plan;
+    GroupTable groups;
+} AggregateWorker;
+
+// Each worker reads its own row range with pread and keeps partial aggregates.
+// Chunks are whole pages, so every pread starts on a page boundary.
+static void* aggregate_worker(void* arg) {
+    AggregateWorker* worker = arg;
+    int record_size = current_table.record_size;
+    long chunk_rows = AGGREGATE_CHUNK_ROWS / current_table.page_records * current_table.page_records;
+    if (chunk_rows == 0) chunk_rows = current_table.page_records;
+    char* buffer = malloc((size_t)chunk_rows * record_size);
+    
+    for (long row = worker->first_row; row < worker->last_row; ) {
+        long rows = worker->last_row - row < chunk_rows ? worker->last_row - row : chunk_rows;
+        ssize_t bytes = table_pread(buffer, rows * record_size, row_position(row));
+        long read_rows = bytes > 0 ? bytes / record_size : 0;
+        
+        for (long i = 0; i < read_rows; i++) {
+            char* record = buffer + i * record_size;
+            if (row_deleted(row + i)) continue;
+            if (worker->conditions && !check_complex_conditions(record, worker->conditions, worker->condition_count)) {
+                continue;
+            }
+            group_table_accumulate(&worker->groups, worker->plan, record);
+        }
+        
+        // A short read stops at a damaged page, which is reported and skipped
+        if (read_rows < rows) {
+            row = ((row + read_rows) / current_table.page_records + 1) * current_table.page_records;
+        } else {
+            row += rows;
+        }
+    }
+    
+    free(buffer);
+    return NULL;
+}
+
+static bool parse_aggregate_function(const char* token, AggregateColumn* column) {
+    static const char* names[] = { "COUNT", "SUM", "AVG", "MIN", "MAX" };
+    char name[10], argument[MAX_FIELD_NAME];
+    if (sscanf(token, "%9[A-Za-z] ( %29[^) ] )", name, argument) != 2) return false;
+    
+    for (int f = 0; f <= AGG_MAX; f++) {
+        if (strcasecmp(name, names[f]) != 0) continue;
+        column->function = f;
+        column->field_index = -1;
+        column->offset = 0;
+        if (strcmp(argument, "*") == 0) return f == AGG_COUNT;
+        
         int offset = 0;
         for (int i = 0; i < current_table.field_count; i++) {
-            Field field = current_table.fields[i];
-            
-            switch (field.type) {
-                case FIELD_INT: {
-                    int value;
-                    memcpy(&value, record + offset, sizeof(int));
-                    printf("%s: %d", field.name, value);
-                    break;
+            if (strcmp(current_table.fields[i].name, argument) == 0) {
+                if (current_table.fields[i].type == FIELD_TEXT) {
+                    printf("Aggregate %s needs an int or bool field\n", token);
+                    return false;
                 }
-                case FIELD_TEXT: {
-                    char text[field.size + 1];
-                    strncpy(text, record + offset, field.size);
-                    text[field.size] = '\0';
-                    printf("%s: '%s'", field.name, text);
-                    break;
+                column->field_index = i;
+                column->offset = offset;
+                return true;
+            }
+            offset += current_table.fields[i].size;
+        }
+        printf("Field '%s' not found\n", argument);
+        return false;
+    }
+    return false;
+}
+
+bool parse_aggregate_plan(const char* columns, const char* group_clause, AggregatePlan* plan) {
+    memset(plan, 0, sizeof(AggregatePlan));
+    
+    char group_copy[MAX_QUERY_LENGTH];
+    strcpy(group_copy, group_clause ? group_clause : "");
+    for (char* token = strtok(group_copy, ", "); token; token = strtok(NULL, ", ")) {
+        int offset = 0, field_index = -1;
+        for (int i = 0; i < current_table.field_count; i++) {
+            if (strcmp(current_table.fields[i].name, token) == 0) {
+                field_index = i;
+                break;
+            }
+            offset += current_table.fields[i].size;
+        }
+        if (field_index == -1 || plan->group_count == MAX_FIELDS) {
+            printf("Field '%s' not found\n", token);
+            return false;
+        }
+        plan->group_fields[plan->group_count] = field_index;
+        plan->group_offsets[plan->group_count++] = offset;
+        plan->key_size += current_table.fields[field_index].size;
+    }
+    
+    char cols_copy[MAX_QUERY_LENGTH];
+    strcpy(cols_copy, columns);
+    for (char* token = strtok(cols_copy, ","); token && plan->output_count < MAX_FIELDS; token = strtok(NULL, ",")) {
+        while (*token == ' ') token++;
+        char* end = token + strlen(token) - 1;
+        while (end > token && *end == ' ') *end-- = '\0';
+        
+        if (strchr(token, '(')) {
+            if (!parse_aggregate_function(token, &plan->aggregates[plan->aggregate_count])) {
+                printf("Unknown aggregate: %s\n", token);
+                return false;
+            }
+            plan->output[plan->output_count++] = -(++plan->aggregate_count);
+            continue;
+        }
+        
+        int group = -1;
+        for (int i = 0; i < plan->group_count; i++) {
+            if (strcmp(current_table.fields[plan->group_fields[i]].name, token) == 0) group = i;
+        }
+        if (group == -1) {
+            printf("Column '%s' must appear in GROUP BY\n", token);
+            return false;
+        }
+        plan->output[plan->output_count++] = group;
+    }
+    return plan->output_count > 0;
+}
+
+// Single pass hash aggregation, split by row ranges across threads
+void select_aggregate(const char* columns, const char* where_clause, const char* group_clause, RowLimit limit) {
+    if (!table_loaded) {
+        printf("No table selected\n");
+        return;
+    }
+    
+    AggregatePlan plan;
+    if (!parse_aggregate_plan(columns, group_clause, &plan)) return;
+    
+    int condition_count = 0;
+    WhereCondition* conditions = NULL;
+    if (where_clause != NULL && strlen(where_clause) > 0) {
+        conditions = parse_where_conditions(where_clause, &condition_count);
+    }
+    
+    long first_row = current_table.first_row;
+    long rows = table_row_count() - first_row;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > MAX_AGGREGATE_THREADS) threads = MAX_AGGREGATE_THREADS;
+    if (threads > rows / AGGREGATE_CHUNK_ROWS) threads = rows / AGGREGATE_CHUNK_ROWS;
+    if (threads < 1) threads = 1;
+    
+    fflush(current_table.data_file);
+    AggregateWorker workers[MAX_AGGREGATE_THREADS];
+    pthread_t thread_ids[MAX_AGGREGATE_THREADS];
+    // Workers split on page boundaries so that no page is read by two of them
+    for (long t = 0; t < threads; t++) {
+        long last_row = first_row + rows * (t + 1) / threads;
+        workers[t].first_row = t == 0 ? first_row : workers[t - 1].last_row;
+        workers[t].last_row = t == threads - 1 ? first_row + rows : last_row - last_row % current_table.page_records;
+        if (workers[t].last_row < workers[t].first_row) workers[t].last_row = workers[t].first_row;
+        workers[t].conditions = conditions;
+        workers[t].condition_count = condition_count;
+        workers[t].plan = &plan;
+        group_table_init(&workers[t].groups, &plan, 1024);
+        if (t > 0) pthread_create(&thread_ids[t], NULL, aggregate_worker, &workers[t]);
+    }
+    aggregate_worker(&workers[0]);
+    
+    // Merge partial aggregates into the first worker's table
+    GroupTable* result = &workers[0].groups;
+    for (long t = 1; t < threads; t++) {
+        pthread_join(thread_ids[t], NULL);
+        GroupTable* partial = &workers[t].groups;
+        for (long i = 0; i < partial->capacity; i++) {
+            if (partial->counts[i] == 0) continue;
+            long slot = group_table_find(result, &plan, partial->keys + i * plan.key_size);
+            result->counts[slot] += partial->counts[i];
+            for (int a = 0; a < plan.aggregate_count; a++) {
+                AggregateState* to = &result->states[slot * plan.aggregate_count + a];
+                AggregateState* from = &partial->states[i * plan.aggregate_count + a];
+                to->sum += from->sum;
+                if (from->min < to->min) to->min = from->min;
+                if (from->max > to->max) to->max = from->max;
+            }
+        }
+        group_table_free(partial);
+    }
+    
+    // An aggregate without GROUP BY still returns one row
+    if (plan.group_count == 0 && result->used == 0) {
+        long slot = group_table_find(result, &plan, (const unsigned char*)"");
+        result->counts[slot] = -1;
+    }
+    
+    long groups_returned = 0;
+    for (long i = 0; i < result->capacity && !row_limit_done(&limit); i++) {
+        if (result->counts[i] == 0 || !row_limit_take(&limit)) continue;
+        groups_returned++;
+        long group_rows = result->counts[i] > 0 ? result->counts[i] : 0;
+        const unsigned char* key = result->keys + i * plan.key_size;
+        
+        for (int c = 0; c < plan.output_count; c++) {
+            if (plan.output[c] >= 0) {
+                int group = plan.output[c];
+                Field field = current_table.fields[plan.group_fields[group]];
+                int key_offset = 0;
+                for (int g = 0; g < group; g++) key_offset += current_table.fields[plan.group_fields[g]].size;
+                
+                switch (field.type) {
+                    case FIELD_INT: {
+                        int value;
+                        memcpy(&value, key + key_offset, sizeof(int));
+                        printf("%s: %d", field.name, value);
+                        break;
+                    }
+                    case FIELD_TEXT:
+                        printf("%s: '%.*s'", field.name, (int)strnlen((const char*)key + key_offset, field.size), key + key_offset);
+                        break;
+                    case FIELD_BOOL: {
+                        bool value;
+                        memcpy(&value, key + key_offset, sizeof(bool));
+                        printf("%s: %s", field.name, value ? "true" : "false");
+                        break;
+                    }
                 }
-                case FIELD_BOOL: {
-                    bool value;
-                    memcpy(&value, record + offset, sizeof(bool));
-                    printf("%s: %s", field.name, value ? "true" : "false");
-                    break;
+            } else {
+                int a = -plan.output[c] - 1;
+                AggregateColumn* column = &plan.aggregates[a];
+                AggregateState* state = &result->states[i * plan.aggregate_count + a];
+                const char* argument = column->field_index >= 0 ? current_table.fields[column->field_index].name : "*";
+                
+                switch (column->function) {
+                    case AGG_COUNT: printf("COUNT(%s): %ld", argument, group_rows); break;
+                    case AGG_SUM: printf("SUM(%s): %lld", argument, state->sum); break;
+                    case AGG_AVG:
+                        if (group_rows > 0) printf("AVG(%s): %.2f", argument, (double)state->sum / group_rows);
+                        else printf("AVG(%s): NULL", argument);
+                        break;
+                    case AGG_MIN:
+                        if (group_rows > 0) printf("MIN(%s): %d", argument, state->min);
+                        else printf("MIN(%s): NULL", argument);
+                        break;
+                    case AGG_MAX:
+                        if (group_rows > 0) printf("MAX(%s): %d", argument, state->max);
+                        else printf("MAX(%s): NULL", argument);
+                        break;
                 }
             }
-            offset += field.size;
-            if (i < current_table.field_count - 1) printf(" | ");
+            if (c < plan.output_count - 1) printf(" | ");
         }
         printf("\n");
-        count++;
     }
+    printf("%ld groups returned\n", groups_returned);
     
-    printf("%d rows returned\n", count);
+    group_table_free(result);
+    if (conditions != NULL) {
+        free_where_conditions(conditions, condition_count);
+    }
 }
 
-void select_field(const char* field_name) {
-    if (!table_loaded) {
-        printf("No table selected\n");
-        return;
-    }
-    
-    int field_index = -1;
+void print_record(const char* record) {
+    int offset = 0;
     for (int i = 0; i < current_table.field_count; i++) {
-        if (strcmp(current_table.fields[i].name, field_name) == 0) {
-            field_index = i;
-            break;
-        }
-    }
-    
-    if (field_index == -1) {
-        printf("Field '%s' not found\n", field_name);
-        return;
-    }
-    
-    fseek(current_table.data_file, sizeof(Table), SEEK_SET);
-    char record[MAX_RECORD_SIZE];
-    int count = 0;
-    
-    while (fread(record, current_table.record_size, 1, current_table.data_file)) {
-        int offset = 0;
-        for (int i = 0; i < field_index; i++) {
-            offset += current_table.fields[i].size;
-        }
-        
-        Field field = current_table.fields[field_index];
+        Field field = current_table.fields[i];
         
         switch (field.type) {
             case FIELD_INT: {
                 int value;
                 memcpy(&value, record + offset, sizeof(int));
-                printf("%s: %d\n", field.name, value);
+                printf("%s: %d", field.name, value);
                 break;
             }
             case FIELD_TEXT: {
                 char text[field.size + 1];
                 strncpy(text, record + offset, field.size);
                 text[field.size] = '\0';
-                printf("%s: '%s'\n", field.name, text);
+                printf("%s: '%s'", field.name, text);
                 break;
             }
             case FIELD_BOOL: {
                 bool value;
                 memcpy(&value, record + offset, sizeof(bool));
-                printf("%s: %s\n", field.name, value ? "true" : "false");
+                printf("%s: %s", field.name, value ? "true" : "false");
                 break;
             }
         }
-        count++;
+        offset += field.size;
+        if (i < current_table.field_count - 1) printf(" | ");
     }
-    
-    printf("%d rows returned\n", count);
+    printf("\n");
 }
 
-bool compare_values(const char* field_value, const char* operator, const char* compare_value, FieldType field_type) {
-    if (strcmp(operator, "=") == 0 || strcmp(operator, "==") == 0) {
-        return strcmp(field_value, compare_value) == 0;
-    }
-    else if (strcmp(operator, "!=") == 0) {
-        return strcmp(field_value, compare_value) != 0;
-    }
-    
-    if (field_type == FIELD_INT || field_type == FIELD_BOOL) {
-        int field_val = atoi(field_value);
-        int cmp_val = atoi(compare_value);
+void print_selected_columns(const char* record, const int* selected_columns, int selected_count) {
+    for (int i = 0; i < selected_count; i++) {
+        int field_idx = selected_columns[i];
+        Field field = current_table.fields[field_idx];
+        int offset = 0;
         
-        if (strcmp(operator, ">") == 0) {
-            return field_val > cmp_val;
-        }
-        else if (strcmp(operator, "<") == 0) {
-            return field_val < cmp_val;
-        }
-        else if (strcmp(operator, ">=") == 0) {
-            return field_val >= cmp_val;
-        }
-        else if (strcmp(operator, "<=") == 0) {
-            return field_val <= cmp_val;
-        }
-    }
-    
-    return false;
-}
-
-WhereCondition* parse_where_conditions(const char* where_clause, int* condition_count) {
-    WhereCondition* conditions = malloc(10 * sizeof(WhereCondition));
-    *condition_count = 0;
-    
-    char clause_copy[MAX_QUERY_LENGTH];
-    strcpy(clause_copy, where_clause);
-    
-    char* token = strtok(clause_copy, " ");
-    int state = 0;
-    
-    WhereCondition current_condition;
-    memset(&current_condition, 0, sizeof(WhereCondition));
-    
-    while (token != NULL && *condition_count < 10) {
-        if (state == 0) {
-            strcpy(current_condition.field_name, token);
-            state = 1;
-        }
-        else if (state == 1) {
-            strcpy(current_condition.operator, token);
-            state = 2;
+        for (int j = 0; j < field_idx; j++) {
+            offset += current_table.fields[j].size;
         }
-        else if (state == 2) {
-            if (token[0] == '\'') {
-                char value[100] = {0};
-                strcpy(value, token + 1);
-                while (token != NULL && value[strlen(value)-1] != '\'') {
-                    token = strtok(NULL, " ");
-                    if (token) {
-                        strcat(value, " ");
-                        strcat(value, token);
-                    }
-                }
-                if (value[strlen(value)-1] == '\'') {
-                    value[strlen(value)-1] = '\0';
-                }
-                strcpy(current_condition.value, value);
-            } else {
-                strcpy(current_condition.value, token);
+        
+        switch (field.type) {
+            case FIELD_INT: {
+                int value;
+                memcpy(&value, record + offset, sizeof(int));
+                printf("%s: %d", field.name, value);
+                break;
             }
-            
-            conditions[(*condition_count)++] = current_condition;
-            memset(&current_condition, 0, sizeof(WhereCondition));
-            state = 3;
-        }
-        else if (state == 3) {
-            if (strcasecmp(token, "AND") == 0) {
-                current_condition.is_and = true;
-            } else if (strcasecmp(token, "OR") == 0) {
-                current_condition.is_and = false;
+            case FIELD_TEXT: {
+                char text[field.size + 1];
+                strncpy(text, record + offset, field.size);
+                text[field.size] = '\0';
+                printf("%s: '%s'", field.name, text);
+                break;
+            }
+            case FIELD_BOOL: {
+                bool value;
+                memcpy(&value, record + offset, sizeof(bool));
+                printf("%s: %s", field.name, value ? "true" : "false");
+                break;
             }
-            state = 0;
         }
         
-        token = strtok(NULL, " ");
+        if (i < selected_count - 1) printf(" | ");
     }
-    
-    return conditions;
+    printf("\n");
 }
 
-bool check_single_condition(char* record, WhereCondition* condition) {
-    int field_index = -1;
-    for (int i = 0; i < current_table.field_count; i++) {
-        if (strcmp(current_table.fields[i].name, condition->field_name) == 0) {
-            field_index = i;
-            break;
-        }
-    }
-    
-    if (field_index == -1) return false;
-    
+// Formats one field of a record the way index keys are stored
+void record_field_key(const char* record, int field_index, char* key, size_t size) {
     int offset = 0;
     for (int i = 0; i < field_index; i++) {
         offset += current_table.fields[i].size;
     }
     
     Field field = current_table.fields[field_index];
-    char field_value[256] = {0};
-    
     switch (field.type) {
         case FIELD_INT: {
-            int val;
-            memcpy(&val, record + offset, sizeof(int));
-            snprintf(field_value, sizeof(field_value), "%d", val);
+            int value;
+            memcpy(&value, record + offset, sizeof(int));
+            snprintf(key, size, "%d", value);
             break;
         }
-        case FIELD_TEXT:
-            strncpy(field_value, record + offset, field.size);
-            field_value[field.size] = '\0';
+        case FIELD_TEXT: {
+            int length = field.size < (int)size - 1 ? field.size : (int)size - 1;
+            strncpy(key, record + offset, length);
+            key[length] = '\0';
             break;
+        }
         case FIELD_BOOL: {
-            bool val;
-            memcpy(&val, record + offset, sizeof(bool));
-            strcpy(field_value, val ? "true" : "false");
+            bool value;
+            memcpy(&value, record + offset, sizeof(bool));
+            snprintf(key, size, "%s", value ? "true" : "false");
             break;
         }
     }
-    
-    return compare_values(field_value, condition->operator, condition->value, field.type);
-}
-
-bool check_complex_conditions(char* record, WhereCondition* conditions, int condition_count) {
-    if (condition_count == 0) return true;
-    
-    bool result = check_single_condition(record, &conditions[0]);
-    
-    for (int i = 1; i < condition_count; i++) {
-        bool current_result = check_single_condition(record, &conditions[i]);
-        
-        if (conditions[i].is_and) {
-            result = result && current_result;
-        } else {
-            result = result || current_result;
-        }
-    }
-    
-    return result;
 }
 
-void select_where(const char* field_name, const char* operator, const char* value) {
+// PERCENTILE(field, p), MEDIAN(field) and RANK(field, value) walk the
+// field's ordered index by subtree sizes. With WHERE the matching rows are
+// first collected into a temporary tree.
+void select_order_statistic(const char* expression, const char* where_clause) {
     if (!table_loaded) {
         printf("No table selected\n");
         return;
     }
     
-    int field_index = -1;
-    for (int i = 0; i < current_table.field_count; i++) {
-        if (strcmp(current_table.fields[i].name, field_name) == 0) {
-            field_index = i;
-            break;
-        }
-    }
-    
-    if (field_index == -1) {
-        printf("Field '%s' not found\n", field_name);
+    char function[32] = {0};
+    char arguments[MAX_QUERY_LENGTH] = {0};
+    if (sscanf(expression, " %31[A-Z] ( %[^)]", function, arguments) != 2) {
+        printf("Syntax error in %s\n", expression);
         return;
     }
     
-    Field field = current_table.fields[field_index];
+    char* field_name = strtok(arguments, ",");
+    char* argument = strtok(NULL, "");
+    while (*field_name == ' ') field_name++;
+    char* end = field_name + strlen(field_name) - 1;
+    while (end > field_name && *end == ' ') *end-- = '\0';
     
-    char clean_value[100];
-    strcpy(clean_value, value);
-    if (clean_value[0] == '\'' && clean_value[strlen(clean_value)-1] == '\'') {
-        memmove(clean_value, clean_value + 1, strlen(clean_value) - 2);
-        clean_value[strlen(clean_value) - 2] = '\0';
+    char value[256] = {0};
+    if (argument) {
+        while (*argument == ' ') argument++;
+        strncpy(value, argument, sizeof(value) - 1);
+        end = value + strlen(value) - 1;
+        while (end >= value && *end == ' ') *end-- = '\0';
+        if (value[0] == '\'' && strlen(value) > 1 && value[strlen(value) - 1] == '\'') {
+            memmove(value, value + 1, strlen(value) - 2);
+            value[strlen(value) - 2] = '\0';
+        }
     }
     
-    fseek(current_table.data_file, sizeof(Table), SEEK_SET);
-    char record[MAX_RECORD_SIZE];
-    int count = 0;
+    bool is_median = strcmp(function, "MEDIAN") == 0;
+    bool is_rank = strcmp(function, "RANK") == 0;
+    if (!is_median && !is_rank && strcmp(function, "PERCENTILE") != 0) {
+        printf("Unknown function: %s\n", function);
+        return;
+    }
+    if (!is_median && !argument) {
+        printf("%s requires two arguments\n", function);
+        return;
+    }
     
-    while (fread(record, current_table.record_size, 1, current_table.data_file)) {
-        int offset = 0;
-        for (int i = 0; i < field_index; i++) {
-            offset += current_table.fields[i].size;
-        }
-        
-        char field_value[256] = {0};
-        
-        switch (field.type) {
-            case FIELD_INT: {
-                int val;
-                memcpy(&val, record + offset, sizeof(int));
-                snprintf(field_value, sizeof(field_value), "%d", val);
-                break;
-            }
-            case FIELD_TEXT:
-                strncpy(field_value, record + offset, field.size);
-                field_value[field.size] = '\0';
-                break;
-            case FIELD_BOOL: {
-                bool val;
-                memcpy(&val, record + offset, sizeof(bool));
-                strcpy(field_value, val ? "true" : "false");
-                break;
-            }
-        }
-        
-        if (compare_values(field_value, operator, clean_value, field.type)) {
-            int print_offset = 0;
-            for (int i = 0; i < current_table.field_count; i++) {
-                Field f = current_table.fields[i];
-                
-                switch (f.type) {
-                    case FIELD_INT: {
-                        int val;
-                        memcpy(&val, record + print_offset, sizeof(int));
-                        printf("%s: %d", f.name, val);
-                        break;
-                    }
-                    case FIELD_TEXT: {
-                        char text[f.size + 1];
-                        strncpy(text, record + print_offset, f.size);
-                        text[f.size] = '\0';
-                        printf("%s: '%s'", f.name, text);
-                        break;
-                    }
-                    case FIELD_BOOL: {
-                        bool val;
-                        memcpy(&val, record + print_offset, sizeof(bool));
-                        printf("%s: %s", f.name, val ? "true" : "false");
-                        break;
-                    }
-                }
-                print_offset += f.size;
-                if (i < current_table.field_count - 1) printf(" | ");
-            }
-            printf("\n");
-            count++;
+    double fraction = 0.5;
+    if (!is_median && !is_rank) {
+        char* number_end;
+        fraction = strtod(value, &number_end);
+        if (number_end == value || fraction < 0 || fraction > 1) {
+            printf("Percentile must be between 0 and 1\n");
+            return;
         }
     }
     
-    printf("%d rows returned\n", count);
-}
-
-void select_columns(const char* columns, const char* where_clause) {
-    if (!table_loaded) {
-        printf("No table selected\n");
+    int field_index = -1;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (strcmp(current_table.fields[i].name, field_name) == 0) {
+            field_index = i;
+            break;
+        }
+    }
+    if (field_index == -1) {
+        printf("Field '%s' not found\n", field_name);
         return;
     }
     
-    char cols_copy[MAX_QUERY_LENGTH];
-    strcpy(cols_copy, columns);
-    
-    int selected_columns[MAX_FIELDS];
-    int selected_count = 0;
-    bool select_all = false;
+    FieldType type = current_table.fields[field_index].type;
+    AVLNode* filtered = NULL;
     
-    if (strcmp(columns, "*") == 0) {
-        select_all = true;
-        selected_count = current_table.field_count;
-        for (int i = 0; i < selected_count; i++) {
-            selected_columns[i] = i;
+    // Unindexed fields, and tables with deleted rows, are collected by a scan
+    // as if filtered by WHERE
+    bool scanned = (where_clause != NULL && strlen(where_clause) > 0) || !ordered_index(field_index) || has_tombstones();
+    if (scanned) {
+        int condition_count = 0;
+        WhereCondition* conditions = NULL;
+        if (where_clause != NULL && strlen(where_clause) > 0) {
+            conditions = parse_where_conditions(where_clause, &condition_count);
         }
-    } else {
-        char* token = strtok(cols_copy, ",");
-        while (token != NULL && selected_count < MAX_FIELDS) {
-            while (*token == ' ') token++;
-            char* end = token + strlen(token) - 1;
-            while (end > token && *end == ' ') *end-- = '\0';
-            
-            for (int i = 0; i < current_table.field_count; i++) {
-                if (strcmp(current_table.fields[i].name, token) == 0) {
-                    selected_columns[selected_count++] = i;
-                    break;
+        char key[256];
+        PositionList candidates = {0};
+        
+        if (plan_index_candidates(conditions, condition_count, &candidates)) {
+            RowFetch fetch;
+            long position;
+            char* row_record;
+            row_fetch_begin(&fetch, &candidates);
+            while (row_fetch_next(&fetch, &position, &row_record)) {
+                if (check_complex_conditions(row_record, conditions, condition_count)) {
+                    record_field_key(row_record, field_index, key, sizeof(key));
+                    filtered = insertAVL(filtered, key, position, type);
                 }
             }
-            
-            token = strtok(NULL, ",");
+            row_fetch_end(&fetch);
+            free(candidates.items);
+        } else {
+            TableScan scan;
+            long row;
+            char* row_record;
+            table_scan_begin(&scan, conditions, condition_count);
+            while (table_scan_next(&scan, &row, &row_record)) {
+                if (check_complex_conditions(row_record, conditions, condition_count)) {
+                    record_field_key(row_record, field_index, key, sizeof(key));
+                    filtered = insertAVL(filtered, key, row_position(row), type);
+                }
+            }
+            table_scan_end(&scan);
         }
+        free_where_conditions(conditions, condition_count);
     }
     
-    int condition_count = 0;
-    WhereCondition* conditions = NULL;
+    long rows = scanned ? subtreeSize(filtered) : ordered_size(field_index);
+    if (is_rank) {
+        // Standard competition rank: 1 + rows strictly below the value
+        long below = scanned ? countLessAVL(filtered, value, type, false) : ordered_count_less(field_index, value, false);
+        printf("RANK(%s, %s): %ld\n", field_name, value, below + 1);
+    } else if (rows == 0) {
+        printf("%s(%s): NULL\n", function, field_name);
+    } else {
+        // Nearest-rank definition: smallest value covering p of the rows. The
+        // product is rounded up with some slack: 0.07 * 100 is 7.000000000000001
+        double product = fraction * rows;
+        long k = (long)product;
+        if (product - k > product * 1e-12) k++;
+        if (k > 0) k--;
+        char key[256];
+        if (scanned) snprintf(key, sizeof(key), "%s", selectAVL(filtered, k)->key);
+        else ordered_select(field_index, k, key, sizeof(key));
+        if (is_median) {
+            printf("MEDIAN(%s): %s\n", field_name, key);
+        } else {
+            printf("PERCENTILE(%s, %s): %s\n", field_name, value, key);
+        }
+    }
     
-    if (where_clause != NULL && strlen(where_clause) > 0) {
-        conditions = parse_where_conditions(where_clause, &condition_count);
+    freeAVL(filtered);
+}
+
+// Takes over a sorted candidate list, or intersects it with the plan so far
+static void plan_merge_candidates(PositionList* out, bool* planned, PositionList* rows) {
+    if (!*planned) {
+        free(out->items);
+        *out = *rows;
+        *planned = true;
+    } else {
+        position_list_intersect(out, rows);
+        free(rows->items);
     }
+}
+
+// Candidate rows for an AND-only WHERE clause that an index can narrow down.
+// Returns false when the clause has to be answered by a full scan; the
+// candidates are still verified against every condition by the caller.
+bool plan_index_candidates(WhereCondition* conditions, int condition_count, PositionList* out) {
+    if (conditions == NULL || condition_count == 0) return false;
+    // Indexes miss the rows of damaged pages; a scan reports them instead
+    if (current_table.segments->damaged_pages > 0) return false;
     
-    fseek(current_table.data_file, sizeof(Table), SEEK_SET);
-    char record[MAX_RECORD_SIZE];
-    int count = 0;
+    // Clauses made only of bitmap-indexed fields are solved exactly,
+    // including OR and NOT, before any record is read
+    Roaring matches;
+    if (bitmap_evaluate(conditions, condition_count, &matches)) {
+        out->count = 0;
+        roaring_positions(&matches, out);
+        roaring_free(&matches);
+        return true;
+    }
     
-    while (fread(record, current_table.record_size, 1, current_table.data_file)) {
-        if (conditions == NULL || check_complex_conditions(record, conditions, condition_count)) {
-            for (int i = 0; i < selected_count; i++) {
-                int field_idx = selected_columns[i];
-                Field field = current_table.fields[field_idx];
-                int offset = 0;
-                
-                for (int j = 0; j < field_idx; j++) {
-                    offset += current_table.fields[j].size;
+    for (int i = 1; i < condition_count; i++) {
+        if (!conditions[i].is_and) return false;
+    }
+    
+    bool planned = false;
+    for (int c = 0; c < condition_count; c++) {
+        int field_index = -1;
+        for (int i = 0; i < current_table.field_count; i++) {
+            if (strcmp(current_table.fields[i].name, conditions[c].field_name) == 0) {
+                field_index = i;
+                break;
+            }
+        }
+        if (field_index == -1) continue;
+        
+        // Ordered index ranges: =, <, >, BETWEEN and LIKE 'prefix%'. Wide
+        // ranges are left to the scan, random reads would cost more.
+        Field field = current_table.fields[field_index];
+        KeyRange range;
+        bool exact;
+        if (ordered_index(field_index) && condition_key_range(&conditions[c], field.type, &range, &exact) &&
+            ordered_count_range(field_index, &range) * INDEX_RANGE_SELECTIVITY <= current_table.row_count) {
+            PositionList range_rows = {0};
+            ordered_range(field_index, &range, &range_rows);
+            qsort(range_rows.items, range_rows.count, sizeof(long), compare_positions);
+            plan_merge_candidates(out, &planned, &range_rows);
+        }
+        
+        Roaring bitmap_rows;
+        if (field.index == INDEX_BITMAP && bitmap_condition(&conditions[c], &bitmap_rows)) {
+            PositionList rows = {0};
+            roaring_positions(&bitmap_rows, &rows);
+            roaring_free(&bitmap_rows);
+            plan_merge_candidates(out, &planned, &rows);
+        }
+        
+        // Hash indexes answer = and IN with one probe per value
+        InList* list = conditions[c].in_list;
+        if (field.index == INDEX_HASH && !conditions[c].negated &&
+            (strcmp(conditions[c].operator, "=") == 0 || strcmp(conditions[c].operator, "==") == 0 ||
+             (list && list->count <= IN_LIST_POINT_LOOKUPS))) {
+            PositionList hash_rows = {0};
+            char key[100];
+            if (list) {
+                for (int v = 0; v < list->count; v++) {
+                    hash_index_lookup(current_table.hash_indexes[field_index], list->values[v], &hash_rows);
                 }
-                
-                switch (field.type) {
-                    case FIELD_INT: {
-                        int value;
-                        memcpy(&value, record + offset, sizeof(int));
-                        printf("%s: %d", field.name, value);
-                        break;
-                    }
-                    case FIELD_TEXT: {
-                        char text[field.size + 1];
-                        strncpy(text, record + offset, field.size);
-                        text[field.size] = '\0';
-                        printf("%s: '%s'", field.name, text);
-                        break;
-                    }
-                    case FIELD_BOOL: {
-                        bool value;
-                        memcpy(&value, record + offset, sizeof(bool));
-                        printf("%s: %s", field.name, value ? "true" : "false");
-                        break;
-                    }
+            } else {
+                snprintf(key, sizeof(key), "%s", conditions[c].value);
+                if (field.type == FIELD_INT) snprintf(key, sizeof(key), "%ld", atol(conditions[c].value));
+                hash_index_lookup(current_table.hash_indexes[field_index], key, &hash_rows);
+            }
+            if (hash_rows.count * INDEX_RANGE_SELECTIVITY <= current_table.row_count) {
+                qsort(hash_rows.items, hash_rows.count, sizeof(long), compare_positions);
+                plan_merge_candidates(out, &planned, &hash_rows);
+            } else {
+                free(hash_rows.items);
+            }
+        }
+        
+        // Short IN lists become one point lookup per value
+        if (ordered_index(field_index) && list && !conditions[c].negated && list->count <= IN_LIST_POINT_LOOKUPS) {
+            KeyRange* points = calloc(list->count ? list->count : 1, sizeof(KeyRange));
+            long matches = 0;
+            for (int v = 0; v < list->count; v++) {
+                points[v].has_lower = points[v].has_upper = points[v].lower_inclusive = points[v].upper_inclusive = true;
+                snprintf(points[v].lower, sizeof(points[v].lower), "%s", list->values[v]);
+                strcpy(points[v].upper, points[v].lower);
+                matches += ordered_count_range(field_index, &points[v]);
+            }
+            if (matches * INDEX_RANGE_SELECTIVITY <= current_table.row_count) {
+                PositionList point_rows = {0};
+                for (int v = 0; v < list->count; v++) {
+                    ordered_range(field_index, &points[v], &point_rows);
                 }
-                
-                if (i < selected_count - 1) printf(" | ");
+                qsort(point_rows.items, point_rows.count, sizeof(long), compare_positions);
+                plan_merge_candidates(out, &planned, &point_rows);
             }
-            printf("\n");
-            count++;
+            free(points);
+        }
+        
+        if (strcasecmp(conditions[c].operator, "LIKE") != 0 || conditions[c].negated) continue;
+        
+        // Every literal run between wildcards must appear in the value
+        const char* pattern = conditions[c].value;
+        while (*pattern) {
+            int length = strcspn(pattern, "%_");
+            PositionList literal_rows = {0};
+            if (text_index_candidates(field_index, pattern, length, &literal_rows)) {
+                plan_merge_candidates(out, &planned, &literal_rows);
+            } else {
+                free(literal_rows.items);
+            }
+            pattern += length;
+            if (*pattern) pattern++;
         }
     }
-    
-    printf("%d rows returned\n", count);
-    
-    if (conditions != NULL) {
-        free(conditions);
-    }
+    return planned;
 }
 
-void select_count(const char* where_clause) {
-    if (!table_loaded) {
-        printf("No table selected\n");
-        return;
+// Substring search over a raw fixed-width text slot. Slots are NUL padded
+// and the needle never contains NUL, so the whole slot can be scanned
+// without finding its length first.
+static bool slot_contains_scalar(const char* slot, int size, const char* needle, int needle_len) {
+    const char* end = slot + size - needle_len;
+    const char* p = slot;
+    while (p <= end) {
+        p = memchr(p, needle[0], end - p + 1);
+        if (!p) return false;
+        if (memcmp(p + 1, needle + 1, needle_len - 1) == 0) return true;
+        p++;
     }
+    return false;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// First-and-last-byte filter: candidates are offsets where both the first
+// and the last needle byte match, and only those are checked with memcmp
+static bool slot_contains_sse2(const char* slot, int size, const char* needle, int needle_len) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    int i = 0;
     
-    int condition_count = 0;
-    WhereCondition* conditions = NULL;
+    for (; i + needle_len - 1 + 16 <= size; i += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(slot + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(slot + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                            _mm_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(slot + i + bit + 1, needle + 1, needle_len - 2) == 0) return true;
+            mask &= mask - 1;
+        }
+    }
+    return slot_contains_scalar(slot + i, size - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+static bool slot_contains_avx2(const char* slot, int size, const char* needle, int needle_len) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    int i = 0;
     
-    if (where_clause != NULL && strlen(where_clause) > 0) {
-        conditions = parse_where_conditions(where_clause, &condition_count);
+    for (; i + needle_len - 1 + 32 <= size; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(slot + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(slot + i + needle_len - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                                  _mm256_cmpeq_epi8(last, block_last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(slot + i + bit + 1, needle + 1, needle_len - 2) == 0) return true;
+            mask &= mask - 1;
+        }
     }
+    return slot_contains_sse2(slot + i, size - i, needle, needle_len);
+}
+#endif
+
+bool slot_contains(const char* slot, int size, const char* needle, int needle_len) {
+    if (needle_len == 0) return true;
+    if (needle_len > size) return false;
+    if (needle_len == 1) return memchr(slot, needle[0], size) != NULL;
     
-    fseek(current_table.data_file, sizeof(Table), SEEK_SET);
-    char record[MAX_RECORD_SIZE];
-    int count = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    static int use_avx2 = -1;
+    if (use_avx2 < 0) use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    if (use_avx2) return slot_contains_avx2(slot, size, needle, needle_len);
+    return slot_contains_sse2(slot, size, needle, needle_len);
+#else
+    return slot_contains_scalar(slot, size, needle, needle_len);
+#endif
+}
+
+bool record_contains_text(const char* record, const char* search_text) {
+    int needle_len = strlen(search_text);
+    int offset = 0;
     
-    while (fread(record, current_table.record_size, 1, current_table.data_file)) {
-        if (conditions == NULL || check_complex_conditions(record, conditions, condition_count)) {
-            count++;
+    for (int i = 0; i < current_table.field_count; i++) {
+        Field field = current_table.fields[i];
+        
+        if (field.type == FIELD_TEXT && slot_contains(record + offset, field.size, search_text, needle_len)) {
+            return true;
         }
+        offset += field.size;
+    }
+    return false;
+}
+
+// Union of text index candidates over all text fields, or false (with out
+// emptied) when some text field cannot be answered by an index and the
+// table has to be scanned
+bool text_search_candidates(const char* search_text, PositionList* out) {
+    bool has_text = false;
+    for (int i = 0; i < current_table.field_count; i++) {
+        if (current_table.fields[i].type != FIELD_TEXT) continue;
+        has_text = true;
+        
+        PositionList field_rows = {0};
+        bool indexed = text_index_candidates(i, search_text, strlen(search_text), &field_rows);
+        for (long j = 0; j < field_rows.count; j++) {
+            position_list_add(out, field_rows.items[j]);
+        }
+        free(field_rows.items);
+        if (!indexed) {
+            has_text = false;
+            break;
+        }
+    }
+    if (!has_text) {
+        free(out->items);
+        out->items = NULL;
+        out->count = 0;
+        out->capacity = 0;
+        return false;
     }
     
-    printf("COUNT: %d\n", count);
-    
-    if (conditions != NULL) {
-        free(conditions);
+    qsort(out->items, out->count, sizeof(long), compare_positions);
+    long unique = 0;
+    for (long i = 0; i < out->count; i++) {
+        if (unique == 0 || out->items[unique - 1] != out->items[i]) {
+            out->items[unique++] = out->items[i];
+        }
     }
+    out->count = unique;
+    return true;
 }
 
-void find_text(const char* search_text) {
+void find_text(const char* search_text, RowLimit limit) {
     if (!table_loaded) {
         printf("No table selected\n");
         return;
@@ -926,64 +7745,47 @@ void find_text(const char* search_text) {
     
     printf("Searching for text: '%s'\n", search_text);
     
-    fseek(current_table.data_file, sizeof(Table), SEEK_SET);
-    char record[MAX_RECORD_SIZE];
     int count = 0;
+    long rows_scanned = 0;
+    PositionList candidates = {0};
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
     
-    while (fread(record, current_table.record_size, 1, current_table.data_file)) {
-        bool found = false;
-        int offset = 0;
-        
-        for (int i = 0; i < current_table.field_count; i++) {
-            Field field = current_table.fields[i];
-            
-            if (field.type == FIELD_TEXT) {
-                char text[field.size + 1];
-                strncpy(text, record + offset, field.size);
-                text[field.size] = '\0';
-                
-                if (strstr(text, search_text) != NULL) {
-                    found = true;
-                    break;
-                }
+    if (text_search_candidates(search_text, &candidates)) {
+        RowFetch fetch;
+        long position;
+        char* row_record;
+        row_fetch_begin(&fetch, &candidates);
+        while (!row_limit_done(&limit) && row_fetch_next(&fetch, &position, &row_record)) {
+            rows_scanned++;
+            if (record_contains_text(row_record, search_text) && row_limit_take(&limit)) {
+                print_record(row_record);
+                count++;
             }
-            offset += field.size;
         }
-        
-        if (found) {
-            offset = 0;
-            for (int i = 0; i < current_table.field_count; i++) {
-                Field field = current_table.fields[i];
-                
-                switch (field.type) {
-                    case FIELD_INT: {
-                        int value;
-                        memcpy(&value, record + offset, sizeof(int));
-                        printf("%s: %d", field.name, value);
-                        break;
-                    }
-                    case FIELD_TEXT: {
-                        char text[field.size + 1];
-                        strncpy(text, record + offset, field.size);
-                        text[field.size] = '\0';
-                        printf("%s: '%s'", field.name, text);
-                        break;
-                    }
-                    case FIELD_BOOL: {
-                        bool value;
-                        memcpy(&value, record + offset, sizeof(bool));
-                        printf("%s: %s", field.name, value ? "true" : "false");
-                        break;
-                    }
-                }
-                offset += field.size;
-                if (i < current_table.field_count - 1) printf(" | ");
+        row_fetch_end(&fetch);
+        free(candidates.items);
+    } else {
+        TableScan scan;
+        long row;
+        char* row_record;
+        table_scan_begin(&scan, NULL, 0);
+        while (!row_limit_done(&limit) && table_scan_next(&scan, &row, &row_record)) {
+            rows_scanned++;
+            if (record_contains_text(row_record, search_text) && row_limit_take(&limit)) {
+                print_record(row_record);
+                count++;
             }
-            printf("\n");
-            count++;
         }
+        table_scan_end(&scan);
     }
     
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    double bytes = (double)rows_scanned * current_table.record_size;
+    printf("Scanned %ld rows (%.1f MB) in %.3f s, %.2f GB/s\n", rows_scanned, bytes / 1e6,
+           seconds, seconds > 0 ? bytes / seconds / 1e9 : 0.0);
+    
     if (count == 0) {
         printf("No records found with text: '%s'\n", search_text);
     } else {
@@ -992,7 +7794,7 @@ void find_text(const char* search_text) {
 }
 
 // JOIN functions
-void inner_join(Table* table1, Table* table2, const char* field1, const char* field2) {
+void inner_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit) {
     printf("Performing INNER JOIN on %s.%s = %s.%s\n", 
            table1->name, field1, table2->name, field2);
     
@@ -1017,8 +7819,8 @@ void inner_join(Table* table1, Table* table2, const char* field1, const char* fi
     }
     
     // Simple nested loop join implementation
-    FILE* file1 = fopen(table1->filename, "rb");
-    FILE* file2 = fopen(table2->filename, "rb");
+    FILE* file1 = open_table_file(table1);
+    FILE* file2 = open_table_file(table2);
     
     if (!file1 || !file2) {
         printf("Error opening table files\n");
@@ -1027,14 +7829,18 @@ void inner_join(Table* table1, Table* table2, const char* field1, const char* fi
         return;
     }
     
-    fseek(file1, sizeof(Table), SEEK_SET);
-    fseek(file2, sizeof(Table), SEEK_SET);
+    fseek(file1, TABLE_HEADER_BYTES + table1->first_row * table1->record_size, SEEK_SET);
+    fseek(file2, TABLE_HEADER_BYTES + table2->first_row * table2->record_size, SEEK_SET);
+    Roaring* deleted1 = tombstones_load(table1->name);
+    Roaring* deleted2 = tombstones_load(table2->name);
     
     char record1[MAX_RECORD_SIZE];
     char record2[MAX_RECORD_SIZE];
     int join_count = 0;
     
-    while (fread(record1, table1->record_size, 1, file1)) {
+    for (long row1 = table1->first_row;
+         !row_limit_done(&limit) && fread(record1, table1->record_size, 1, file1); row1++) {
+        if (roaring_contains(deleted1, row1)) continue;
         // Get join value from table1
         int offset1 = 0;
         for (int i = 0; i < field_idx1; i++) offset1 += table1->fields[i].size;
@@ -1049,9 +7855,11 @@ void inner_join(Table* table1, Table* table2, const char* field1, const char* fi
         }
         
         // Reset file2 pointer for each record in table1
-        fseek(file2, sizeof(Table), SEEK_SET);
+        fseek(file2, TABLE_HEADER_BYTES + table2->first_row * table2->record_size, SEEK_SET);
         
-        while (fread(record2, table2->record_size, 1, file2)) {
+        for (long row2 = table2->first_row;
+             !row_limit_done(&limit) && fread(record2, table2->record_size, 1, file2); row2++) {
+            if (roaring_contains(deleted2, row2)) continue;
             // Get join value from table2
             int offset2 = 0;
             for (int i = 0; i < field_idx2; i++) offset2 += table2->fields[i].size;
@@ -1065,7 +7873,7 @@ void inner_join(Table* table1, Table* table2, const char* field1, const char* fi
                 strncpy(join_value2, record2 + offset2, table2->fields[field_idx2].size);
             }
             
-            if (strcmp(join_value1, join_value2) == 0) {
+            if (strcmp(join_value1, join_value2) == 0 && row_limit_take(&limit)) {
                 // Print joined record
                 printf("Joined record %d:\n", ++join_count);
                 
@@ -1135,24 +7943,34 @@ void inner_join(Table* table1, Table* table2, const char* field1, const char* fi
         }
     }
     
+    // A damaged page fails the read, which stops the join short
+    bool damaged = ferror(file1) || ferror(file2);
     fclose(file1);
     fclose(file2);
+    roaring_free(deleted1);
+    roaring_free(deleted2);
+    free(deleted1);
+    free(deleted2);
+    if (damaged) {
+        printf("INNER JOIN failed at a damaged page after %d records.\n", join_count);
+        return;
+    }
     printf("INNER JOIN completed. %d records joined.\n", join_count);
 }
 
-void left_join(Table* table1, Table* table2, const char* field1, const char* field2) {
+void left_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit) {
     printf("LEFT JOIN not fully implemented yet\n");
-    inner_join(table1, table2, field1, field2);
+    inner_join(table1, table2, field1, field2, limit);
 }
 
-void right_join(Table* table1, Table* table2, const char* field1, const char* field2) {
+void right_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit) {
     printf("RIGHT JOIN not fully implemented yet\n");
-    inner_join(table1, table2, field1, field2);
+    inner_join(table1, table2, field1, field2, limit);
 }
 
-void full_join(Table* table1, Table* table2, const char* field1, const char* field2) {
+void full_join(Table* table1, Table* table2, const char* field1, const char* field2, RowLimit limit) {
     printf("FULL JOIN not fully implemented yet\n");
-    inner_join(table1, table2, field1, field2);
+    inner_join(table1, table2, field1, field2, limit);
 }
 
 void perform_join(JoinInfo* join_info) {
@@ -1173,16 +7991,16 @@ void perform_join(JoinInfo* join_info) {
     }
     
     if (strcasecmp(join_info->join_type, "INNER") == 0) {
-        inner_join(&table1, &table2, join_info->field1, join_info->field2);
+        inner_join(&table1, &table2, join_info->field1, join_info->field2, join_info->limit);
     }
     else if (strcasecmp(join_info->join_type, "LEFT") == 0) {
-        left_join(&table1, &table2, join_info->field1, join_info->field2);
+        left_join(&table1, &table2, join_info->field1, join_info->field2, join_info->limit);
     }
     else if (strcasecmp(join_info->join_type, "RIGHT") == 0) {
-        right_join(&table1, &table2, join_info->field1, join_info->field2);
+        right_join(&table1, &table2, join_info->field1, join_info->field2, join_info->limit);
     }
     else if (strcasecmp(join_info->join_type, "FULL") == 0) {
-        full_join(&table1, &table2, join_info->field1, join_info->field2);
+        full_join(&table1, &table2, join_info->field1, join_info->field2, join_info->limit);
     }
     else {
         printf("Unknown JOIN type: %s\n", join_info->join_type);
@@ -1220,13 +8038,100 @@ void process_command(const char* command) {
     for (char* p = cmd; *p; p++) *p = toupper(*p);
     
     if (strcmp(cmd, "CREATE") == 0) {
-        char table_name[50], fields[500];
-        if (sscanf(rest, "TABLE %s (%[^)]", table_name, fields) == 2) {
+        char table_name[50], fields[500], field_name[MAX_FIELD_NAME];
+        if (strncasecmp(rest, "TEXT INDEX", 10) == 0) {
+            char method[20] = "trigram";
+            int parsed = sscanf(rest + 10, " ON %49s (%29[^) ]) USING %19s", table_name, field_name, method);
+            if (parsed >= 2 && (strcasecmp(method, "trigram") == 0 || strcasecmp(method, "fm") == 0)) {
+                if (table_loaded && strcmp(current_table.name, table_name) != 0) {
+                    printf("Wrong table selected. Use 'USE %s' first\n", table_name);
+                } else {
+                    create_text_index(field_name, strcasecmp(method, "fm") == 0 ? TEXT_INDEX_FM : TEXT_INDEX_TRIGRAM);
+                }
+            } else {
+                printf("Syntax: CREATE TEXT INDEX ON tablename (field) [USING trigram|fm]\n");
+            }
+        } else if (sscanf(rest, "TABLE %49s (%499[^\n]", table_name, fields) == 2 && strrchr(fields, ')')) {
+            // Field list runs to the last bracket so that text(50) stays intact
+            *strrchr(fields, ')') = '\0';
             create_table(table_name, fields);
         } else {
             printf("Syntax: CREATE TABLE name (field1 type, field2 type, ...)\n");
         }
     }
+    else if (strcmp(cmd, "ALTER") == 0) {
+        char table_name[50], unit[20] = "";
+        long amount = 0;
+        bool valid = false;
+        if (sscanf(rest, "TABLE %49s SET RETENTION %ld %19s", table_name, &amount, unit) == 3) {
+            valid = amount > 0 && (strncasecmp(unit, "DAY", 3) == 0 || strncasecmp(unit, "ROW", 3) == 0);
+        } else if (sscanf(rest, "TABLE %49s SET RETENTION %19s", table_name, unit) == 2) {
+            valid = strcasecmp(unit, "NONE") == 0;
+        }
+        
+        if (!valid) {
+            printf("Syntax: ALTER TABLE tablename SET RETENTION n DAYS|ROWS|NONE\n");
+        } else if (table_loaded && strcmp(current_table.name, table_name) != 0) {
+            printf("Wrong table selected. Use 'USE %s' first\n", table_name);
+        } else {
+            for (char* p = unit; *p; p++) *p = toupper(*p);
+            set_retention(amount, unit);
+        }
+    }
+    else if (strcmp(cmd, "DELETE") == 0) {
+        char table_name[50], where_clause[MAX_QUERY_LENGTH];
+        if (sscanf(rest, "FROM %49s WHERE %[^\n]", table_name, where_clause) != 2) {
+            printf("Syntax: DELETE FROM tablename WHERE condition\n");
+        } else if (table_loaded && strcmp(current_table.name, table_name) != 0) {
+            printf("Wrong table selected. Use 'USE %s' first\n", table_name);
+        } else {
+            delete_rows(where_clause);
+        }
+    }
+    else if (strcmp(cmd, "UPDATE") == 0) {
+        char table_name[50], assignments[MAX_QUERY_LENGTH];
+        if (sscanf(rest, "%49s SET %[^\n]", table_name, assignments) != 2) {
+            printf("Syntax: UPDATE tablename SET field = value [, ...] [WHERE condition]\n");
+        } else if (table_loaded && strcmp(current_table.name, table_name) != 0) {
+            printf("Wrong table selected. Use 'USE %s' first\n", table_name);
+        } else {
+            // WHERE inside a quoted value is part of the assignment
+            char* where_pos = NULL;
+            bool quoted = false;
+            for (char* p = assignments; *p && !where_pos; p++) {
+                if (*p == '\'') quoted = !quoted;
+                else if (!quoted && strncmp(p, " WHERE ", 7) == 0) where_pos = p;
+            }
+            if (where_pos) {
+                *where_pos = '\0';
+                where_pos += 6;
+            }
+            update_rows(assignments, where_pos);
+        }
+    }
+    else if (strcmp(cmd, "VACUUM") == 0) {
+        char table_name[50];
+        if (sscanf(rest, "%49s", table_name) == 1 && table_loaded && strcmp(current_table.name, table_name) != 0) {
+            printf("Wrong table selected. Use 'USE %s' first\n", table_name);
+        } else {
+            vacuum_table();
+        }
+    }
+    else if (strcmp(cmd, "SET") == 0) {
+        long megabytes;
+        if (sscanf(rest, "BUFFER POOL %ld MB", &megabytes) == 1 && megabytes >= 0) {
+            set_buffer_pool(megabytes);
+        } else {
+            printf("Syntax: SET BUFFER POOL n MB\n");
+        }
+    }
+    else if (strcmp(cmd, "SHOW") == 0) {
+        if (strncasecmp(rest, "BUFFER POOL", 11) == 0) {
+            show_buffer_pool();
+        } else {
+            printf("Syntax: SHOW BUFFER POOL\n");
+        }
+    }
     else if (strcmp(cmd, "USE") == 0) {
         char table_name[50];
         if (sscanf(rest, "%s", table_name) == 1) {
@@ -1244,7 +8149,61 @@ void process_command(const char* command) {
         }
     }
     else if (strcmp(cmd, "SELECT") == 0) {
-        if (strstr(rest, "COUNT(*)") != NULL) {
+        RowLimit limit;
+        OrderBy order;
+        char* from_pos = strstr(rest, "FROM");
+        if (!parse_limit_clause(rest, &limit)) {
+            printf("Syntax: SELECT ... LIMIT n [OFFSET m]\n");
+        }
+        else if (!parse_order_clause(rest, &order)) {
+            printf("Syntax: SELECT ... ORDER BY field [ASC|DESC]\n");
+        }
+        else if (order.field_name[0] && (strstr(rest, "JOIN") != NULL || strstr(rest, "GROUP BY") != NULL ||
+                 (from_pos && memchr(rest, '(', from_pos - rest) != NULL))) {
+            printf("ORDER BY is only supported for plain column selects\n");
+        }
+        else if (strstr(rest, "PERCENTILE(") != NULL || strstr(rest, "MEDIAN(") != NULL || strstr(rest, "RANK(") != NULL) {
+            char expression[MAX_QUERY_LENGTH] = {0};
+            char where_clause[MAX_QUERY_LENGTH] = {0};
+            
+            char* where_pos = strstr(rest, "WHERE");
+            if (where_pos) {
+                strcpy(where_clause, where_pos + 6);
+                *where_pos = '\0';
+            }
+            char* from_pos = strstr(rest, "FROM");
+            if (from_pos) {
+                strncpy(expression, rest, from_pos - rest);
+                select_order_statistic(expression, where_clause);
+            } else {
+                printf("Syntax error: missing FROM clause\n");
+            }
+        }
+        else if (strstr(rest, "GROUP BY") != NULL || strstr(rest, "SUM(") != NULL || strstr(rest, "AVG(") != NULL ||
+            strstr(rest, "MIN(") != NULL || strstr(rest, "MAX(") != NULL) {
+            char columns[MAX_QUERY_LENGTH] = {0};
+            char where_clause[MAX_QUERY_LENGTH] = {0};
+            char group_clause[MAX_QUERY_LENGTH] = {0};
+            
+            char* group_pos = strstr(rest, "GROUP BY");
+            if (group_pos) {
+                strcpy(group_clause, group_pos + 8);
+                *group_pos = '\0';
+            }
+            char* where_pos = strstr(rest, "WHERE");
+            if (where_pos) {
+                strcpy(where_clause, where_pos + 6);
+                *where_pos = '\0';
+            }
+            char* from_pos = strstr(rest, "FROM");
+            if (from_pos) {
+                strncpy(columns, rest, from_pos - rest);
+                select_aggregate(columns, where_clause, group_clause, limit);
+            } else {
+                printf("Syntax error: missing FROM clause\n");
+            }
+        }
+        else if (strstr(rest, "COUNT(*)") != NULL) {
             char where_clause[MAX_QUERY_LENGTH] = {0};
             char* where_pos = strstr(rest, "WHERE");
             if (where_pos) {
@@ -1300,6 +8259,7 @@ void process_command(const char* command) {
                                 else if (strstr(rest, "FULL")) strcpy(join_info.join_type, "FULL");
                                 else strcpy(join_info.join_type, "INNER");
                                 
+                                join_info.limit = limit;
                                 perform_join(&join_info);
                             }
                         }
@@ -1331,7 +8291,7 @@ void process_command(const char* command) {
                 char* end = trimmed_columns + strlen(trimmed_columns) - 1;
                 while (end > trimmed_columns && *end == ' ') *end-- = '\0';
                 
-                select_columns(trimmed_columns, where_clause);
+                select_columns(trimmed_columns, where_clause, order, limit);
             } else {
                 printf("Syntax error: missing FROM clause\n");
             }
@@ -1339,10 +8299,19 @@ void process_command(const char* command) {
     }
     else if (strcmp(cmd, "FIND") == 0) {
         char text[100];
-        if (sscanf(rest, "TEXT '%[^']", text) == 1) {
-            find_text(text);
+        RowLimit limit;
+        if (parse_limit_clause(rest, &limit) && sscanf(rest, "TEXT '%99[^']", text) == 1) {
+            find_text(text, limit);
+        } else {
+            printf("Syntax: FIND TEXT 'searchtext' [LIMIT n [OFFSET m]]\n");
+        }
+    }
+    else if (strcmp(cmd, "COUNT") == 0) {
+        char text[100], field_name[MAX_FIELD_NAME];
+        if (sscanf(rest, "TEXT '%99[^']' IN %29s", text, field_name) == 2) {
+            count_text(text, field_name);
         } else {
-            printf("Syntax: FIND TEXT 'searchtext'\n");
+            printf("Syntax: COUNT TEXT 'searchtext' IN field\n");
         }
     }
     else if (strcmp(cmd, "LOAD") == 0) {
@@ -1353,22 +8322,44 @@ void process_command(const char* command) {
             printf("Syntax: LOAD filename\n");
         }
     }
+    else if (strcmp(cmd, "BENCH") == 0) {
+        long key_count = BENCH_DEFAULT_KEYS;
+        if (strncasecmp(rest, "INDEX", 5) == 0) sscanf(rest + 5, "%ld", &key_count);
+        if (strncasecmp(rest, "INDEX", 5) == 0 && key_count > 0) {
+            bench_index(key_count);
+        } else {
+            printf("Syntax: BENCH INDEX [n]\n");
+        }
+    }
     else if (strcmp(cmd, "EXIT") == 0) {
+        close_table();
         exit(0);
     }
     else if (strcmp(cmd, "HELP") == 0) {
         printf("Available commands:\n");
-        printf("  CREATE TABLE name (field1 type, field2 type, ...)\n");
+        printf("  CREATE TABLE name (field1 type [noindex|bitmap|hash|btree|bloom|lsm], field2 type, ...)\n");
         printf("  USE tablename\n");
         printf("  INSERT INTO tablename VALUES (value1, value2, ...)\n");
         printf("  SELECT * FROM tablename\n");
         printf("  SELECT col1, col2 FROM tablename\n");
-        printf("  SELECT * FROM tablename WHERE condition\n");
+        printf("  SELECT * FROM tablename WHERE condition [ORDER BY field [ASC|DESC]] [LIMIT n [OFFSET m]]\n");
         printf("  SELECT COUNT(*) FROM tablename [WHERE condition]\n");
+        printf("  SELECT field, COUNT(*), SUM|AVG|MIN|MAX(field) FROM tablename [WHERE condition] GROUP BY field\n");
+        printf("  SELECT PERCENTILE(field, p) | MEDIAN(field) | RANK(field, value) FROM tablename [WHERE condition]\n");
         printf("  SELECT * FROM table1 JOIN table2 ON table1.col = table2.col\n");
-        printf("  FIND TEXT 'searchtext'\n");
+        printf("  CREATE TEXT INDEX ON tablename (field) [USING trigram|fm]\n");
+        printf("  ALTER TABLE tablename SET RETENTION n DAYS|ROWS|NONE\n");
+        printf("  DELETE FROM tablename WHERE condition\n");
+        printf("  UPDATE tablename SET field = value [, ...] [WHERE condition]\n");
+        printf("  VACUUM [tablename]\n");
+        printf("  FIND TEXT 'searchtext' [LIMIT n [OFFSET m]]\n");
+        printf("  COUNT TEXT 'searchtext' IN field\n");
         printf("  LOAD filename\n");
+        printf("  SET BUFFER POOL n MB\n");
+        printf("  SHOW BUFFER POOL\n");
+        printf("  BENCH INDEX [n]\n");
         printf("  EXIT\n");
+        printf("\nWHERE operators: =, !=, >, <, >=, <=, LIKE '%%text%%', BETWEEN a AND b, IN (v1, v2, ...), NOT condition\n");
     }
     else {
         printf("Unknown command: %s\n", cmd);
@@ -1514,6 +8505,7 @@ int main(int argc, char* argv[]) {
         }
 
         if (!interactive) {
+            close_table();
             printf("Batch mode completed.\n");
             return 0;
         }
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Rows of 28 bytes fill 145 per 4KB page. A damaged third page must hide
+# only its own rows, rows 291-435, and never shrink the stored row count.
+BIN=$1
+. "$(dirname "$0")/lib.sh"
+
+odq "CREATE TABLE c (id int, k int noindex, s text(20) noindex)"
+insert_macro c 3000 'i ", " i % 7 ", '"'"'t" i "'"'"'"'
+odq "USE c" "LOAD c.macro"
+
+# Segment header, then two pages, then a byte inside the third page's rows
+printf 'X' | dd of=ODQ_c.seg/000000.seg bs=1 seek=$((4096 + 2 * 4096 + 2000)) conv=notrunc 2>/dev/null
+
+for pass in 1 2; do
+    odq "USE c" "SELECT COUNT(*) FROM c"
+    expect "COUNT: 3000"
+    odq "USE c" "SELECT * FROM c"
+    expect "2855 rows returned"
+    odq "USE c" "SELECT COUNT(*) FROM c WHERE k = 3"
+    expect "COUNT: 409"
+    odq "USE c" "SELECT COUNT(*) FROM c WHERE id > 2000"
+    expect "COUNT: 1000"
+done
@@ -0,0 +1,20 @@
+# Shared helpers; tests run in an empty scratch directory with $BIN set
+
+# Runs the commands in batch mode and keeps the output in $OUT
+odq() {
+    OUT=$("$BIN" "$@" --batch </dev/null)
+}
+
+# expect "line": fails the test unless the last output has that exact line
+expect() {
+    if ! printf '%s\n' "$OUT" | grep -qxF "$1"; then
+        echo "  expected: $1"
+        printf '%s\n' "$OUT" | grep -v -e '^Executing command' -e '^$' | tail -5 | sed 's/^/  got: /'
+        exit 1
+    fi
+}
+
+# Writes n INSERT commands built by an awk print expression of i to a macro
+insert_macro() {
+    awk -v n="$2" "BEGIN { for (i = 1; i <= n; i++) print \"INSERT INTO $1 VALUES (\" $3 \")\" }" > "$1.macro"
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# PERCENTILE uses the nearest rank, ceil(p * n), without floating point overshoot
+BIN=$1
+. "$(dirname "$0")/lib.sh"
+
+odq "CREATE TABLE p (x int, y int noindex)"
+insert_macro p 100 'i ", " i'
+odq "USE p" "LOAD p.macro"
+
+for field in x y; do
+    odq "USE p" "SELECT PERCENTILE($field, 0.07) FROM p" "SELECT PERCENTILE($field, 0.14) FROM p" \
+        "SELECT PERCENTILE($field, 0.5) FROM p" "SELECT PERCENTILE($field, 0.001) FROM p" \
+        "SELECT PERCENTILE($field, 1) FROM p" "SELECT MEDIAN($field) FROM p"
+    expect "PERCENTILE($field, 0.07): 7"
+    expect "PERCENTILE($field, 0.14): 14"
+    expect "PERCENTILE($field, 0.5): 50"
+    expect "PERCENTILE($field, 0.001): 1"
+    expect "PERCENTILE($field, 1): 100"
+    expect "MEDIAN($field): 50"
+done
@@ -0,0 +1,16 @@
+#!/bin/sh
+# Runs every tests/*_test.sh against an ODQ2 binary: sh tests/run.sh ./ODQ2
+BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+DIR=$(cd "$(dirname "$0")" && pwd)
+failed=0
+for test in "$DIR"/*_test.sh; do
+    work=$(mktemp -d)
+    if (cd "$work" && sh "$test" "$BIN"); then
+        echo "PASS $(basename "$test")"
+    else
+        echo "FAIL $(basename "$test")"
+        failed=1
+    fi
+    rm -rf "$work"
+done
+exit $failed
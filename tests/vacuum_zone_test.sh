@@ -0,0 +1,23 @@
+#!/bin/sh
+# Two int fields pack 510 rows per 4KB page, so the second segment starts at
+# row 1048560, inside a 64K-row zone block. VACUUM of that segment must keep
+# the block's rows ahead of it visible to filtered scans.
+BIN=$1
+. "$(dirname "$0")/lib.sh"
+
+odq "CREATE TABLE v (x int noindex, y int noindex)"
+insert_macro v 1050000 'i ", " i'
+odq "USE v" "LOAD v.macro"
+
+odq "USE v" "DELETE FROM v WHERE x = 1049000" "VACUUM"
+expect "VACUUM: 1 deleted rows removed, 1 segment(s) rewritten"
+
+# Once after VACUUM and once from the saved zone map
+for pass in 1 2; do
+    odq "USE v" "SELECT COUNT(*) FROM v WHERE x = 1000000"
+    expect "COUNT: 1"
+    odq "USE v" "SELECT COUNT(*) FROM v WHERE x >= 990000 AND x < 1048560"
+    expect "COUNT: 58560"
+    odq "USE v" "SELECT COUNT(*) FROM v WHERE x > 1048000"
+    expect "COUNT: 1999"
+done